@@ -0,0 +1,134 @@
+#pragma once
+#include <chrono>
+#include <cstdio>
+#include <cstdint>
+#include <vector>
+#include <thread>
+#include <random>
+#include <algorithm>
+#include <atomic>
+#if defined(__linux__)
+#include <sys/resource.h>
+#include <malloc.h>
+#endif
+
+template<int N>
+struct TBenchComponent
+{
+	float x, y, z;
+};
+
+struct FBenchConfig
+{
+	std::vector<uint32_t> EntityCounts = { 1000, 10000, 100000 };
+	std::vector<uint32_t> Widths = { 1, 2, 4, 8 };
+	std::vector<float> RemoveRatios = { 0.1f, 0.5f };
+	std::vector<uint32_t> ThreadCounts = { 1, 4 };
+	uint32_t Repeat = 5;
+	bool RunDe = true;
+	bool RunDe2 = true;
+
+	bool HasWidth(uint32_t width) const
+	{
+		return std::find(Widths.begin(), Widths.end(), width) != Widths.end();
+	}
+};
+
+struct FBenchResult
+{
+	const char* Api;
+	const char* Op;
+	uint32_t Entities;
+	uint32_t Width;
+	float RemoveRatio;
+	uint32_t Threads;
+	// entities touched by the measured operation
+	uint64_t Processed;
+	double ElapsedNs;
+	uint64_t WorldBytes;
+};
+
+class FBenchTimer
+{
+	std::chrono::steady_clock::time_point Start = std::chrono::steady_clock::now();
+
+public:
+	double ElapsedNs() const
+	{
+		return (double)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Start).count();
+	}
+};
+
+// Peak resident set size of the process in KB.
+inline uint64_t GetPeakRssKb()
+{
+#if defined(__linux__)
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		return (uint64_t)usage.ru_maxrss;
+#endif
+	return 0;
+}
+
+// Bytes currently allocated on the heap.
+inline uint64_t GetHeapBytes()
+{
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	auto info = mallinfo2();
+	return (uint64_t)info.uordblks + (uint64_t)info.hblkhd;
+#else
+	return 0;
+#endif
+}
+
+// One JSON object per line.
+inline void Report(const FBenchResult& result)
+{
+	double nsPerEntity = result.Processed ? result.ElapsedNs / (double)result.Processed : 0.0;
+	double entitiesPerSec = result.ElapsedNs > 0.0 ? (double)result.Processed * 1e9 / result.ElapsedNs : 0.0;
+	printf("{\"api\":\"%s\",\"op\":\"%s\",\"entities\":%u,\"width\":%u,\"remove_ratio\":%.2f,\"threads\":%u,"
+		"\"processed\":%llu,\"ns_per_entity\":%.3f,\"entities_per_sec\":%.0f,\"world_bytes\":%llu,\"peak_rss_kb\":%llu}\n",
+		result.Api, result.Op, result.Entities, result.Width, result.RemoveRatio, result.Threads,
+		(unsigned long long)result.Processed, nsPerEntity, entitiesPerSec,
+		(unsigned long long)result.WorldBytes, (unsigned long long)GetPeakRssKb());
+	fflush(stdout);
+}
+
+// Keeps the compiler from dropping the measured reads.
+inline void DoNotOptimize(float value)
+{
+	static std::atomic<float> Sink;
+	Sink.store(value, std::memory_order_relaxed);
+}
+
+// Copy of values in a random order. The same seed gives the same order.
+template<typename T>
+std::vector<T> Shuffled(std::vector<T> values, uint32_t seed)
+{
+	std::mt19937 rng(seed);
+	std::shuffle(values.begin(), values.end(), rng);
+	return values;
+}
+
+// Splits [0, count) into threadCount ranges and runs fn(begin, end) for each on its own thread.
+template<typename F>
+void ParallelFor(uint32_t threadCount, std::size_t count, F fn)
+{
+	if (threadCount <= 1) {
+		fn((std::size_t)0, count);
+		return;
+	}
+	std::vector<std::thread> threads;
+	std::size_t step = (count + threadCount - 1) / threadCount;
+	for (uint32_t t = 0; t < threadCount; ++t) {
+		std::size_t begin = std::min(count, step * t);
+		std::size_t end = std::min(count, begin + step);
+		threads.emplace_back([=]() { fn(begin, end); });
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+}
+
+void RunBenchDe(const FBenchConfig& config);
+void RunBenchDe2(const FBenchConfig& config);
@@ -0,0 +1,185 @@
+#define IMPLEMENT_DOECS
+#include "../doecs.h"
+#include "BenchCommon.h"
+#include <utility>
+
+// Benchmarks for the header only de api (doecs.h).
+
+namespace
+{
+	struct FBenchSystem : public de::System<TBenchComponent<0>>
+	{
+		void Execute(uint32_t count, TBenchComponent<0>* components)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				components[i].x += 1.f;
+			}
+		}
+	};
+
+	struct FBenchClampSystem : public de::System<TBenchComponent<0>>
+	{
+		void Execute(uint32_t count, TBenchComponent<0>* components)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				components[i].x = std::min(components[i].x, 1000.f);
+			}
+		}
+	};
+
+	struct FBenchScaleSystem : public de::System<TBenchComponent<0>>
+	{
+		void Execute(uint32_t count, TBenchComponent<0>* components)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				components[i].y = components[i].x * 0.5f;
+			}
+		}
+	};
+
+	template<typename PoolType, typename ... ComponentTypes>
+	std::vector<de::EntityId> CreateEntities(uint32_t entityCount)
+	{
+		std::vector<de::EntityId> entities;
+		entities.reserve(entityCount);
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			entities.push_back(de::CreateEntity<ComponentTypes...>());
+		}
+		return entities;
+	}
+
+	template<std::size_t ... Is>
+	void RunWidth(const FBenchConfig& config, std::index_sequence<Is...>)
+	{
+		using PoolType = de::impl::ArchetypePool<TBenchComponent<Is>...>;
+		constexpr uint32_t Width = sizeof...(Is);
+		std::tuple<PoolType&> pools = { PoolType::Get() };
+
+		for (auto entityCount : config.EntityCounts) {
+			fprintf(stderr, "de: width %u, %u entities\n", Width, entityCount);
+			FBenchResult result = { "de", "", entityCount, Width, 0.f, 1, entityCount, 0.0, 0 };
+
+			uint64_t heapBefore = GetHeapBytes();
+			de::InitializePools(pools);
+			std::vector<de::EntityId> entities;
+			{
+				FBenchTimer timer;
+				entities = CreateEntities<PoolType, TBenchComponent<Is>...>(entityCount);
+				result.ElapsedNs = timer.ElapsedNs();
+			}
+			uint64_t heapAfter = GetHeapBytes();
+			result.WorldBytes = heapAfter > heapBefore ? heapAfter - heapBefore : 0;
+			result.Op = "CreateEntity";
+			Report(result);
+
+			{
+				FBenchSystem system;
+				FBenchTimer timer;
+				for (uint32_t r = 0; r < config.Repeat; ++r) {
+					de::RunSystem(&system, pools);
+				}
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = (uint64_t)entityCount * config.Repeat;
+				result.Op = "RunSystem";
+				Report(result);
+			}
+			{
+				// Three systems in one pass.
+				FBenchSystem system;
+				FBenchClampSystem clampSystem;
+				FBenchScaleSystem scaleSystem;
+				FBenchTimer timer;
+				for (uint32_t r = 0; r < config.Repeat; ++r) {
+					de::RunSystems(pools, &system, &clampSystem, &scaleSystem);
+				}
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = (uint64_t)entityCount * config.Repeat;
+				result.Op = "RunSystems";
+				Report(result);
+			}
+
+			auto shuffled = Shuffled(entities, entityCount);
+			for (auto threadCount : config.ThreadCounts) {
+				FBenchTimer timer;
+				ParallelFor(threadCount, shuffled.size(), [&](std::size_t begin, std::size_t end) {
+					float sum = 0.f;
+					for (auto i = begin; i < end; ++i) {
+						sum += de::GetComponent<TBenchComponent<0>>(shuffled[i], pools)->x;
+					}
+					DoNotOptimize(sum);
+				});
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = entityCount;
+				result.Threads = threadCount;
+				result.Op = "GetComponent";
+				Report(result);
+			}
+			de::DestroyPools(pools);
+
+			// Single threaded creation is measured above.
+			for (auto threadCount : config.ThreadCounts) {
+				if (threadCount <= 1)
+					continue;
+				de::InitializePools(pools);
+				FBenchTimer timer;
+				ParallelFor(threadCount, entityCount, [&](std::size_t begin, std::size_t end) {
+					for (auto i = begin; i < end; ++i) {
+						de::CreateEntity<TBenchComponent<Is>...>();
+					}
+				});
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = entityCount;
+				result.Threads = threadCount;
+				result.Op = "CreateEntity";
+				Report(result);
+				de::DestroyPools(pools);
+			}
+
+			for (auto removeRatio : config.RemoveRatios) {
+				auto removeCount = (std::size_t)(entityCount * removeRatio);
+				for (auto threadCount : config.ThreadCounts) {
+					de::InitializePools(pools);
+					entities = CreateEntities<PoolType, TBenchComponent<Is>...>(entityCount);
+					auto removing = Shuffled(entities, (uint32_t)entities.size());
+					removing.resize(removeCount);
+
+					result.RemoveRatio = removeRatio;
+					result.Threads = threadCount;
+					result.Processed = removeCount;
+					{
+						FBenchTimer timer;
+						ParallelFor(threadCount, removing.size(), [&](std::size_t begin, std::size_t end) {
+							for (auto i = begin; i < end; ++i) {
+								de::RemoveEntity(removing[i], pools);
+							}
+						});
+						result.ElapsedNs = timer.ElapsedNs();
+						result.Op = "RemoveEntity";
+						Report(result);
+					}
+					{
+						FBenchTimer timer;
+						de::FlushPools(pools);
+						result.ElapsedNs = timer.ElapsedNs();
+						result.Threads = 1;
+						result.Op = "Flush";
+						Report(result);
+					}
+					de::DestroyPools(pools);
+				}
+			}
+		}
+	}
+}
+
+void RunBenchDe(const FBenchConfig& config)
+{
+	if (config.HasWidth(1))
+		RunWidth(config, std::make_index_sequence<1>{});
+	if (config.HasWidth(2))
+		RunWidth(config, std::make_index_sequence<2>{});
+	if (config.HasWidth(4))
+		RunWidth(config, std::make_index_sequence<4>{});
+	if (config.HasWidth(8))
+		RunWidth(config, std::make_index_sequence<8>{});
+}
@@ -0,0 +1,181 @@
+#include "../doecs2.h"
+#include "BenchCommon.h"
+#include <utility>
+#include <memory>
+
+// Benchmarks for the de2 api (doecs2.h).
+
+namespace
+{
+	class FBenchSystem : public de2::ISystem
+	{
+	public:
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(TBenchComponent<0>).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		void Execute(uint32_t entityCount, const de2::ComponentsArg& components) override
+		{
+			auto comps = (TBenchComponent<0>*)components[0];
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				comps[i].x += 1.f;
+			}
+		}
+	};
+
+	class FBenchEvent : public de2::IEvent
+	{
+	public:
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(TBenchComponent<0>).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		void Execute(const de2::ComponentsArg& components) override
+		{
+			((TBenchComponent<0>*)components[0])->y += 1.f;
+		}
+	};
+
+	template<typename ... ComponentTypes>
+	std::vector<de2::EntityId> CreateEntities(de2::DOECS& ecs, uint32_t entityCount)
+	{
+		std::vector<de2::EntityId> entities;
+		entities.reserve(entityCount);
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			entities.push_back(ecs.CreateEntity<ComponentTypes...>());
+		}
+		return entities;
+	}
+
+	template<std::size_t ... Is>
+	void RunWidth(const FBenchConfig& config, std::index_sequence<Is...>)
+	{
+		constexpr uint32_t Width = sizeof...(Is);
+
+		for (auto entityCount : config.EntityCounts) {
+			fprintf(stderr, "de2: width %u, %u entities\n", Width, entityCount);
+			FBenchResult result = { "de2", "", entityCount, Width, 0.f, 1, entityCount, 0.0, 0 };
+
+			uint64_t heapBefore = GetHeapBytes();
+			auto ecs = std::make_unique<de2::DOECS>();
+			ecs->AddPool<TBenchComponent<Is>...>();
+			std::vector<de2::EntityId> entities;
+			{
+				FBenchTimer timer;
+				entities = CreateEntities<TBenchComponent<Is>...>(*ecs, entityCount);
+				result.ElapsedNs = timer.ElapsedNs();
+			}
+			uint64_t heapAfter = GetHeapBytes();
+			result.WorldBytes = heapAfter > heapBefore ? heapAfter - heapBefore : 0;
+			result.Op = "CreateEntity";
+			Report(result);
+
+			{
+				FBenchSystem system;
+				FBenchTimer timer;
+				for (uint32_t r = 0; r < config.Repeat; ++r) {
+					ecs->RunSystem(&system);
+				}
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = (uint64_t)entityCount * config.Repeat;
+				result.Op = "RunSystem";
+				Report(result);
+			}
+
+			auto shuffled = Shuffled(entities, entityCount);
+			for (auto threadCount : config.ThreadCounts) {
+				FBenchTimer timer;
+				ParallelFor(threadCount, shuffled.size(), [&](std::size_t begin, std::size_t end) {
+					float sum = 0.f;
+					for (auto i = begin; i < end; ++i) {
+						sum += ecs->GetComponent<TBenchComponent<0>>(shuffled[i])->x;
+					}
+					DoNotOptimize(sum);
+				});
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = entityCount;
+				result.Threads = threadCount;
+				result.Op = "GetComponent";
+				Report(result);
+			}
+
+			{
+				std::vector<TBenchComponent<0>> values(shuffled.size());
+				FBenchTimer timer;
+				ecs->Gather(shuffled.data(), shuffled.size(), values.data());
+				result.ElapsedNs = timer.ElapsedNs();
+				DoNotOptimize(values[0].x);
+				result.Processed = entityCount;
+				result.Threads = 1;
+				result.Op = "Gather";
+				Report(result);
+			}
+
+			{
+				for (auto entity : shuffled) {
+					ecs->PushEvent(entity, new FBenchEvent);
+				}
+				FBenchTimer timer;
+				ecs->RunEvents();
+				result.ElapsedNs = timer.ElapsedNs();
+				result.Processed = entityCount;
+				result.Threads = 1;
+				result.Op = "RunEvents";
+				Report(result);
+			}
+			ecs.reset();
+
+			for (auto removeRatio : config.RemoveRatios) {
+				auto removeCount = (std::size_t)(entityCount * removeRatio);
+				for (auto threadCount : config.ThreadCounts) {
+					ecs = std::make_unique<de2::DOECS>();
+					ecs->AddPool<TBenchComponent<Is>...>();
+					entities = CreateEntities<TBenchComponent<Is>...>(*ecs, entityCount);
+					auto removing = Shuffled(entities, (uint32_t)entities.size());
+					removing.resize(removeCount);
+
+					result.RemoveRatio = removeRatio;
+					result.Threads = threadCount;
+					result.Processed = removeCount;
+					{
+						FBenchTimer timer;
+						ParallelFor(threadCount, removing.size(), [&](std::size_t begin, std::size_t end) {
+							for (auto i = begin; i < end; ++i) {
+								ecs->RemoveEntity(removing[i]);
+							}
+						});
+						result.ElapsedNs = timer.ElapsedNs();
+						result.Op = "RemoveEntity";
+						Report(result);
+					}
+					{
+						FBenchTimer timer;
+						ecs->Flush(threadCount);
+						result.ElapsedNs = timer.ElapsedNs();
+						result.Op = "Flush";
+						Report(result);
+					}
+					ecs.reset();
+				}
+			}
+		}
+	}
+}
+
+void RunBenchDe2(const FBenchConfig& config)
+{
+	if (config.HasWidth(1))
+		RunWidth(config, std::make_index_sequence<1>{});
+	if (config.HasWidth(2))
+		RunWidth(config, std::make_index_sequence<2>{});
+	if (config.HasWidth(4))
+		RunWidth(config, std::make_index_sequence<4>{});
+	if (config.HasWidth(8))
+		RunWidth(config, std::make_index_sequence<8>{});
+}
@@ -0,0 +1,67 @@
+#include "BenchCommon.h"
+#include <cstring>
+#include <cstdlib>
+#include <string>
+
+// Usage: doecs_bench [--quick] [--api de|de2] [--entities 1000,10000] [--widths 1,2,4,8]
+//                    [--remove 0.1,0.5] [--threads 1,4] [--repeat 5]
+// Results are written to stdout as JSON lines. Progress goes to stderr.
+
+template<typename T>
+static std::vector<T> ParseList(const char* arg)
+{
+	std::vector<T> values;
+	std::string s(arg);
+	std::size_t begin = 0;
+	while (begin <= s.size()) {
+		auto end = s.find(',', begin);
+		if (end == std::string::npos)
+			end = s.size();
+		if (end > begin)
+			values.push_back((T)std::atof(s.substr(begin, end - begin).c_str()));
+		begin = end + 1;
+	}
+	return values;
+}
+
+int main(int argc, char** argv)
+{
+	FBenchConfig config;
+	for (int i = 1; i < argc; ++i) {
+		bool hasValue = i + 1 < argc;
+		if (strcmp(argv[i], "--quick") == 0) {
+			config.EntityCounts = { 1000, 10000 };
+			config.Repeat = 2;
+		}
+		else if (strcmp(argv[i], "--api") == 0 && hasValue) {
+			++i;
+			config.RunDe = strcmp(argv[i], "de") == 0;
+			config.RunDe2 = strcmp(argv[i], "de2") == 0;
+		}
+		else if (strcmp(argv[i], "--entities") == 0 && hasValue) {
+			config.EntityCounts = ParseList<uint32_t>(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--widths") == 0 && hasValue) {
+			config.Widths = ParseList<uint32_t>(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--remove") == 0 && hasValue) {
+			config.RemoveRatios = ParseList<float>(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--threads") == 0 && hasValue) {
+			config.ThreadCounts = ParseList<uint32_t>(argv[++i]);
+		}
+		else if (strcmp(argv[i], "--repeat") == 0 && hasValue) {
+			config.Repeat = (uint32_t)std::atoi(argv[++i]);
+		}
+		else {
+			fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	if (config.RunDe)
+		RunBenchDe(config);
+	if (config.RunDe2)
+		RunBenchDe2(config);
+	return 0;
+}
@@ -19,7 +19,7 @@ struct MovementSystem : public de::System<FPositionComponent>
 class MovementSystem2 : public de2::ISystem
 {	
 public:
-	uint32_t GetComponentHashes(const uint64_t*& pHashes) override
+	std::size_t GetComponentHashes(const uint64_t*& pHashes) override
 	{
 		static const uint64_t ComponentHashes[] = { typeid(FPositionComponent).hash_code() };
 		pHashes = ComponentHashes;
@@ -0,0 +1,66 @@
+// Replaces the global operator new and delete of doecs_tests to count the heap allocations. See test::GetAllocationCount().
+// A translation unit of its own, so the compiler doesn't inline free() into code which it sees calling operator new.
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace
+{
+	std::atomic<uint64_t> AllocationCount = 0;
+}
+
+namespace test
+{
+	uint64_t GetAllocationCount()
+	{
+		return AllocationCount.load();
+	}
+}
+
+void* operator new(std::size_t size)
+{
+	AllocationCount.fetch_add(1, std::memory_order_relaxed);
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment)
+{
+	AllocationCount.fetch_add(1, std::memory_order_relaxed);
+	auto align = (std::size_t)alignment;
+#ifdef _MSC_VER
+	if (auto p = _aligned_malloc(size ? size : 1, align))
+		return p;
+#else
+	// aligned_alloc requires the size to be a multiple of the alignment.
+	if (auto p = std::aligned_alloc(align, size ? (size + align - 1) / align * align : align))
+		return p;
+#endif
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+#ifdef _MSC_VER
+	_aligned_free(p);
+#else
+	std::free(p);
+#endif
+}
+
+void operator delete(void* p, std::size_t, std::align_val_t alignment) noexcept
+{
+	operator delete(p, alignment);
+}
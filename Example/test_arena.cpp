@@ -0,0 +1,160 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Allocations of the last 20 of 40 frames of a game loop: systems, removedCount removals and as many new entities.
+	// The first frames grow the buffers.
+	template<typename RunFrameFn>
+	uint64_t CountFrameAllocations(std::size_t removedCount, RunFrameFn&& runFrame)
+	{
+		de2::DOECS ecs;
+		ecs.AddPool<FPositionComponent, FLifeformComponent>();
+		ecs.AddPool<FRotationComponent>();
+		test::LambdaSystem<FPositionComponent, FLifeformComponent> system([](uint32_t count, const de2::ComponentsArg& components) {
+			auto positions = (FPositionComponent*)components[0];
+			auto scratch = de2::GetFrameArena().Allocate<float>(count);
+			for (uint32_t i = 0; i < count; ++i) {
+				scratch[i] = positions[i].x;
+				positions[i].y += scratch[i];
+			}
+		});
+		ecs.AddSystem(&system);
+		std::vector<de2::EntityId> entities;
+		entities.reserve(40000);
+		for (int i = 0; i < 10000; ++i) {
+			entities.push_back(ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f }, FLifeformComponent{}));
+			entities.push_back(ecs.AddEntity(FRotationComponent{}));
+		}
+
+		uint64_t allocations = 0;
+		for (int frame = 0; frame < 40; ++frame) {
+			auto before = test::GetAllocationCount();
+			// The oldest entities, half of them in each pool.
+			for (std::size_t i = 0; i < removedCount; ++i) {
+				ecs.RemoveEntity(entities[i]);
+			}
+			runFrame(ecs);
+			entities.erase(entities.begin(), entities.begin() + removedCount);
+			for (std::size_t i = 0; i < removedCount / 2; ++i) {
+				entities.push_back(ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f }, FLifeformComponent{}));
+				entities.push_back(ecs.AddEntity(FRotationComponent{}));
+			}
+			if (frame >= 20)
+				allocations += test::GetAllocationCount() - before;
+		}
+		return allocations;
+	}
+}
+
+// The allocation counter sees plain and over-aligned allocations, or the tests below would pass without counting.
+// Direct calls, because the compiler may drop a new-expression paired with its delete.
+TEST_CASE(Arena_CountsAllocations)
+{
+	auto before = test::GetAllocationCount();
+	auto value = ::operator new(16);
+	auto block = ::operator new(256, std::align_val_t(256));
+	CHECK(test::GetAllocationCount() - before == 2);
+	CHECK((uintptr_t)block % 256 == 0);
+	::operator delete(value);
+	::operator delete(block, std::align_val_t(256));
+}
+
+TEST_CASE(Arena_SteadySyncFramesDontAllocate)
+{
+	auto allocations = CountFrameAllocations(1000, [](de2::DOECS& ecs) {
+		ecs.RunSystems();
+		ecs.RunEvents();
+		ecs.Flush();
+		ecs.EndFrame();
+	});
+	CHECK(allocations == 0);
+}
+
+TEST_CASE(Arena_SteadyAsyncFramesDontAllocate)
+{
+	auto allocations = CountFrameAllocations(1000, [](de2::DOECS& ecs) {
+		ecs.RunSystemsAsync().Wait();
+	});
+	CHECK(allocations == 0);
+}
+
+TEST_CASE(Arena_ParallelFlushDoesntAllocate)
+{
+	static_assert(de2::impl::MinParallelFlushCount <= 6000, "The flush must take the parallel path.");
+	auto allocations = CountFrameAllocations(6000, [](de2::DOECS& ecs) {
+		ecs.RunSystems();
+		ecs.RunEvents();
+		ecs.Flush(4);
+		ecs.EndFrame();
+	});
+	CHECK(allocations == 0);
+}
+
+// Flush() and MergeInto() release only what they allocated in the arena of the calling thread.
+TEST_CASE(Arena_FlushKeepsCallerAllocations)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 20000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{}));
+	}
+	auto& arena = de2::GetFrameArena();
+	arena.Reset();
+	auto values = arena.Allocate<uint32_t>(1000);
+	for (uint32_t i = 0; i < 1000; ++i) {
+		values[i] = i;
+	}
+	auto usedBytes = arena.GetUsedBytes();
+
+	for (std::size_t i = 0; i < entities.size(); i += 2) {
+		ecs.RemoveEntity(entities[i]);
+	}
+	ecs.Flush(4);
+	CHECK(arena.GetUsedBytes() == usedBytes);
+	de2::DOECS level;
+	level.AddPool<FPositionComponent>();
+	for (int i = 0; i < 100; ++i) {
+		level.RemoveEntity(level.AddEntity(FPositionComponent{}));
+	}
+	level.MergeInto(ecs);
+	CHECK(arena.GetUsedBytes() == usedBytes);
+	// What the flushes allocated was rewound, so the next allocation follows the values.
+	CHECK(arena.Allocate<uint32_t>(1) == values + 1000);
+	for (uint32_t i = 0; i < 1000; ++i) {
+		CHECK(values[i] == i);
+	}
+	ecs.EndFrame();
+	CHECK(arena.GetUsedBytes() == 0);
+}
+
+// A reader thread which runs systems on snapshots and never resets its arena doesn't grow it.
+TEST_CASE(Arena_SnapshotReaderDoesntGrow)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	for (int i = 0; i < 5000; ++i) {
+		ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f }, FRotationComponent{});
+	}
+	float sum = 0.f;
+	test::LambdaSystem<FPositionComponent> reader([&sum](uint32_t count, const de2::ComponentsArg& components) {
+		auto positions = (const FPositionComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			sum += positions[i].x;
+		}
+	});
+	std::size_t usedBytes[2] = {};
+	std::thread render([&]() {
+		for (int frame = 0; frame < 200; ++frame) {
+			auto snapshot = ecs.Snapshot();
+			snapshot.RunSystem(&reader);
+			if (frame == 0)
+				usedBytes[0] = de2::GetFrameArena().GetUsedBytes();
+		}
+		usedBytes[1] = de2::GetFrameArena().GetUsedBytes();
+	});
+	render.join();
+	CHECK(sum == 200.f * 5000.f);
+	CHECK(usedBytes[0] == 0 && usedBytes[1] == 0);
+}
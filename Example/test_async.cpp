@@ -0,0 +1,175 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	class SpinEvent : public de2::IEvent
+	{
+	public:
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(FRotationComponent).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		void Execute(const de2::ComponentsArg& components) override
+		{
+			((FRotationComponent*)components[0])->w += 1.f;
+		}
+	};
+
+	// Fails the test if two threads are in the callbacks at once.
+	class LifeformObserver : public de2::IObserver
+	{
+		std::atomic<int> Inside = 0;
+
+		void Enter()
+		{
+			if (Inside.fetch_add(1) != 0)
+				Overlapped = true;
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+		}
+
+	public:
+		uint32_t AddedCount = 0;
+		uint32_t RemovedCount = 0;
+		bool Overlapped = false;
+
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(FLifeformComponent).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		void OnAdd(uint32_t entityCount, const de2::EntityId*, const de2::ComponentsArg&) override
+		{
+			Enter();
+			AddedCount += entityCount;
+			Inside.fetch_sub(1);
+		}
+
+		void OnRemove(uint32_t entityCount, const de2::EntityId*, const de2::ComponentsArg&) override
+		{
+			Enter();
+			RemovedCount += entityCount;
+			Inside.fetch_sub(1);
+		}
+	};
+}
+
+// The systems remove entities of a pool they don't match and push events to it while that pool is flushed.
+TEST_CASE(Async_RemoveAndPushEventToUntouchedPool)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FLifeformComponent>();
+	ecs.AddPool<FRotationComponent, FLifeformComponent>();
+	LifeformObserver observer;
+	ecs.AddObserver(&observer);
+	std::vector<de2::EntityId> movers;
+	std::vector<de2::EntityId> spinners;
+	for (uint32_t i = 0; i < 1000; ++i) {
+		movers.push_back(ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ i, i }));
+		spinners.push_back(ecs.AddEntity(FRotationComponent{}, FLifeformComponent{ i, i }));
+	}
+	ecs.Flush();
+	CHECK(observer.AddedCount == 2000);
+
+	constexpr uint32_t FrameCount = 10;
+	constexpr uint32_t RemovedPerFrame = 20;
+	uint32_t frameIndex = 0;
+	bool frameDone = false;
+	test::LambdaSystem<FPositionComponent> system([&](uint32_t, const de2::ComponentsArg&) {
+		// Once per frame, from the first chunk.
+		if (frameDone)
+			return;
+		frameDone = true;
+		for (uint32_t i = 0; i < RemovedPerFrame; ++i) {
+			CHECK(ecs.RemoveEntity(spinners[frameIndex * RemovedPerFrame + i]));
+			CHECK(ecs.RemoveEntity(movers[frameIndex * RemovedPerFrame + i]));
+		}
+		for (uint32_t i = 500; i < 1000; ++i) {
+			CHECK(ecs.PushEvent(spinners[i], new SpinEvent));
+		}
+		++frameIndex;
+	});
+	ecs.AddSystem(&system);
+
+	for (uint32_t frame = 0; frame < FrameCount; ++frame) {
+		// Events pushed between frames run in the untouched worker, concurrently with the system.
+		for (uint32_t i = 900; i < 1000; ++i) {
+			ecs.PushEvent(spinners[i], new SpinEvent);
+		}
+		frameDone = false;
+		auto handle = ecs.RunSystemsAsync();
+		handle.Wait();
+	}
+
+	CHECK(!observer.Overlapped);
+	CHECK(observer.RemovedCount == 2 * FrameCount * RemovedPerFrame);
+	std::vector<de2::PoolStats> stats;
+	ecs.GetPoolStats(stats);
+	CHECK(stats.size() == 2);
+	for (auto& pool : stats) {
+		CHECK(pool.EntityCount == 1000 - FrameCount * RemovedPerFrame);
+	}
+	for (uint32_t i = 0; i < 1000; ++i) {
+		auto rotation = ecs.GetComponent<FRotationComponent>(spinners[i]);
+		CHECK((rotation == nullptr) == (i < FrameCount * RemovedPerFrame));
+		if (rotation)
+			CHECK(rotation->w == (i >= 900 ? 2.f * FrameCount : i >= 500 ? 1.f * FrameCount : 0.f));
+	}
+	ecs.RemoveObserver(&observer);
+}
+
+// An async frame gives the same world as RunSystems(), RunEvents() and Flush().
+TEST_CASE(Async_MatchesSyncFrame)
+{
+	de2::DOECS worlds[2];
+	std::vector<de2::EntityId> entities[2];
+	test::LambdaSystem<FPositionComponent> mover([](uint32_t count, const de2::ComponentsArg& components) {
+		auto positions = (FPositionComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			positions[i].x += 1.f;
+		}
+	});
+	for (int w = 0; w < 2; ++w) {
+		worlds[w].AddPool<FPositionComponent>();
+		worlds[w].AddPool<FRotationComponent>();
+		for (int i = 0; i < 3000; ++i) {
+			entities[w].push_back(worlds[w].AddEntity(FPositionComponent{}));
+			entities[w].push_back(worlds[w].AddEntity(FRotationComponent{}));
+		}
+		worlds[w].AddSystem(&mover);
+	}
+
+	for (int frame = 0; frame < 4; ++frame) {
+		for (int w = 0; w < 2; ++w) {
+			// Odd entities have a rotation.
+			for (std::size_t i = frame; i < entities[w].size(); i += 7) {
+				worlds[w].RemoveEntity(entities[w][i]);
+				auto evt = new SpinEvent;
+				if (!worlds[w].PushEvent(entities[w][i | 1], evt))
+					delete evt;
+			}
+		}
+		worlds[0].RunSystems();
+		worlds[0].RunEvents();
+		worlds[0].Flush();
+		worlds[1].RunSystemsAsync().Wait();
+	}
+
+	for (std::size_t i = 0; i < entities[0].size(); ++i) {
+		auto syncPos = worlds[0].GetComponent<FPositionComponent>(entities[0][i]);
+		auto asyncPos = worlds[1].GetComponent<FPositionComponent>(entities[1][i]);
+		CHECK((syncPos == nullptr) == (asyncPos == nullptr));
+		if (syncPos && asyncPos)
+			CHECK(syncPos->x == asyncPos->x);
+		auto syncRot = worlds[0].GetComponent<FRotationComponent>(entities[0][i]);
+		auto asyncRot = worlds[1].GetComponent<FRotationComponent>(entities[1][i]);
+		CHECK((syncRot == nullptr) == (asyncRot == nullptr));
+		if (syncRot && asyncRot)
+			CHECK(syncRot->w == asyncRot->w);
+	}
+}
@@ -0,0 +1,128 @@
+#include "test_runner.h"
+#include "Components.h"
+
+TEST_CASE(Batch_GatherAcrossPools)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	ecs.AddPool<FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 1000; ++i) {
+		if (i % 3 == 0)
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+		else if (i % 3 == 1)
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{}));
+		else
+			entities.push_back(ecs.AddEntity(FRotationComponent{}));
+	}
+	entities.push_back(de2::INVALID_ENTITY_ID - 1);
+
+	std::vector<FPositionComponent> positions(entities.size(), FPositionComponent{ -1.f, -1.f, -1.f });
+	CHECK(ecs.Gather(entities.data(), entities.size(), positions.data()) == 667);
+	for (int i = 0; i < 1000; ++i) {
+		CHECK(positions[i].x == (i % 3 == 2 ? -1.f : (float)i));
+	}
+	CHECK(positions.back().x == -1.f);
+}
+
+TEST_CASE(Batch_ScatterThenGather)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 5000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{}, FRotationComponent{}));
+	}
+	std::reverse(entities.begin(), entities.end());
+	std::vector<FPositionComponent> values(entities.size());
+	for (std::size_t i = 0; i < values.size(); ++i) {
+		values[i] = FPositionComponent{ (float)i, (float)i * 2.f, 0.f };
+	}
+	CHECK(ecs.Scatter(entities.data(), entities.size(), values.data()) == 5000);
+	for (std::size_t i = 0; i < entities.size(); i += 97) {
+		CHECK(ecs.GetComponent<FPositionComponent>(entities[i])->y == (float)i * 2.f);
+	}
+	std::vector<FPositionComponent> gathered(entities.size());
+	CHECK(ecs.Gather(entities.data(), entities.size(), gathered.data()) == 5000);
+	CHECK(std::equal(gathered.begin(), gathered.end(), values.begin(), [](const FPositionComponent& a, const FPositionComponent& b) {
+		return a.x == b.x && a.y == b.y;
+	}));
+}
+
+// Requests which jump between the chunks. Each value goes to its own entity, and the last of duplicate Scatter requests wins.
+TEST_CASE(Batch_ShuffledRequestsWithDuplicates)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (uint32_t i = 0; i < 5000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{}));
+	}
+	// Request j is entity j * 7919 % 5000, which jumps between the chunks. Every tenth entity is requested again at the end.
+	std::vector<de2::EntityId> requested;
+	std::vector<uint32_t> keys;
+	for (uint32_t j = 0; j < 5000; ++j) {
+		keys.push_back(j * 7919 % 5000);
+	}
+	for (uint32_t j = 0; j < 5000; j += 10) {
+		keys.push_back(keys[j]);
+	}
+	for (auto key : keys) {
+		requested.push_back(entities[key]);
+	}
+
+	std::vector<FPositionComponent> gathered(requested.size());
+	CHECK(ecs.Gather(requested.data(), requested.size(), gathered.data()) == requested.size());
+	bool gatheredAll = true;
+	for (std::size_t j = 0; j < keys.size(); ++j) {
+		gatheredAll = gatheredAll && gathered[j].x == (float)keys[j];
+	}
+	CHECK(gatheredAll);
+
+	// Value j is j, so a duplicate keeps the index of its second request.
+	std::vector<FPositionComponent> values(requested.size());
+	for (std::size_t j = 0; j < values.size(); ++j) {
+		values[j] = FPositionComponent{ 0.f, (float)j, 0.f };
+	}
+	CHECK(ecs.Scatter(requested.data(), requested.size(), values.data()) == requested.size());
+	bool scatteredAll = true;
+	for (std::size_t j = 0; j < 5000; ++j) {
+		auto expected = j % 10 == 0 ? 5000 + j / 10 : j;
+		scatteredAll = scatteredAll && ecs.ReadComponent<FPositionComponent>(requested[j])->y == (float)expected;
+	}
+	CHECK(scatteredAll);
+}
+
+// Scatter detaches the snapshotted chunks, which rewrites the index entries of their rows.
+// Entity counts around the load factor of the index, where a rewrite used to grow it under a live iterator.
+TEST_CASE(Batch_ScatterOnSnapshotAtLoadBoundaries)
+{
+	for (uint32_t boundary = 12; boundary <= 3 * 1024; boundary *= 2) {
+		for (auto entityCount : { boundary - 1, boundary, boundary + 1 }) {
+			de2::DOECS ecs;
+			ecs.AddPool<FPositionComponent>();
+			std::vector<de2::EntityId> entities;
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				entities.push_back(ecs.AddEntity(FPositionComponent{ 0.f, 0.f, 0.f }));
+			}
+			auto snapshot = ecs.Snapshot();
+			std::vector<FPositionComponent> values(entityCount, FPositionComponent{ 1.f, 2.f, 3.f });
+			CHECK(ecs.Scatter(entities.data(), entities.size(), values.data()) == entityCount);
+			for (auto entity : entities) {
+				CHECK(ecs.GetComponent<FPositionComponent>(entity)->y == 2.f);
+			}
+
+			uint32_t snapshotCount = 0;
+			for (uint32_t c = 0; c < snapshot.GetChunkCount(0); ++c) {
+				const void* components = nullptr;
+				auto rowCount = snapshot.GetComponents(0, c, typeid(FPositionComponent).hash_code(), components);
+				CHECK(std::all_of((const FPositionComponent*)components, (const FPositionComponent*)components + rowCount, [](const FPositionComponent& pos) {
+					return pos.y == 0.f;
+				}));
+				snapshotCount += rowCount;
+			}
+			CHECK(snapshotCount == entityCount);
+		}
+	}
+}
@@ -0,0 +1,198 @@
+#include "test_runner.h"
+#include "Components.h"
+
+// The same blackboard kept in the chunk and kept as a cold component.
+struct FHotTestBlackboard
+{
+	uint32_t Values[48];
+};
+
+struct FColdTestBlackboard
+{
+	uint32_t Values[48];
+};
+DeclareColdComponent(FColdTestBlackboard);
+
+namespace
+{
+	FColdTestBlackboard MakeBlackboard(uint32_t key)
+	{
+		FColdTestBlackboard blackboard;
+		for (uint32_t i = 0; i < 48; ++i) {
+			blackboard.Values[i] = key * 48 + i;
+		}
+		return blackboard;
+	}
+
+	bool IsBlackboardOf(const FColdTestBlackboard* blackboard, uint32_t key)
+	{
+		return blackboard && std::memcmp(blackboard->Values, MakeBlackboard(key).Values, sizeof(blackboard->Values)) == 0;
+	}
+
+	// Entity i has position x == i and the blackboard of key i.
+	std::vector<de2::EntityId> BuildColdPool(de2::DOECS& ecs, uint32_t entityCount)
+	{
+		ecs.AddPool<FPositionComponent, FColdTestBlackboard>();
+		std::vector<de2::EntityId> entities;
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, MakeBlackboard(i)));
+		}
+		return entities;
+	}
+
+	// The hot and the cold component of a row stay together when rows move.
+	template<typename IsRemovedFn>
+	bool CheckEntities(de2::DOECS& ecs, const std::vector<de2::EntityId>& entities, IsRemovedFn isRemoved)
+	{
+		for (uint32_t i = 0; i < entities.size(); ++i) {
+			auto pos = ecs.ReadComponent<FPositionComponent>(entities[i]);
+			auto blackboard = ecs.ReadComponent<FColdTestBlackboard>(entities[i]);
+			if ((pos == nullptr) != isRemoved(i) || (blackboard == nullptr) != isRemoved(i))
+				return false;
+			if (pos && (pos->x != (float)i || !IsBlackboardOf(blackboard, i)))
+				return false;
+		}
+		return true;
+	}
+
+	bool CheckEntities(de2::DOECS& ecs, const std::vector<de2::EntityId>& entities)
+	{
+		return CheckEntities(ecs, entities, [](uint32_t) { return false; });
+	}
+
+	de2::PoolStats GetStats(de2::DOECS& ecs)
+	{
+		std::vector<de2::PoolStats> stats;
+		ecs.GetPoolStats(stats);
+		return stats[0];
+	}
+}
+
+// Only the hot components set the entity count per chunk.
+TEST_CASE(Cold_ChunkHoldsMoreEntities)
+{
+	de2::DOECS hotEcs;
+	hotEcs.AddPool<FPositionComponent, FHotTestBlackboard>();
+	de2::DOECS coldEcs;
+	coldEcs.AddPool<FPositionComponent, FColdTestBlackboard>();
+	de2::DOECS positionEcs;
+	positionEcs.AddPool<FPositionComponent>();
+
+	auto hotCount = GetStats(hotEcs).EntityCountPerChunk;
+	auto coldCount = GetStats(coldEcs).EntityCountPerChunk;
+	auto positionCount = GetStats(positionEcs).EntityCountPerChunk;
+	CHECK(coldCount > hotCount * 5);
+	// The chunk header grows by the pointer to the cold array.
+	CHECK(coldCount <= positionCount && coldCount + 1 >= positionCount);
+}
+
+// Removed rows are filled by Flush and compacted by Defragment with their cold components.
+TEST_CASE(Cold_FlushAndDefragment)
+{
+	auto isRemoved = [](uint32_t i) { return i % 3 == 0 || (i / 500) % 4 == 1; };
+	de2::DOECS ecs;
+	auto entities = BuildColdPool(ecs, 20000);
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		if (isRemoved(i))
+			ecs.RemoveEntity(entities[i]);
+	}
+	ecs.Flush();
+	CHECK(CheckEntities(ecs, entities, isRemoved));
+
+	auto before = GetStats(ecs);
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	auto after = GetStats(ecs);
+	CHECK(after.EntityCount == before.EntityCount);
+	CHECK(after.ChunkCount == (after.EntityCount + after.EntityCountPerChunk - 1) / after.EntityCountPerChunk);
+	CHECK(after.ChunkCount < before.ChunkCount);
+	CHECK(CheckEntities(ecs, entities, isRemoved));
+}
+
+TEST_CASE(Cold_SortPool)
+{
+	de2::DOECS ecs;
+	auto entities = BuildColdPool(ecs, 20000);
+	// Reverses the rows.
+	CHECK(ecs.SortPool<FPositionComponent, FColdTestBlackboard>([](const FPositionComponent& pos, const FColdTestBlackboard&) {
+		return -pos.x;
+	}));
+	std::vector<float> order;
+	ecs.ForEach<FPositionComponent>([&order](de2::EntityId, FPositionComponent& pos) {
+		order.push_back(pos.x);
+	});
+	CHECK(order.size() == entities.size());
+	CHECK(std::is_sorted(order.rbegin(), order.rend()));
+	CHECK(CheckEntities(ecs, entities));
+}
+
+TEST_CASE(Cold_GatherScatter)
+{
+	de2::DOECS ecs;
+	auto entities = BuildColdPool(ecs, 5000);
+	std::vector<de2::EntityId> requested;
+	for (uint32_t i = 0; i < entities.size(); i += 7) {
+		requested.push_back(entities[i]);
+	}
+	std::reverse(requested.begin(), requested.end());
+
+	std::vector<FColdTestBlackboard> values(requested.size());
+	CHECK(ecs.Gather(requested.data(), requested.size(), values.data()) == requested.size());
+	bool gathered = true;
+	for (uint32_t i = 0; i < values.size(); ++i) {
+		gathered = gathered && IsBlackboardOf(&values[i], (uint32_t)(entities.size() - 1) / 7 * 7 - i * 7);
+	}
+	CHECK(gathered);
+
+	// Scatter writes the blackboard of key i + 1 to entity i.
+	for (uint32_t i = 0; i < values.size(); ++i) {
+		values[i] = MakeBlackboard((uint32_t)(entities.size() - 1) / 7 * 7 - i * 7 + 1);
+	}
+	CHECK(ecs.Scatter(requested.data(), requested.size(), values.data()) == requested.size());
+	bool scattered = true;
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		auto key = i % 7 == 0 ? i + 1 : i;
+		scattered = scattered && IsBlackboardOf(ecs.ReadComponent<FColdTestBlackboard>(entities[i]), key);
+	}
+	CHECK(scattered);
+}
+
+// Writes after the snapshot detach the chunk, cold array included.
+TEST_CASE(Cold_Snapshot)
+{
+	de2::DOECS ecs;
+	auto entities = BuildColdPool(ecs, 3000);
+	auto snapshot = ecs.Snapshot();
+
+	ecs.SetComponent(entities[0], MakeBlackboard(100000));
+	test::LambdaSystem<FColdTestBlackboard> system([](uint32_t entityCount, const de2::ComponentsArg& components) {
+		auto blackboards = (FColdTestBlackboard*)components[0];
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			blackboards[i].Values[0] += 1;
+		}
+	});
+	ecs.RunSystem(&system);
+
+	bool unchanged = true;
+	uint32_t count = 0;
+	for (std::size_t p = 0; p < snapshot.GetPoolCount(); ++p) {
+		for (uint32_t c = 0; c < snapshot.GetChunkCount(p); ++c) {
+			const void* components = nullptr;
+			const de2::EntityId* chunkEntities = nullptr;
+			auto rowCount = snapshot.GetComponents(p, c, typeid(FColdTestBlackboard).hash_code(), components);
+			snapshot.GetEntities(p, c, chunkEntities);
+			auto blackboards = (const FColdTestBlackboard*)components;
+			for (uint32_t i = 0; i < rowCount; ++i) {
+				auto key = (uint32_t)(std::find(entities.begin(), entities.end(), chunkEntities[i]) - entities.begin());
+				unchanged = unchanged && IsBlackboardOf(&blackboards[i], key);
+			}
+			count += rowCount;
+		}
+	}
+	CHECK(unchanged);
+	CHECK(count == entities.size());
+
+	auto blackboard = ecs.ReadComponent<FColdTestBlackboard>(entities[0]);
+	CHECK(blackboard && blackboard->Values[0] == 100000 * 48 + 1);
+	blackboard = ecs.ReadComponent<FColdTestBlackboard>(entities[1]);
+	CHECK(blackboard && blackboard->Values[0] == 48 + 1);
+}
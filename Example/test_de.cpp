@@ -0,0 +1,406 @@
+// Tests of the header only de api (doecs.h).
+#define IMPLEMENT_DOECS
+#include "test_runner.h"
+#include "../doecs.h"
+#include <thread>
+
+namespace
+{
+	struct FDeValue
+	{
+		de::EntityId Owner;
+	};
+
+	struct FDeSpeed
+	{
+		float Value;
+	};
+
+	struct FDePosition
+	{
+		float Value;
+	};
+
+	struct FDeWeapon
+	{
+		int Ammo;
+	};
+
+	DeclareEntityArchetypePool(FDeCreatePool, FDeValue, FDeSpeed);
+	DeclareEntityArchetypePool(FDeRemovePool, FDeValue, FDeSpeed);
+	DeclareEntityArchetypePool(FDeMovePool, FDeValue, FDeSpeed, FDePosition);
+	DeclareEntityArchetypePool(FDeArmedPool, FDeValue, FDeSpeed, FDePosition, FDeWeapon);
+	DeclareEntityArchetypePool(FDeStillPool, FDeValue, FDePosition);
+	using FDeSystemPools = std::tuple<FDeMovePool&, FDeArmedPool&, FDeStillPool&>;
+
+	// Row count of every chunk and the owners of all rows.
+	struct FDeRowSystem : de::System<FDeValue>
+	{
+		std::vector<uint32_t> ChunkRowCounts;
+		std::vector<de::EntityId> Owners;
+
+		void Execute(uint32_t count, FDeValue* values)
+		{
+			ChunkRowCounts.push_back(count);
+			for (uint32_t i = 0; i < count; ++i) {
+				Owners.push_back(values[i].Owner);
+			}
+		}
+	};
+
+	// Owners of the rows of the pools without a weapon.
+	struct FDeUnarmedSystem : de::System<FDeValue>
+	{
+		using ExcludedTuple = std::tuple<FDeWeapon>;
+		std::vector<de::EntityId> Owners;
+
+		void Execute(uint32_t count, FDeValue* values)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				Owners.push_back(values[i].Owner);
+			}
+		}
+	};
+
+	// Owners of the rows with and without a speed.
+	struct FDeOptionalSpeedSystem : de::System<FDeValue>
+	{
+		using OptionalTuple = std::tuple<FDeSpeed>;
+		std::vector<de::EntityId> WithSpeed;
+		std::vector<de::EntityId> WithoutSpeed;
+		uint32_t WrongSpeedCount = 0;
+
+		void Execute(uint32_t count, FDeValue* values, FDeSpeed* speeds)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				(speeds ? WithSpeed : WithoutSpeed).push_back(values[i].Owner);
+				if (speeds && speeds[i].Value != 1.f)
+					++WrongSpeedCount;
+			}
+		}
+	};
+
+	struct FDeIntegrateSystem : de::System<FDeSpeed, FDePosition>
+	{
+		void Execute(uint32_t count, FDeSpeed* speeds, FDePosition* positions)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				positions[i].Value += speeds[i].Value;
+			}
+		}
+	};
+
+	struct FDeDoubleSystem : de::System<FDePosition>
+	{
+		void Execute(uint32_t count, FDePosition* positions)
+		{
+			for (uint32_t i = 0; i < count; ++i) {
+				positions[i].Value *= 2.f;
+			}
+		}
+	};
+
+	template<typename PoolsType>
+	de::EntityId CreateOwnedEntity(PoolsType& pools)
+	{
+		auto entity = de::CreateEntity<FDeValue, FDeSpeed>();
+		de::GetComponent<FDeValue>(entity, pools)->Owner = entity;
+		return entity;
+	}
+
+	// Every alive entity maps to its own row, and the rows hold exactly the alive entities.
+	template<typename PoolsType>
+	bool CheckOwners(PoolsType& pools, const std::vector<de::EntityId>& alive, const std::vector<de::EntityId>& removed)
+	{
+		for (auto entity : alive) {
+			auto value = de::GetComponent<FDeValue>(entity, pools);
+			if (!value || value->Owner != entity)
+				return false;
+		}
+		for (auto entity : removed) {
+			if (de::GetComponent<FDeValue>(entity, pools))
+				return false;
+		}
+		FDeRowSystem system;
+		de::RunSystem(&system, pools);
+		std::vector<de::EntityId> sortedAlive(alive);
+		std::sort(sortedAlive.begin(), sortedAlive.end());
+		std::sort(system.Owners.begin(), system.Owners.end());
+		return sortedAlive == system.Owners;
+	}
+}
+
+// Threads create entities and look up, write and remove their own and older entities at the same time.
+TEST_CASE(DeCreate_ConcurrentCreateAndGetComponent)
+{
+	std::tuple<FDeCreatePool&> pools = { FDeCreatePool::Get() };
+	de::InitializePools(pools);
+	std::vector<de::EntityId> existing;
+	for (int i = 0; i < 1000; ++i) {
+		existing.push_back(de::CreateEntity<FDeValue, FDeSpeed>());
+		de::GetComponent<FDeValue>(existing.back(), pools)->Owner = existing.back();
+	}
+
+	constexpr uint32_t ThreadCount = 4;
+	constexpr uint32_t EntityCountPerThread = 20000;
+	std::vector<de::EntityId> created[ThreadCount];
+	std::atomic<uint32_t> failureCount = 0;
+	std::vector<std::thread> threads;
+	for (uint32_t t = 0; t < ThreadCount; ++t) {
+		threads.emplace_back([&, t]() {
+			for (uint32_t i = 0; i < EntityCountPerThread; ++i) {
+				auto entity = de::CreateEntity<FDeValue, FDeSpeed>();
+				auto value = de::GetComponent<FDeValue>(entity, pools);
+				if (!value) {
+					++failureCount;
+					continue;
+				}
+				value->Owner = entity;
+				created[t].push_back(entity);
+				auto old = existing[(i * 7 + t) % existing.size()];
+				auto oldValue = de::GetComponent<FDeValue>(old, pools);
+				if (!oldValue || oldValue->Owner != old)
+					++failureCount;
+				// Every tenth entity of the thread is removed at Flush.
+				if (i % 10 == 0 && !FDeCreatePool::Get().RemoveEntity(entity))
+					++failureCount;
+			}
+		});
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+	CHECK(failureCount == 0);
+
+	de::FlushPools(pools);
+	std::vector<de::EntityId> all(existing);
+	for (uint32_t t = 0; t < ThreadCount; ++t) {
+		CHECK(created[t].size() == EntityCountPerThread);
+		for (uint32_t i = 0; i < created[t].size(); ++i) {
+			auto value = de::GetComponent<FDeValue>(created[t][i], pools);
+			CHECK((value == nullptr) == (i % 10 == 0));
+			if (value)
+				CHECK(value->Owner == created[t][i]);
+		}
+		all.insert(all.end(), created[t].begin(), created[t].end());
+	}
+	std::sort(all.begin(), all.end());
+	CHECK(std::adjacent_find(all.begin(), all.end()) == all.end());
+	de::DestroyPools(pools);
+}
+
+// Removed rows in every chunk are filled from the tail of the pool, which moves rows across chunk boundaries.
+TEST_CASE(DeRemove_AcrossChunkBoundaries)
+{
+	std::tuple<FDeRemovePool&> pools = { FDeRemovePool::Get() };
+	de::InitializePools(pools);
+	constexpr uint32_t RowCount = FDeRemovePool::ElementCountPerChunk;
+	std::vector<de::EntityId> entities;
+	for (uint32_t i = 0; i < RowCount * 3 + 17; ++i) {
+		entities.push_back(CreateOwnedEntity(pools));
+	}
+
+	// First and last rows of the chunks, rows in the middle and rows of the tail chunk which are also moved.
+	std::vector<de::EntityId> alive;
+	std::vector<de::EntityId> removed;
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		auto row = i % RowCount;
+		bool remove = row == 0 || row == RowCount - 1 || i % 5 == 0 || i >= RowCount * 3 + 10;
+		(remove ? removed : alive).push_back(entities[i]);
+	}
+	for (auto entity : removed) {
+		de::RemoveEntity(entity, pools);
+	}
+	de::FlushPools(pools);
+	CHECK(CheckOwners(pools, alive, removed));
+
+	FDeRowSystem system;
+	de::RunSystem(&system, pools);
+	// Every chunk but the last is full.
+	for (size_t i = 0; i + 1 < system.ChunkRowCounts.size(); ++i) {
+		CHECK(system.ChunkRowCounts[i] == RowCount);
+	}
+	CHECK(system.ChunkRowCounts.size() == (alive.size() + RowCount - 1) / RowCount);
+
+	// Rows moved by the first Flush are moved again correctly.
+	std::vector<de::EntityId> stillAlive;
+	for (uint32_t i = 0; i < alive.size(); ++i) {
+		(i % 3 == 0 ? removed : stillAlive).push_back(alive[i]);
+	}
+	for (uint32_t i = 0; i < alive.size(); i += 3) {
+		de::RemoveEntity(alive[i], pools);
+	}
+	de::FlushPools(pools);
+	CHECK(CheckOwners(pools, stillAlive, removed));
+	de::DestroyPools(pools);
+}
+
+// Removing the rows of the tail chunk frees it. The pool grows again from the new tail.
+TEST_CASE(DeRemove_ShrinkToEmptyTailChunk)
+{
+	std::tuple<FDeRemovePool&> pools = { FDeRemovePool::Get() };
+	de::InitializePools(pools);
+	constexpr uint32_t RowCount = FDeRemovePool::ElementCountPerChunk;
+	std::vector<de::EntityId> alive;
+	for (uint32_t i = 0; i < RowCount + 1; ++i) {
+		alive.push_back(CreateOwnedEntity(pools));
+	}
+	auto countChunks = [&]() {
+		FDeRowSystem system;
+		de::RunSystem(&system, pools);
+		return system.ChunkRowCounts.size();
+	};
+	CHECK(countChunks() == 2);
+
+	// The only row of the tail chunk.
+	std::vector<de::EntityId> removed = { alive.back() };
+	alive.pop_back();
+	de::RemoveEntity(removed.back(), pools);
+	de::FlushPools(pools);
+	CHECK(countChunks() == 1);
+	CHECK(CheckOwners(pools, alive, removed));
+
+	// A row of the root chunk, filled from the single row of the tail chunk.
+	alive.push_back(CreateOwnedEntity(pools));
+	CHECK(countChunks() == 2);
+	removed.push_back(alive.front());
+	alive.erase(alive.begin());
+	de::RemoveEntity(removed.back(), pools);
+	de::FlushPools(pools);
+	CHECK(countChunks() == 1);
+	CHECK(CheckOwners(pools, alive, removed));
+
+	// Grow to three chunks and remove everything. The root chunk stays.
+	for (uint32_t i = 0; i < RowCount * 2; ++i) {
+		alive.push_back(CreateOwnedEntity(pools));
+	}
+	CHECK(countChunks() == 3);
+	for (auto entity : alive) {
+		de::RemoveEntity(entity, pools);
+	}
+	removed.insert(removed.end(), alive.begin(), alive.end());
+	alive.clear();
+	de::FlushPools(pools);
+	CHECK(countChunks() == 1);
+	CHECK(CheckOwners(pools, alive, removed));
+
+	for (uint32_t i = 0; i < RowCount + 5; ++i) {
+		alive.push_back(CreateOwnedEntity(pools));
+	}
+	CHECK(countChunks() == 2);
+	CHECK(CheckOwners(pools, alive, removed));
+	de::DestroyPools(pools);
+}
+
+namespace
+{
+	template<typename ... ComponentTypes>
+	de::EntityId CreateSystemTestEntity(FDeSystemPools& pools, float position)
+	{
+		auto entity = de::CreateEntity<ComponentTypes...>();
+		de::GetComponent<FDeValue>(entity, pools)->Owner = entity;
+		de::GetComponent<FDePosition>(entity, pools)->Value = position;
+		if (auto speed = de::GetComponent<FDeSpeed>(entity, pools))
+			speed->Value = 1.f;
+		return entity;
+	}
+
+	struct FDeSystemTestEntities
+	{
+		std::vector<de::EntityId> Moving;
+		std::vector<de::EntityId> Armed;
+		std::vector<de::EntityId> Still;
+
+		// More than one chunk in every pool.
+		FDeSystemTestEntities(FDeSystemPools& pools)
+		{
+			for (uint32_t i = 0; i < FDeArmedPool::ElementCountPerChunk + 3; ++i) {
+				Moving.push_back(CreateSystemTestEntity<FDeValue, FDeSpeed, FDePosition>(pools, (float)i));
+				Armed.push_back(CreateSystemTestEntity<FDeValue, FDeSpeed, FDePosition, FDeWeapon>(pools, (float)i));
+				Still.push_back(CreateSystemTestEntity<FDeValue, FDePosition>(pools, (float)i));
+			}
+		}
+	};
+
+	std::vector<de::EntityId> Sorted(std::vector<de::EntityId> entities)
+	{
+		std::sort(entities.begin(), entities.end());
+		return entities;
+	}
+
+	template<typename ... VectorTypes>
+	std::vector<de::EntityId> Concat(const VectorTypes& ... entities)
+	{
+		std::vector<de::EntityId> all;
+		(all.insert(all.end(), entities.begin(), entities.end()), ...);
+		return all;
+	}
+}
+
+// Pools with an excluded component are skipped by RunSystem and RunSystems.
+TEST_CASE(DeSystems_ExcludedComponentSkipsPool)
+{
+	FDeSystemPools pools = { FDeMovePool::Get(), FDeArmedPool::Get(), FDeStillPool::Get() };
+	de::InitializePools(pools);
+	FDeSystemTestEntities entities(pools);
+	auto unarmed = Sorted(Concat(entities.Moving, entities.Still));
+
+	FDeUnarmedSystem system;
+	de::RunSystem(&system, pools);
+	CHECK(Sorted(system.Owners) == unarmed);
+
+	FDeUnarmedSystem fusedSystem;
+	FDeDoubleSystem doubleSystem;
+	de::RunSystems(pools, &doubleSystem, &fusedSystem);
+	CHECK(Sorted(fusedSystem.Owners) == unarmed);
+	de::DestroyPools(pools);
+}
+
+// Optional components are passed as nullptr for the pools without them.
+TEST_CASE(DeSystems_OptionalComponentIsNullWhenAbsent)
+{
+	FDeSystemPools pools = { FDeMovePool::Get(), FDeArmedPool::Get(), FDeStillPool::Get() };
+	de::InitializePools(pools);
+	FDeSystemTestEntities entities(pools);
+
+	FDeOptionalSpeedSystem system;
+	de::RunSystem(&system, pools);
+	CHECK(Sorted(system.WithSpeed) == Sorted(Concat(entities.Moving, entities.Armed)));
+	CHECK(Sorted(system.WithoutSpeed) == Sorted(entities.Still));
+	CHECK(system.WrongSpeedCount == 0);
+
+	FDeOptionalSpeedSystem fusedSystem;
+	FDeIntegrateSystem integrateSystem;
+	de::RunSystems(pools, &fusedSystem, &integrateSystem);
+	CHECK(Sorted(fusedSystem.WithSpeed) == Sorted(Concat(entities.Moving, entities.Armed)));
+	CHECK(Sorted(fusedSystem.WithoutSpeed) == Sorted(entities.Still));
+	CHECK(fusedSystem.WrongSpeedCount == 0);
+	de::DestroyPools(pools);
+}
+
+// Fused systems run in declaration order on each chunk, so each sees the writes of the ones before it.
+TEST_CASE(DeSystems_FusedSystemsRunInOrder)
+{
+	FDeSystemPools pools = { FDeMovePool::Get(), FDeArmedPool::Get(), FDeStillPool::Get() };
+	de::InitializePools(pools);
+	FDeSystemTestEntities entities(pools);
+	FDeIntegrateSystem integrateSystem;
+	FDeDoubleSystem doubleSystem;
+
+	// (p + 1) * 2 for the moving entities. The still entities only match the second system.
+	de::RunSystems(pools, &integrateSystem, &doubleSystem);
+	for (uint32_t i = 0; i < entities.Moving.size(); ++i) {
+		CHECK(de::GetComponent<FDePosition>(entities.Moving[i], pools)->Value == (i + 1.f) * 2.f);
+		CHECK(de::GetComponent<FDePosition>(entities.Armed[i], pools)->Value == (i + 1.f) * 2.f);
+		CHECK(de::GetComponent<FDePosition>(entities.Still[i], pools)->Value == i * 2.f);
+	}
+
+	// p * 2 + 1 in the reversed order.
+	de::RunSystems(pools, &doubleSystem, &integrateSystem);
+	for (uint32_t i = 0; i < entities.Moving.size(); ++i) {
+		CHECK(de::GetComponent<FDePosition>(entities.Moving[i], pools)->Value == (i + 1.f) * 4.f + 1.f);
+		CHECK(de::GetComponent<FDePosition>(entities.Armed[i], pools)->Value == (i + 1.f) * 4.f + 1.f);
+		CHECK(de::GetComponent<FDePosition>(entities.Still[i], pools)->Value == i * 4.f);
+	}
+	de::DestroyPools(pools);
+}
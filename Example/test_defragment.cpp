@@ -0,0 +1,98 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Entity i has position x == i. Removes every entity for which isRemoved(i) and flushes.
+	template<typename IsRemovedFn>
+	std::vector<de2::EntityId> BuildSparsePool(de2::DOECS& ecs, uint32_t entityCount, IsRemovedFn isRemoved)
+	{
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+		std::vector<de2::EntityId> entities;
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{}));
+		}
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			if (isRemoved(i))
+				ecs.RemoveEntity(entities[i]);
+		}
+		ecs.Flush();
+		return entities;
+	}
+
+	de2::PoolStats GetStats(de2::DOECS& ecs)
+	{
+		std::vector<de2::PoolStats> stats;
+		ecs.GetPoolStats(stats);
+		return stats[0];
+	}
+
+	// Every remaining entity keeps its position.
+	template<typename IsRemovedFn>
+	bool CheckEntities(de2::DOECS& ecs, const std::vector<de2::EntityId>& entities, IsRemovedFn isRemoved)
+	{
+		for (uint32_t i = 0; i < entities.size(); ++i) {
+			auto pos = ecs.GetComponent<FPositionComponent>(entities[i]);
+			if ((pos == nullptr) != isRemoved(i) || (pos && pos->x != (float)i))
+				return false;
+		}
+		return true;
+	}
+}
+
+// Holes everywhere: every chunk but the last ends up full.
+TEST_CASE(Defragment_CompactsScatteredHoles)
+{
+	auto isRemoved = [](uint32_t i) { return i % 3 == 0 || (i / 1000) % 5 == 2; };
+	de2::DOECS ecs;
+	auto entities = BuildSparsePool(ecs, 50000, isRemoved);
+	auto before = GetStats(ecs);
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	auto after = GetStats(ecs);
+	CHECK(after.EntityCount == before.EntityCount);
+	CHECK(after.ChunkCount == (after.EntityCount + after.EntityCountPerChunk - 1) / after.EntityCountPerChunk);
+	CHECK(after.ChunkCount < before.ChunkCount);
+	CHECK(CheckEntities(ecs, entities, isRemoved));
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	CHECK(GetStats(ecs).ChunkCount == after.ChunkCount);
+}
+
+// A snapshot keeps the chunks the defragmentation moves rows out of.
+TEST_CASE(Defragment_WithSnapshot)
+{
+	auto isRemoved = [](uint32_t i) { return i % 2 == 0; };
+	de2::DOECS ecs;
+	auto entities = BuildSparsePool(ecs, 20000, isRemoved);
+	auto snapshot = ecs.Snapshot();
+	auto chunkCount = snapshot.GetChunkCount(0);
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	CHECK(GetStats(ecs).ChunkCount < chunkCount);
+	CHECK(CheckEntities(ecs, entities, isRemoved));
+
+	uint32_t snapshotCount = 0;
+	for (uint32_t c = 0; c < snapshot.GetChunkCount(0); ++c) {
+		const void* components = nullptr;
+		auto count = snapshot.GetComponents(0, c, typeid(FPositionComponent).hash_code(), components);
+		for (uint32_t i = 0; i < count; ++i) {
+			CHECK(!isRemoved((uint32_t)((const FPositionComponent*)components)[i].x));
+		}
+		snapshotCount += count;
+	}
+	CHECK(snapshotCount == 10000);
+	CHECK(snapshot.GetChunkCount(0) == chunkCount);
+}
+
+// Small budgets spread the work over calls. Each call resumes where the pool is left.
+TEST_CASE(Defragment_SpreadOverCalls)
+{
+	auto isRemoved = [](uint32_t i) { return i % 4 != 0; };
+	de2::DOECS ecs;
+	auto entities = BuildSparsePool(ecs, 100000, isRemoved);
+	uint32_t callCount = 1;
+	while (!ecs.Defragment(std::chrono::microseconds(50)) && callCount < 100000) {
+		++callCount;
+	}
+	auto stats = GetStats(ecs);
+	CHECK(stats.ChunkCount == (stats.EntityCount + stats.EntityCountPerChunk - 1) / stats.EntityCountPerChunk);
+	CHECK(CheckEntities(ecs, entities, isRemoved));
+}
@@ -0,0 +1,74 @@
+#include "test_runner.h"
+#include "Components.h"
+
+// Every entity with all the requested components is exported once, in request order, and the arrays keep
+// the values of the snapshot while the world is written.
+TEST_CASE(Export_ColumnsOfSnapshot)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	ecs.AddPool<FRotationComponent, FPositionComponent, FLifeformComponent>();
+	ecs.AddPool<FPositionComponent>();
+	std::unordered_map<de2::EntityId, uint32_t> expected;
+	for (uint32_t i = 0; i < 6000; ++i) {
+		de2::EntityId entity;
+		if (i % 3 == 0)
+			entity = ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{ 0.f, 0.f, 0.f, (float)i });
+		else if (i % 3 == 1)
+			entity = ecs.AddEntity(FRotationComponent{ 0.f, 0.f, 0.f, (float)i }, FPositionComponent{ (float)i, 0.f, 0.f }, FLifeformComponent{ i, i });
+		else
+			entity = ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f });
+		if (i % 3 != 2)
+			expected[entity] = i;
+	}
+	auto snapshot = ecs.Snapshot();
+	CHECK(ecs.Fill<FPositionComponent>(FPositionComponent{ -1.f, -1.f, -1.f }) == 6000);
+
+	de2::ColumnExport exp;
+	CHECK(snapshot.ExportColumns<FRotationComponent, FPositionComponent>(exp));
+	CHECK(exp.Layouts.size() == 2);
+	CHECK(exp.Layouts[0].TypeHash == typeid(FRotationComponent).hash_code());
+	CHECK(exp.Layouts[1].TypeHash == typeid(FPositionComponent).hash_code());
+	CHECK(exp.Layouts[1].Size == sizeof(FPositionComponent) && exp.Layouts[1].Stride == sizeof(FPositionComponent));
+	CHECK(exp.Layouts[1].TriviallyCopyable == 1);
+	CHECK(exp.Columns.size() == exp.Chunks.size() * 2);
+	CHECK(exp.EntityCount == expected.size());
+
+	uint32_t exportedCount = 0;
+	for (std::size_t c = 0; c < exp.Chunks.size(); ++c) {
+		auto& chunk = exp.Chunks[c];
+		CHECK(chunk.PoolIndex < snapshot.GetPoolCount());
+		auto rotations = exp.GetColumn<FRotationComponent>(c, 0);
+		auto positions = exp.GetColumn<FPositionComponent>(c, 1);
+		for (uint32_t row = 0; row < chunk.Count; ++row) {
+			auto it = expected.find(chunk.Entities[row]);
+			CHECK(it != expected.end());
+			if (it == expected.end())
+				continue;
+			CHECK(positions[row].x == (float)it->second);
+			CHECK(rotations[row].w == (float)it->second);
+			expected.erase(it);
+			++exportedCount;
+		}
+	}
+	CHECK(exportedCount == exp.EntityCount);
+	CHECK(expected.empty());
+}
+
+TEST_CASE(Export_NoMatch)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	ecs.AddPool<FRotationComponent>();
+	ecs.AddEntity(FPositionComponent{});
+	auto snapshot = ecs.Snapshot();
+
+	de2::ColumnExport exp;
+	CHECK(snapshot.ExportColumns<FPositionComponent>(exp));
+	CHECK(exp.EntityCount == 1);
+	// The previous content is cleared.
+	CHECK(!snapshot.ExportColumns<FPositionComponent, FRotationComponent>(exp));
+	CHECK(exp.Chunks.empty() && exp.Columns.empty() && exp.EntityCount == 0);
+	CHECK(!snapshot.ExportColumns<FRotationComponent>(exp));
+	CHECK(!snapshot.ExportColumns(nullptr, 0, exp));
+}
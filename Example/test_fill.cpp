@@ -0,0 +1,92 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Chunks whose column of the component changed since epochs, which are advanced.
+	std::size_t CountChangedChunks(de2::DOECS& ecs, uint64_t componentHash, std::unordered_map<uint64_t, uint64_t>& epochs)
+	{
+		std::size_t changedCount = 0;
+		ecs.ForEachPoolWith(componentHash, [&](uint64_t poolHash, de2::impl::IArchetypePool* pool) {
+			std::vector<de2::impl::ChangedChunk> changed;
+			uint32_t chunkCount = 0;
+			epochs[poolHash] = pool->GetChangedChunks(componentHash, epochs[poolHash], changed, chunkCount);
+			changedCount += changed.size();
+		});
+		return changedCount;
+	}
+
+	// Entity i has position x == i and a weapon of range i. Every other entity also has a lifeform.
+	void BuildWorld(de2::DOECS& ecs, std::vector<de2::EntityId>& entities)
+	{
+		ecs.AddPool<FPositionComponent, FWeaponComponent>();
+		ecs.AddPool<FPositionComponent, FWeaponComponent, FLifeformComponent>();
+		ecs.AddPool<FRotationComponent>();
+		for (uint32_t i = 0; i < 6000; ++i) {
+			if (i % 2 == 0)
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FWeaponComponent{ 0.f, 0.f, (float)i }));
+			else
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FWeaponComponent{ 0.f, 0.f, (float)i }, FLifeformComponent{ i, i }));
+			ecs.AddEntity(FRotationComponent{});
+		}
+	}
+}
+
+// Fill writes only the matching pools and the filled column.
+TEST_CASE(Fill_QueryAndColumn)
+{
+	de2::DOECS ecs;
+	std::vector<de2::EntityId> entities;
+	BuildWorld(ecs, entities);
+	auto snapshot = ecs.Snapshot();
+	std::unordered_map<uint64_t, uint64_t> positionEpochs;
+	CountChangedChunks(ecs, typeid(FPositionComponent).hash_code(), positionEpochs);
+
+	CHECK(ecs.Fill<FWeaponComponent, FLifeformComponent>(FWeaponComponent{ 1.f, 2.f, 3.f }) == 3000);
+	CHECK(ecs.Fill<FWeaponComponent>(FWeaponComponent{}) == 6000);
+	CHECK(ecs.Fill<FWeaponComponent, FLifeformComponent>(FWeaponComponent{ 1.f, 2.f, 3.f }) == 3000);
+	CHECK(ecs.Fill<FWeaponComponent, FDurabilityComponent>(FWeaponComponent{}) == 0);
+	CHECK(CountChangedChunks(ecs, typeid(FPositionComponent).hash_code(), positionEpochs) == 0);
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		auto weapon = ecs.ReadComponent<FWeaponComponent>(entities[i]);
+		CHECK(weapon->Range == (i % 2 ? 3.f : 0.f));
+		CHECK(ecs.ReadComponent<FPositionComponent>(entities[i])->x == (float)i);
+	}
+
+	// The snapshot keeps the values from before the fills.
+	for (std::size_t p = 0; p < snapshot.GetPoolCount(); ++p) {
+		for (uint32_t c = 0; c < snapshot.GetChunkCount(p); ++c) {
+			const void* weapons = nullptr;
+			const void* positions = nullptr;
+			auto count = snapshot.GetComponents(p, c, typeid(FWeaponComponent).hash_code(), weapons);
+			snapshot.GetComponents(p, c, typeid(FPositionComponent).hash_code(), positions);
+			for (uint32_t row = 0; row < count; ++row) {
+				CHECK(((const FWeaponComponent*)weapons)[row].Range == ((const FPositionComponent*)positions)[row].x);
+			}
+		}
+	}
+}
+
+// Transform reads the current value of each row and writes back only the transformed column.
+TEST_CASE(Fill_Transform)
+{
+	de2::DOECS ecs;
+	std::vector<de2::EntityId> entities;
+	BuildWorld(ecs, entities);
+	std::unordered_map<uint64_t, uint64_t> positionEpochs;
+	std::unordered_map<uint64_t, uint64_t> weaponEpochs;
+	CountChangedChunks(ecs, typeid(FPositionComponent).hash_code(), positionEpochs);
+	CountChangedChunks(ecs, typeid(FWeaponComponent).hash_code(), weaponEpochs);
+
+	CHECK(ecs.Transform<FWeaponComponent>([](const FWeaponComponent& weapon) {
+		return FWeaponComponent{ weapon.Delay, weapon.Charging, weapon.Range * 2.f };
+	}) == 6000);
+	CHECK(ecs.Transform<FWeaponComponent, FLifeformComponent>([](const FWeaponComponent& weapon) {
+		return FWeaponComponent{ weapon.Delay, weapon.Charging, weapon.Range + 1.f };
+	}) == 3000);
+	CHECK(CountChangedChunks(ecs, typeid(FPositionComponent).hash_code(), positionEpochs) == 0);
+	CHECK(CountChangedChunks(ecs, typeid(FWeaponComponent).hash_code(), weaponEpochs) > 1);
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		CHECK(ecs.ReadComponent<FWeaponComponent>(entities[i])->Range == (float)i * 2.f + (i % 2 ? 1.f : 0.f));
+	}
+}
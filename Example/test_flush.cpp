@@ -0,0 +1,139 @@
+#include "test_runner.h"
+#include "Components.h"
+
+struct FFlushTestMarker
+{
+	uint32_t Value;
+};
+DeclareSparseComponent(FFlushTestMarker);
+
+namespace
+{
+	constexpr uint32_t EntityCount = 40000;
+
+	// Entity i has position x == i in one of three pools. Every third entity has a marker.
+	void BuildWorld(de2::DOECS& ecs, std::vector<de2::EntityId>& entities)
+	{
+		ecs.AddPool<FPositionComponent>();
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+		ecs.AddPool<FPositionComponent, FLifeformComponent>();
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			if (i % 3 == 0)
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+			else if (i % 3 == 1)
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{}));
+			else
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FLifeformComponent{ i, 0 }));
+			if (i % 3 == 0)
+				ecs.AddComponent(entities.back(), FFlushTestMarker{ i });
+		}
+	}
+
+	// Removes a pattern with whole removed chunks, scattered rows and untouched chunks.
+	bool IsRemoved(uint32_t i)
+	{
+		return (i / 2000) % 4 == 1 || i % 5 == 0 || (i > 30000 && i % 7 < 3);
+	}
+
+	// Positions in chunk order for each pool, the layout after Flush.
+	std::vector<float> GetLayout(de2::WorldSnapshot& snapshot)
+	{
+		std::vector<float> layout;
+		for (std::size_t p = 0; p < snapshot.GetPoolCount(); ++p) {
+			for (uint32_t c = 0; c < snapshot.GetChunkCount(p); ++c) {
+				const void* components = nullptr;
+				auto count = snapshot.GetComponents(p, c, typeid(FPositionComponent).hash_code(), components);
+				for (uint32_t i = 0; i < count; ++i) {
+					layout.push_back(((const FPositionComponent*)components)[i].x);
+				}
+				layout.push_back(-1.f);
+			}
+		}
+		return layout;
+	}
+
+	// Removes the same entities from two identical worlds and flushes them with threadCount 1 and 4.
+	void CheckParallelFlush(bool withSnapshot)
+	{
+		de2::DOECS serial;
+		de2::DOECS parallel;
+		std::vector<de2::EntityId> serialEntities;
+		std::vector<de2::EntityId> parallelEntities;
+		BuildWorld(serial, serialEntities);
+		BuildWorld(parallel, parallelEntities);
+		de2::WorldSnapshot serialBefore;
+		de2::WorldSnapshot parallelBefore;
+		if (withSnapshot) {
+			serialBefore = serial.Snapshot();
+			parallelBefore = parallel.Snapshot();
+		}
+
+		uint32_t removedCount = 0;
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			if (!IsRemoved(i))
+				continue;
+			CHECK(serial.RemoveEntity(serialEntities[i]));
+			CHECK(parallel.RemoveEntity(parallelEntities[i]));
+			++removedCount;
+		}
+		CHECK(removedCount >= de2::impl::MinParallelFlushCount);
+		serial.Flush(1);
+		parallel.Flush(4);
+
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			auto serialPos = serial.GetComponent<FPositionComponent>(serialEntities[i]);
+			auto parallelPos = parallel.GetComponent<FPositionComponent>(parallelEntities[i]);
+			CHECK((serialPos == nullptr) == IsRemoved(i));
+			CHECK((parallelPos == nullptr) == IsRemoved(i));
+			if (parallelPos)
+				CHECK(parallelPos->x == (float)i);
+			auto marker = parallel.GetComponent<FFlushTestMarker>(parallelEntities[i]);
+			CHECK((marker != nullptr) == (i % 3 == 0 && !IsRemoved(i)));
+			if (i % 3 == 2 && !IsRemoved(i))
+				CHECK(parallel.GetComponent<FLifeformComponent>(parallelEntities[i])->HitPoint == i);
+		}
+
+		auto serialAfter = serial.Snapshot();
+		auto parallelAfter = parallel.Snapshot();
+		CHECK(GetLayout(serialAfter) == GetLayout(parallelAfter));
+		if (withSnapshot) {
+			auto layout = GetLayout(parallelBefore);
+			CHECK(layout == GetLayout(serialBefore));
+			CHECK((uint32_t)std::count(layout.begin(), layout.end(), -1.f) + EntityCount == layout.size());
+		}
+	}
+}
+
+TEST_CASE(Flush_ParallelMatchesSerial)
+{
+	CheckParallelFlush(false);
+}
+
+TEST_CASE(Flush_ParallelMatchesSerialWithSnapshot)
+{
+	CheckParallelFlush(true);
+}
+
+// Repeated frames reuse the workers and the flush buffers of the pools.
+TEST_CASE(Flush_ParallelRepeatedFrames)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int frame = 0; frame < 5; ++frame) {
+		while (entities.size() < 20000) {
+			entities.push_back(ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f }));
+		}
+		for (std::size_t i = frame % 2; i < entities.size(); i += 2) {
+			ecs.RemoveEntity(entities[i]);
+		}
+		ecs.Flush(4);
+		entities.erase(std::remove_if(entities.begin(), entities.end(), [&ecs](de2::EntityId entity) {
+			return ecs.GetComponent<FPositionComponent>(entity) == nullptr;
+		}), entities.end());
+		CHECK(entities.size() == 10000);
+		std::vector<de2::PoolStats> stats;
+		ecs.GetPoolStats(stats);
+		CHECK(stats.size() == 1 && stats[0].EntityCount == 10000);
+	}
+}
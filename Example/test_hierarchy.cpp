@@ -0,0 +1,126 @@
+#include "test_runner.h"
+#include "Components.h"
+#include "../doecs2_hierarchy.h"
+
+namespace
+{
+	struct FWorldOffset
+	{
+		float x, y, z;
+	};
+
+	using Hierarchy = de2::TransformHierarchy<FWorldOffset, FPositionComponent>;
+
+	FWorldOffset Combine(const FWorldOffset& parent, const FPositionComponent& pos)
+	{
+		return { parent.x + pos.x, parent.y + pos.y, parent.z + pos.z };
+	}
+}
+
+TEST_CASE(Hierarchy_PropagateChain)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	ecs.AddPool<FRotationComponent>();
+	auto root = ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f });
+	auto child = ecs.AddEntity(FPositionComponent{ 0.f, 2.f, 0.f });
+	auto grandChild = ecs.AddEntity(FPositionComponent{ 0.f, 0.f, 3.f });
+	// No position, combined as a zero offset.
+	auto noPosition = ecs.AddEntity(FRotationComponent{});
+
+	Hierarchy hierarchy;
+	CHECK(hierarchy.SetParent(child, root));
+	CHECK(hierarchy.SetParent(grandChild, child));
+	CHECK(hierarchy.SetParent(noPosition, grandChild));
+	CHECK(!hierarchy.SetParent(root, grandChild));
+	hierarchy.Propagate(ecs, FWorldOffset{ 10.f, 0.f, 0.f }, Combine);
+
+	CHECK(hierarchy.GetDepthCount() == 4);
+	auto world = hierarchy.GetWorld(noPosition);
+	CHECK(world && world->x == 11.f && world->y == 2.f && world->z == 3.f);
+	world = hierarchy.GetWorld(child);
+	CHECK(world && world->x == 11.f && world->y == 2.f && world->z == 0.f);
+}
+
+TEST_CASE(Hierarchy_ReparentAndRemove)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	auto a = ecs.AddEntity(FPositionComponent{ 1.f, 0.f, 0.f });
+	auto b = ecs.AddEntity(FPositionComponent{ 2.f, 0.f, 0.f });
+	auto c = ecs.AddEntity(FPositionComponent{ 4.f, 0.f, 0.f });
+	auto d = ecs.AddEntity(FPositionComponent{ 8.f, 0.f, 0.f });
+
+	Hierarchy hierarchy;
+	hierarchy.SetParent(c, a);
+	hierarchy.SetParent(d, c);
+	hierarchy.SetParent(c, b);
+	CHECK(hierarchy.GetParent(c) == b);
+	hierarchy.Propagate(ecs, FWorldOffset{}, Combine);
+	CHECK(hierarchy.GetWorld(d)->x == 14.f);
+	// a has no children anymore, so it is not in the hierarchy.
+	CHECK(hierarchy.GetWorld(a) == nullptr);
+
+	// The children of a removed entity become roots.
+	hierarchy.RemoveEntity(c);
+	CHECK(hierarchy.GetParent(d) == de2::INVALID_ENTITY_ID);
+	hierarchy.SetParent(d, a);
+	hierarchy.Propagate(ecs, FWorldOffset{}, Combine);
+	CHECK(hierarchy.GetWorld(d)->x == 9.f);
+	CHECK(hierarchy.GetWorld(c) == nullptr);
+	CHECK(hierarchy.GetDepthCount() == 2);
+
+	hierarchy.SetParent(d, de2::INVALID_ENTITY_ID);
+	CHECK(hierarchy.GetDepthCount() == 0);
+}
+
+// Wide levels are split across the workers. The result must match the single threaded propagation.
+TEST_CASE(Hierarchy_ParallelMatchesSerial)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 20000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)(i % 7), (float)(i % 5), 1.f }));
+	}
+	Hierarchy serial;
+	Hierarchy parallel;
+	// 10 roots, then levels of 2000 entities.
+	for (std::size_t i = 10; i < entities.size(); ++i) {
+		auto parent = i < 2010 ? entities[i % 10] : entities[i - 2000];
+		serial.SetParent(entities[i], parent);
+		parallel.SetParent(entities[i], parent);
+	}
+	for (int frame = 0; frame < 3; ++frame) {
+		serial.Propagate(ecs, FWorldOffset{}, Combine, 1);
+		parallel.Propagate(ecs, FWorldOffset{}, Combine, 4);
+	}
+
+	const de2::EntityId* serialEntities = nullptr;
+	const FWorldOffset* serialWorlds = nullptr;
+	const de2::EntityId* parallelEntities = nullptr;
+	const FWorldOffset* parallelWorlds = nullptr;
+	auto count = serial.GetWorlds(serialEntities, serialWorlds);
+	CHECK(count == entities.size());
+	CHECK(parallel.GetWorlds(parallelEntities, parallelWorlds) == count);
+	CHECK(std::equal(serialEntities, serialEntities + count, parallelEntities));
+	CHECK(std::equal(serialWorlds, serialWorlds + count, parallelWorlds, [](const FWorldOffset& a, const FWorldOffset& b) {
+		return a.x == b.x && a.y == b.y && a.z == b.z;
+	}));
+}
+
+// ParallelFor inside a ParallelFor range runs on the same workers without waiting for a free one.
+TEST_CASE(Hierarchy_NestedParallelFor)
+{
+	std::vector<std::atomic<uint32_t>> hits(64 * 64);
+	de2::impl::ParallelFor(8, 64, [&hits](std::size_t begin, std::size_t end) {
+		for (auto i = begin; i < end; ++i) {
+			de2::impl::ParallelFor(8, 64, [&hits, i](std::size_t innerBegin, std::size_t innerEnd) {
+				for (auto j = innerBegin; j < innerEnd; ++j) {
+					hits[i * 64 + j].fetch_add(1);
+				}
+			});
+		}
+	});
+	CHECK(std::all_of(hits.begin(), hits.end(), [](const std::atomic<uint32_t>& hit) { return hit.load() == 1; }));
+}
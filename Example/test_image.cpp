@@ -0,0 +1,144 @@
+#include <fstream>
+#include <iterator>
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	constexpr uint32_t EntityCount = 20000;
+	const char* ImagePath = "doecs_image_test.img";
+	const char* PatchedPath = "doecs_image_test_patched.img";
+
+	// Entity i has position x == i. Odd entities have a rotation too.
+	std::vector<de2::EntityId> SaveWorld()
+	{
+		de2::DOECS ecs;
+		ecs.AddPool<FPositionComponent>();
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+		std::vector<de2::EntityId> entities;
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			if (i % 2)
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{ 0.f, 0.f, 0.f, (float)i }));
+			else
+				entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+		}
+		CHECK(ecs.SaveImage(ImagePath));
+		return entities;
+	}
+
+	void AddPools(de2::DOECS& ecs)
+	{
+		ecs.AddPool<FPositionComponent>();
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+	}
+
+	std::vector<char> ReadFile(const char* path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		return std::vector<char>(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	}
+
+	void WriteFile(const char* path, const std::vector<char>& bytes)
+	{
+		std::ofstream file(path, std::ios::binary);
+		file.write(bytes.data(), bytes.size());
+	}
+}
+
+// Removal, Flush and Defragment on the mapped chunks. The file is not modified.
+TEST_CASE(Image_RoundTripWithRemoveAndDefragment)
+{
+	auto entities = SaveWorld();
+	auto fileBefore = ReadFile(ImagePath);
+	{
+		de2::DOECS ecs;
+		AddPools(ecs);
+		CHECK(ecs.OpenImage(ImagePath));
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			CHECK(ecs.ReadComponent<FPositionComponent>(entities[i])->x == (float)i);
+		}
+		auto isRemoved = [](uint32_t i) { return i % 3 == 0 || (i > 5000 && i < 9000); };
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			if (isRemoved(i))
+				CHECK(ecs.RemoveEntity(entities[i]));
+		}
+		ecs.Flush();
+		CHECK(ecs.Defragment(std::chrono::seconds(10)));
+		ecs.GetComponent<FPositionComponent>(entities[1])->y = 1.f;
+		auto added = ecs.AddEntity(FPositionComponent{ -1.f, 0.f, 0.f });
+		CHECK(!std::count(entities.begin(), entities.end(), added));
+
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			auto pos = ecs.GetComponent<FPositionComponent>(entities[i]);
+			CHECK((pos == nullptr) == isRemoved(i));
+			if (pos)
+				CHECK(pos->x == (float)i);
+			auto rot = ecs.GetComponent<FRotationComponent>(entities[i]);
+			CHECK((rot != nullptr) == (i % 2 == 1 && !isRemoved(i)));
+			if (rot)
+				CHECK(rot->w == (float)i);
+		}
+		std::vector<de2::PoolStats> stats;
+		ecs.GetPoolStats(stats);
+		for (auto& pool : stats) {
+			CHECK(pool.ChunkCount == (pool.EntityCount + pool.EntityCountPerChunk - 1) / pool.EntityCountPerChunk);
+		}
+	}
+	CHECK(ReadFile(ImagePath) == fileBefore);
+
+	// A second world maps the unchanged file.
+	de2::DOECS ecs;
+	AddPools(ecs);
+	CHECK(ecs.OpenImage(ImagePath));
+	CHECK(ecs.GetComponent<FPositionComponent>(entities[0])->x == 0.f);
+	CHECK(ecs.GetComponent<FPositionComponent>(entities[1])->y == 0.f);
+	std::remove(ImagePath);
+}
+
+// Images of another format version or with another column layout are rejected before any pool changes.
+TEST_CASE(Image_RejectsMismatchedLayout)
+{
+	auto entities = SaveWorld();
+	auto bytes = ReadFile(ImagePath);
+	CHECK(bytes.size() > sizeof(de2::impl::ImageHeader) + 2 * sizeof(de2::impl::ImagePool));
+
+	auto patched = bytes;
+	((de2::impl::ImageHeader*)patched.data())->Version = de2::impl::ImageVersion + 1;
+	WriteFile(PatchedPath, patched);
+	{
+		de2::DOECS ecs;
+		AddPools(ecs);
+		CHECK(!ecs.OpenImage(PatchedPath));
+	}
+
+	// Every field of every column of the second pool.
+	de2::impl::ImagePool desc;
+	std::memcpy(&desc, bytes.data() + sizeof(de2::impl::ImageHeader) + sizeof(de2::impl::ImagePool), sizeof(desc));
+	CHECK(desc.ColumnCount >= 1);
+	for (uint32_t c = 0; c < desc.ColumnCount; ++c) {
+		for (int field = 0; field < 4; ++field) {
+			patched = bytes;
+			auto column = (de2::impl::ImageColumn*)(patched.data() + desc.ColumnOffset) + c;
+			if (field == 0)
+				column->ComponentHash ^= 1;
+			else if (field == 1)
+				column->Offset += 4;
+			else if (field == 2)
+				column->Size += 4;
+			else
+				column->Alignment *= 2;
+			WriteFile(PatchedPath, patched);
+			de2::DOECS ecs;
+			AddPools(ecs);
+			CHECK(!ecs.OpenImage(PatchedPath));
+			// Nothing was mapped.
+			CHECK(ecs.GetComponent<FPositionComponent>(entities[0]) == nullptr);
+		}
+	}
+
+	de2::DOECS ecs;
+	AddPools(ecs);
+	CHECK(ecs.OpenImage(ImagePath));
+	std::remove(PatchedPath);
+	std::remove(ImagePath);
+}
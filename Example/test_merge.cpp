@@ -0,0 +1,83 @@
+#include "test_runner.h"
+#include "Components.h"
+
+struct FMergeTestMarker
+{
+	uint32_t Value;
+};
+DeclareSparseComponent(FMergeTestMarker);
+
+// A level built on a loader thread is linked into the main world, with a pool the main world doesn't have.
+TEST_CASE(Merge_LevelFromThread)
+{
+	de2::DOECS main;
+	main.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> mainEntities;
+	for (uint32_t i = 0; i < 3000; ++i) {
+		mainEntities.push_back(main.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+	}
+
+	de2::DOECS level;
+	std::vector<de2::EntityId> levelEntities;
+	std::thread loader([&level, &levelEntities] {
+		level.ReserveEntityIds(5000);
+		level.AddPool<FPositionComponent>();
+		level.AddPool<FPositionComponent, FLifeformComponent>();
+		for (uint32_t i = 0; i < 5000; ++i) {
+			if (i % 2 == 0)
+				levelEntities.push_back(level.AddEntity(FPositionComponent{ -(float)i, 0.f, 0.f }));
+			else
+				levelEntities.push_back(level.AddEntity(FPositionComponent{ -(float)i, 0.f, 0.f }, FLifeformComponent{ i, i }));
+			if (i % 5 == 0)
+				level.AddComponent(levelEntities.back(), FMergeTestMarker{ i });
+		}
+		// Flushed by MergeInto().
+		for (uint32_t i = 0; i < 5000; i += 7) {
+			level.RemoveEntity(levelEntities[i]);
+		}
+	});
+	loader.join();
+	level.MergeInto(main);
+
+	std::vector<de2::PoolStats> stats;
+	level.GetPoolStats(stats);
+	for (auto& pool : stats) {
+		CHECK(pool.EntityCount == 0);
+	}
+	CHECK(level.GetComponent<FPositionComponent>(levelEntities[1]) == nullptr);
+
+	for (uint32_t i = 0; i < mainEntities.size(); ++i) {
+		CHECK(main.GetComponent<FPositionComponent>(mainEntities[i])->x == (float)i);
+	}
+	uint32_t removedCount = 0;
+	for (uint32_t i = 0; i < levelEntities.size(); ++i) {
+		auto pos = main.GetComponent<FPositionComponent>(levelEntities[i]);
+		CHECK((pos == nullptr) == (i % 7 == 0));
+		if (!pos) {
+			++removedCount;
+			continue;
+		}
+		CHECK(pos->x == -(float)i);
+		auto lifeform = main.GetComponent<FLifeformComponent>(levelEntities[i]);
+		CHECK((lifeform != nullptr) == (i % 2 == 1));
+		if (lifeform)
+			CHECK(lifeform->HitPoint == i);
+		auto marker = main.GetComponent<FMergeTestMarker>(levelEntities[i]);
+		CHECK((marker != nullptr) == (i % 5 == 0));
+		if (marker)
+			CHECK(marker->Value == i);
+	}
+
+	// Merged rows are regular rows of main: systems see them and they can be removed.
+	uint32_t visited = 0;
+	test::LambdaSystem<FPositionComponent> counter([&visited](uint32_t count, const de2::ComponentsArg&) {
+		visited += count;
+	});
+	main.AddSystem(&counter);
+	main.RunSystems();
+	CHECK(visited == mainEntities.size() + levelEntities.size() - removedCount);
+	CHECK(main.RemoveEntity(levelEntities[1]));
+	main.Flush();
+	CHECK(main.GetComponent<FPositionComponent>(levelEntities[1]) == nullptr);
+	main.RemoveSystem(&counter);
+}
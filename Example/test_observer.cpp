@@ -0,0 +1,141 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Records the entities and hit points it is told about. OnAdd sets MaxHitPoint to show writes are kept.
+	class LifeformObserver : public de2::IObserver
+	{
+	public:
+		std::vector<std::pair<de2::EntityId, uint32_t>> Added;
+		std::vector<std::pair<de2::EntityId, uint32_t>> Removed;
+		uint32_t AddCallCount = 0;
+
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(FLifeformComponent).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		void OnAdd(uint32_t entityCount, const de2::EntityId* entities, const de2::ComponentsArg& components) override
+		{
+			++AddCallCount;
+			auto lifeforms = (FLifeformComponent*)components[0];
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				Added.push_back({ entities[i], lifeforms[i].HitPoint });
+				lifeforms[i].MaxHitPoint = 1000;
+			}
+		}
+
+		void OnRemove(uint32_t entityCount, const de2::EntityId* entities, const de2::ComponentsArg& components) override
+		{
+			auto lifeforms = (const FLifeformComponent*)components[0];
+			for (uint32_t i = 0; i < entityCount; ++i) {
+				Removed.push_back({ entities[i], lifeforms[i].HitPoint });
+			}
+		}
+
+		void Clear()
+		{
+			Added.clear();
+			Removed.clear();
+			AddCallCount = 0;
+		}
+	};
+
+	std::vector<std::pair<de2::EntityId, uint32_t>> Sorted(std::vector<std::pair<de2::EntityId, uint32_t>> entities)
+	{
+		std::sort(entities.begin(), entities.end());
+		return entities;
+	}
+}
+
+// Only pools with every observed component are reported, with the component values of each row.
+TEST_CASE(Observer_AddAndRemove)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FLifeformComponent>();
+	ecs.AddPool<FRotationComponent, FLifeformComponent>();
+	ecs.AddPool<FPositionComponent>();
+	LifeformObserver observer;
+	ecs.AddObserver(&observer);
+
+	std::vector<std::pair<de2::EntityId, uint32_t>> expected;
+	std::vector<de2::EntityId> lifeforms;
+	for (uint32_t i = 0; i < 3000; ++i) {
+		if (i % 3 == 0) {
+			lifeforms.push_back(ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ i, i }));
+			expected.push_back({ lifeforms.back(), i });
+		}
+		else if (i % 3 == 1) {
+			lifeforms.push_back(ecs.AddEntity(FRotationComponent{}, FLifeformComponent{ i, i }));
+			expected.push_back({ lifeforms.back(), i });
+		}
+		else {
+			ecs.AddEntity(FPositionComponent{});
+		}
+	}
+	CHECK(observer.Added.empty());
+	ecs.Flush();
+	CHECK(Sorted(observer.Added) == Sorted(expected));
+	CHECK(observer.Removed.empty());
+	// Contiguous rows are reported together.
+	CHECK(observer.AddCallCount < 20);
+	for (auto entity : lifeforms) {
+		CHECK(ecs.ReadComponent<FLifeformComponent>(entity)->MaxHitPoint == 1000);
+	}
+
+	// Nothing new, nothing reported.
+	observer.Clear();
+	ecs.Flush();
+	CHECK(observer.Added.empty() && observer.Removed.empty());
+
+	// Removed rows are reported before they are removed.
+	expected.clear();
+	for (std::size_t i = 0; i < lifeforms.size(); i += 4) {
+		CHECK(ecs.RemoveEntity(lifeforms[i]));
+		expected.push_back({ lifeforms[i], ecs.ReadComponent<FLifeformComponent>(lifeforms[i])->HitPoint });
+	}
+	ecs.Flush();
+	CHECK(observer.Added.empty());
+	CHECK(Sorted(observer.Removed) == Sorted(expected));
+	ecs.RemoveObserver(&observer);
+}
+
+// Entities added while no observer matched their pool are not reported later. Removed observers are not called.
+TEST_CASE(Observer_AddedLaterAndRemoved)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FLifeformComponent>();
+	auto before = ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ 1, 1 });
+	ecs.Flush();
+
+	LifeformObserver observer;
+	ecs.AddObserver(&observer);
+	// The pool is created after the observer was added, and by a prefab.
+	auto prefab = ecs.CreatePrefab(FRotationComponent{}, FLifeformComponent{ 7, 7 });
+	auto first = ecs.Instantiate(prefab, 100);
+	auto after = ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ 2, 2 });
+	ecs.Flush();
+	CHECK(observer.Added.size() == 101);
+	CHECK(std::count(observer.Added.begin(), observer.Added.end(), std::make_pair(after, 2u)) == 1);
+	CHECK(std::count(observer.Added.begin(), observer.Added.end(), std::make_pair(first + 99, 7u)) == 1);
+	CHECK(std::none_of(observer.Added.begin(), observer.Added.end(), [before](const std::pair<de2::EntityId, uint32_t>& added) {
+		return added.first == before;
+	}));
+
+	observer.Clear();
+	ecs.RemoveObserver(&observer);
+	ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ 3, 3 });
+	ecs.RemoveEntity(before);
+	ecs.Flush();
+	CHECK(observer.Added.empty() && observer.Removed.empty());
+
+	// Adds made while the observer was removed are not reported once it is back.
+	ecs.AddEntity(FPositionComponent{}, FLifeformComponent{ 4, 4 });
+	ecs.AddObserver(&observer);
+	ecs.Flush();
+	CHECK(observer.Added.empty());
+	ecs.RemoveObserver(&observer);
+}
@@ -0,0 +1,124 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	constexpr uint32_t EntityCount = 20000;
+
+	// Entity i has HitPoint i, in one of two pools.
+	void BuildWorld(de2::DOECS& ecs)
+	{
+		ecs.AddPool<FLifeformComponent>();
+		ecs.AddPool<FLifeformComponent, FPositionComponent>();
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			if (i % 2)
+				ecs.AddEntity(FLifeformComponent{ i, 0 });
+			else
+				ecs.AddEntity(FLifeformComponent{ i, 0 }, FPositionComponent{});
+		}
+	}
+
+	// Counts the visits of each entity by HitPoint.
+	test::LambdaSystem<FLifeformComponent> CountingSystem(std::vector<uint32_t>& visits, de2::ExecutionPolicy policy)
+	{
+		return test::LambdaSystem<FLifeformComponent>([&visits](uint32_t count, const de2::ComponentsArg& components) {
+			auto lifeforms = (const FLifeformComponent*)components[0];
+			for (uint32_t i = 0; i < count; ++i) {
+				if (lifeforms[i].HitPoint < visits.size())
+					++visits[lifeforms[i].HitPoint];
+			}
+		}, policy);
+	}
+
+	bool AllVisited(const std::vector<uint32_t>& visits, uint32_t times)
+	{
+		return std::all_of(visits.begin(), visits.end(), [times](uint32_t v) { return v == times; });
+	}
+}
+
+TEST_CASE(Policy_SlicesVisitEachEntityOncePerPass)
+{
+	de2::DOECS ecs;
+	BuildWorld(ecs);
+	std::vector<uint32_t> visits(EntityCount);
+	auto system = CountingSystem(visits, { 1, 4, 0 });
+	ecs.AddSystem(&system);
+	for (int pass = 1; pass <= 3; ++pass) {
+		for (int run = 0; run < 4; ++run) {
+			CHECK(!AllVisited(visits, pass));
+			ecs.RunSystems();
+		}
+		CHECK(AllVisited(visits, pass));
+	}
+}
+
+TEST_CASE(Policy_Interval)
+{
+	de2::DOECS ecs;
+	BuildWorld(ecs);
+	std::vector<uint32_t> visits(EntityCount);
+	auto system = CountingSystem(visits, { 3, 1, 0 });
+	ecs.AddSystem(&system);
+	for (int run = 0; run < 7; ++run) {
+		ecs.RunSystems();
+	}
+	// Runs 0, 3 and 6.
+	CHECK(AllVisited(visits, 3));
+}
+
+// Adding pools rebuilds the query, in another pool order. The pass resumes in the pool it stopped in.
+TEST_CASE(Policy_ResumeAfterPoolsAreAdded)
+{
+	de2::DOECS ecs;
+	BuildWorld(ecs);
+	std::vector<uint32_t> visits(EntityCount);
+	auto system = CountingSystem(visits, { 1, 8, 0 });
+	ecs.AddSystem(&system);
+	// Runs until the pass is over. No entity is visited twice before that.
+	for (int run = 0; run < 16 && std::count(visits.begin(), visits.end(), 0u) > 0; ++run) {
+		ecs.RunSystems();
+		CHECK(*std::max_element(visits.begin(), visits.end()) == 1);
+		// Entities of the new pools have HitPoints past the counted ones.
+		if (run == 1) {
+			ecs.AddPool<FLifeformComponent, FRotationComponent>();
+			CHECK(ecs.AddEntity(FLifeformComponent{ EntityCount, 0 }, FRotationComponent{}) != de2::INVALID_ENTITY_ID);
+		}
+		if (run == 3) {
+			ecs.AddPool<FLifeformComponent, FRotationComponent, FPositionComponent>();
+			CHECK(ecs.AddEntity(FLifeformComponent{ EntityCount, 0 }, FRotationComponent{}, FPositionComponent{}) != de2::INVALID_ENTITY_ID);
+		}
+	}
+	CHECK(AllVisited(visits, 1));
+}
+
+// A system removed while it runs doesn't keep a cursor. Added again, it starts a new pass.
+TEST_CASE(Policy_RemoveSystemDuringRun)
+{
+	de2::DOECS ecs;
+	BuildWorld(ecs);
+	std::vector<uint32_t> visits(EntityCount);
+	bool removeInRun = false;
+	test::LambdaSystem<FLifeformComponent>* self = nullptr;
+	test::LambdaSystem<FLifeformComponent> system([&](uint32_t count, const de2::ComponentsArg& components) {
+		auto lifeforms = (const FLifeformComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			++visits[lifeforms[i].HitPoint];
+		}
+		if (removeInRun) {
+			removeInRun = false;
+			ecs.RemoveSystem(self);
+		}
+	}, { 1, 2, 0 });
+	self = &system;
+	ecs.AddSystem(&system);
+	ecs.RunSystems();
+	auto firstHalf = visits;
+
+	removeInRun = true;
+	ecs.RunSystem(&system);
+
+	std::fill(visits.begin(), visits.end(), 0);
+	ecs.AddSystem(&system);
+	ecs.RunSystems();
+	CHECK(visits == firstHalf);
+}
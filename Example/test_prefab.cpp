@@ -0,0 +1,96 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Longer than the small string buffer, so every filled row owns its own copy.
+	struct FNameComponent
+	{
+		std::string Value;
+	};
+}
+
+// Copies fill the free rows of the last chunk first, then new chunks, and interleave with AddEntity().
+TEST_CASE(Prefab_InstantiateAcrossChunks)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FLifeformComponent>();
+	auto single = ecs.AddEntity(FPositionComponent{ 5.f, 0.f, 0.f }, FLifeformComponent{ 1, 1 });
+	auto orc = ecs.CreatePrefab(FPositionComponent{ 1.f, 2.f, 3.f }, FLifeformComponent{ 100, 100 });
+	auto goblin = ecs.CreatePrefab(FPositionComponent{ 4.f, 5.f, 6.f }, FLifeformComponent{ 30, 30 });
+	CHECK(orc.PoolHash == goblin.PoolHash && orc.Index != goblin.Index);
+
+	auto firstOrc = ecs.Instantiate(orc, 3000);
+	CHECK(firstOrc != de2::INVALID_ENTITY_ID);
+	auto other = ecs.AddEntity(FPositionComponent{ 7.f, 0.f, 0.f }, FLifeformComponent{ 2, 2 });
+	auto firstGoblin = ecs.Instantiate(goblin, 1500);
+	CHECK(firstGoblin != de2::INVALID_ENTITY_ID);
+
+	for (de2::EntityId i = 0; i < 3000; ++i) {
+		auto pos = ecs.GetComponent<FPositionComponent>(firstOrc + i);
+		CHECK(pos && pos->x == 1.f && pos->z == 3.f);
+		CHECK(ecs.GetComponent<FLifeformComponent>(firstOrc + i)->HitPoint == 100);
+	}
+	for (de2::EntityId i = 0; i < 1500; ++i) {
+		CHECK(ecs.GetComponent<FLifeformComponent>(firstGoblin + i)->MaxHitPoint == 30);
+	}
+	CHECK(ecs.GetComponent<FPositionComponent>(single)->x == 5.f);
+	CHECK(ecs.GetComponent<FPositionComponent>(other)->x == 7.f);
+
+	// Copies are regular rows: systems see them, writes stay per row and they can be removed.
+	uint32_t visited = 0;
+	test::LambdaSystem<FLifeformComponent> counter([&visited](uint32_t count, const de2::ComponentsArg&) {
+		visited += count;
+	});
+	ecs.AddSystem(&counter);
+	ecs.RunSystems();
+	CHECK(visited == 3000 + 1500 + 2);
+	ecs.RemoveSystem(&counter);
+	ecs.GetComponent<FLifeformComponent>(firstOrc)->HitPoint = 10;
+	CHECK(ecs.GetComponent<FLifeformComponent>(firstOrc + 1)->HitPoint == 100);
+	CHECK(ecs.RemoveEntity(firstOrc + 1));
+	ecs.Flush();
+	CHECK(ecs.GetComponent<FLifeformComponent>(firstOrc + 1) == nullptr);
+	CHECK(ecs.GetComponent<FLifeformComponent>(firstOrc + 2)->HitPoint == 100);
+	std::vector<de2::PoolStats> stats;
+	ecs.GetPoolStats(stats);
+	CHECK(stats.size() == 1 && stats[0].EntityCount == 3000 + 1500 + 2 - 1);
+}
+
+TEST_CASE(Prefab_InvalidHandle)
+{
+	de2::DOECS ecs;
+	auto prefab = ecs.CreatePrefab(FRotationComponent{});
+	CHECK(ecs.Instantiate(de2::Prefab{}, 10) == de2::INVALID_ENTITY_ID);
+	CHECK(ecs.Instantiate(de2::Prefab{ prefab.PoolHash, prefab.Index + 1 }, 10) == de2::INVALID_ENTITY_ID);
+	CHECK(ecs.Instantiate(prefab, 0) == de2::INVALID_ENTITY_ID);
+	std::vector<de2::PoolStats> stats;
+	ecs.GetPoolStats(stats);
+	CHECK(stats.size() == 1 && stats[0].EntityCount == 0);
+}
+
+// Non trivially copyable components are copy constructed into every row and destroyed with it.
+TEST_CASE(Prefab_StringComponent)
+{
+	const std::string name = "prefab name longer than the small string buffer";
+	de2::DOECS ecs;
+	auto prefab = ecs.CreatePrefab(FNameComponent{ name }, FPositionComponent{});
+	auto first = ecs.Instantiate(prefab, 2000);
+	CHECK(first != de2::INVALID_ENTITY_ID);
+	ecs.GetComponent<FNameComponent>(first)->Value += " changed";
+	for (de2::EntityId i = 1; i < 2000; ++i) {
+		CHECK(ecs.ReadComponent<FNameComponent>(first + i)->Value == name);
+	}
+	CHECK(ecs.ReadComponent<FNameComponent>(first)->Value == name + " changed");
+	for (de2::EntityId i = 0; i < 2000; i += 2) {
+		ecs.RemoveEntity(first + i);
+	}
+	ecs.Flush();
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	for (de2::EntityId i = 1; i < 2000; i += 2) {
+		CHECK(ecs.ReadComponent<FNameComponent>(first + i)->Value == name);
+	}
+	// A second batch from the same prefab after the first was modified.
+	auto second = ecs.Instantiate(prefab, 10);
+	CHECK(ecs.ReadComponent<FNameComponent>(second + 9)->Value == name);
+}
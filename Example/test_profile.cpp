@@ -0,0 +1,102 @@
+#include <cstring>
+#include <set>
+#include "test_runner.h"
+#include "Components.h"
+
+#if !DOECS_PROFILE
+#error "Build with DOECS_PROFILE 1. See the doecs_profile_tests target."
+#endif
+
+namespace
+{
+	// Thread index of every event named name in the trace file.
+	std::vector<uint32_t> ReadTraceThreads(const char* path, const char* name)
+	{
+		std::vector<uint32_t> threads;
+		FILE* file = fopen(path, "r");
+		if (!file)
+			return threads;
+		std::string prefix = std::string("{\"name\":\"") + name + "\"";
+		char line[1024];
+		while (fgets(line, sizeof(line), file)) {
+			auto event = strstr(line, prefix.c_str());
+			auto tid = strstr(line, "\"tid\":");
+			unsigned threadIndex = 0;
+			if (event && tid && sscanf(tid, "\"tid\":%u", &threadIndex) == 1)
+				threads.push_back(threadIndex);
+		}
+		fclose(file);
+		return threads;
+	}
+
+	// The threads exit together, so each one records into a different buffer.
+	void RecordOnThreads(uint32_t threadCount, uint32_t scopeCount)
+	{
+		std::atomic<uint32_t> doneCount = 0;
+		std::vector<std::thread> threads;
+		for (uint32_t t = 0; t < threadCount; ++t) {
+			threads.emplace_back([&doneCount, threadCount, scopeCount]() {
+				for (uint32_t i = 0; i < scopeCount; ++i) {
+					DOECS_PROFILE_SCOPE(profileScope, "ThreadScope", "Test");
+					DOECS_PROFILE_ADD(profileScope, "i", i);
+				}
+				++doneCount;
+				while (doneCount.load() < threadCount) {
+					std::this_thread::yield();
+				}
+			});
+		}
+		for (auto& thread : threads) {
+			thread.join();
+		}
+	}
+}
+
+// Each thread records into its own buffer. Reports merge them, and exited threads hand their buffer over.
+TEST_CASE(Profile_ThreadBuffersMergeInReports)
+{
+	auto& profiler = de2::Profiler::Get();
+	profiler.Clear();
+	RecordOnThreads(4, 100);
+	auto stats = profiler.GetStats("Test", "ThreadScope");
+	CHECK(stats.SampleCount == 400);
+	CHECK(stats.Min <= stats.P50 && stats.P50 <= stats.Max);
+
+	const char* path = "doecs_profile_test.json";
+	CHECK(profiler.WriteChromeTrace(path));
+	auto firstThreads = ReadTraceThreads(path, "ThreadScope");
+	CHECK(firstThreads.size() == 400);
+	CHECK(std::set<uint32_t>(firstThreads.begin(), firstThreads.end()).size() == 4);
+
+	// Threads started later take over the buffers of the exited ones.
+	RecordOnThreads(4, 100);
+	CHECK(profiler.GetStats("Test", "ThreadScope").SampleCount == 800);
+	CHECK(profiler.WriteChromeTrace(path));
+	auto threads = ReadTraceThreads(path, "ThreadScope");
+	CHECK(threads.size() == 800);
+	CHECK(std::set<uint32_t>(threads.begin(), threads.end()) == std::set<uint32_t>(firstThreads.begin(), firstThreads.end()));
+	std::remove(path);
+}
+
+TEST_CASE(Profile_SystemAndPoolNames)
+{
+	auto& profiler = de2::Profiler::Get();
+	profiler.Clear();
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	ecs.AddEntity(FPositionComponent{});
+	test::LambdaSystem<FPositionComponent> system([](uint32_t, const de2::ComponentsArg&) {});
+	ecs.AddSystem(&system);
+	ecs.RunSystems();
+	ecs.RunSystemsAsync().Wait();
+
+	std::vector<de2::PoolStats> stats;
+	ecs.GetPoolStats(stats);
+	CHECK(stats.size() == 1 && std::string(stats[0].Name) == "Pool<FPositionComponent>");
+	CHECK(std::string(system.GetName()).find("LambdaSystem") != std::string::npos);
+	auto systemStats = profiler.GetStats("System", system.GetName());
+	CHECK(systemStats.SampleCount == 2);
+	auto names = profiler.GetScopeNames();
+	CHECK(std::find(names.begin(), names.end(), std::make_pair(std::string("Phase"), std::string("RunSystems"))) != names.end());
+	ecs.RemoveSystem(&system);
+}
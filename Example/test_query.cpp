@@ -0,0 +1,107 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	// Requires a position, skips the pools with a lifeform or, if set, a weapon, and takes an optional rotation.
+	// Counts the entities visited with and without a rotation.
+	class MoverSystem : public de2::ISystem
+	{
+	public:
+		bool ExcludeWeapons = false;
+		uint32_t WithRotation = 0;
+		uint32_t WithoutRotation = 0;
+
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(FPositionComponent).hash_code() };
+			pHashes = ComponentHashes;
+			return de2::ArrayCount(ComponentHashes);
+		}
+
+		std::size_t GetExcludedComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ExcludedHashes[] = { typeid(FLifeformComponent).hash_code(), typeid(FWeaponComponent).hash_code() };
+			pHashes = ExcludedHashes;
+			return ExcludeWeapons ? 2 : 1;
+		}
+
+		std::size_t GetOptionalComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t OptionalHashes[] = { typeid(FRotationComponent).hash_code() };
+			pHashes = OptionalHashes;
+			return de2::ArrayCount(OptionalHashes);
+		}
+
+		void Execute(uint32_t entityCount, const de2::ComponentsArg& components) override
+		{
+			CHECK(components.size() == 2);
+			CHECK(components[0] != nullptr);
+			(components[1] ? WithRotation : WithoutRotation) += entityCount;
+		}
+	};
+
+	void AddEntities(de2::DOECS& ecs)
+	{
+		ecs.AddPool<FPositionComponent>();
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+		ecs.AddPool<FPositionComponent, FLifeformComponent>();
+		ecs.AddPool<FPositionComponent, FRotationComponent, FLifeformComponent>();
+		ecs.AddPool<FRotationComponent>();
+		for (int i = 0; i < 3000; ++i) {
+			ecs.AddEntity(FPositionComponent{});
+			ecs.AddEntity(FPositionComponent{}, FRotationComponent{});
+			ecs.AddEntity(FPositionComponent{}, FLifeformComponent{});
+			ecs.AddEntity(FPositionComponent{}, FRotationComponent{}, FLifeformComponent{});
+			ecs.AddEntity(FRotationComponent{});
+		}
+	}
+}
+
+TEST_CASE(Query_ExcludedAndOptional)
+{
+	de2::DOECS ecs;
+	AddEntities(ecs);
+	MoverSystem system;
+	ecs.AddSystem(&system);
+	ecs.RunSystems();
+	CHECK(system.WithoutRotation == 3000);
+	CHECK(system.WithRotation == 3000);
+	ecs.RemoveSystem(&system);
+}
+
+// The matched pools are cached. Adding a pool or changing the hash arrays rebuilds them.
+TEST_CASE(Query_CacheFollowsPoolsAndHashes)
+{
+	de2::DOECS ecs;
+	AddEntities(ecs);
+	MoverSystem system;
+	ecs.AddSystem(&system);
+	ecs.RunSystems();
+	ecs.AddPool<FPositionComponent, FWeaponComponent>();
+	for (int i = 0; i < 1000; ++i) {
+		ecs.AddEntity(FPositionComponent{}, FWeaponComponent{});
+	}
+	system.WithRotation = system.WithoutRotation = 0;
+	ecs.RunSystems();
+	CHECK(system.WithoutRotation == 4000);
+
+	system.ExcludeWeapons = true;
+	system.WithRotation = system.WithoutRotation = 0;
+	ecs.RunSystems();
+	CHECK(system.WithoutRotation == 3000);
+	CHECK(system.WithRotation == 3000);
+	ecs.RemoveSystem(&system);
+}
+
+// A snapshot matches the same pools and passes nullptr for the missing optional column.
+TEST_CASE(Query_Snapshot)
+{
+	de2::DOECS ecs;
+	AddEntities(ecs);
+	auto snapshot = ecs.Snapshot();
+	MoverSystem system;
+	snapshot.RunSystem(&system);
+	CHECK(system.WithoutRotation == 3000);
+	CHECK(system.WithRotation == 3000);
+}
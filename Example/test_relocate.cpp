@@ -0,0 +1,208 @@
+#include "test_runner.h"
+#include "Components.h"
+#include <string>
+
+// Points at itself, so it breaks if it is moved with memcpy. Counts the live objects and the moves.
+struct FSelfRefComponent
+{
+	static inline int LiveCount = 0;
+	static inline int MoveCount = 0;
+
+	uint32_t Key = 0;
+	const FSelfRefComponent* Self = this;
+
+	FSelfRefComponent(uint32_t key = 0)
+		: Key(key)
+	{
+		++LiveCount;
+	}
+
+	FSelfRefComponent(const FSelfRefComponent& other)
+		: Key(other.Key)
+	{
+		++LiveCount;
+	}
+
+	FSelfRefComponent(FSelfRefComponent&& other) noexcept
+		: Key(other.Key)
+	{
+		++LiveCount;
+		++MoveCount;
+	}
+
+	FSelfRefComponent& operator=(const FSelfRefComponent& other)
+	{
+		Key = other.Key;
+		return *this;
+	}
+
+	~FSelfRefComponent()
+	{
+		--LiveCount;
+	}
+};
+
+// Not trivially copyable, but declared trivially relocatable, so rows are moved with memcpy.
+struct FRelocatableComponent
+{
+	static inline int LiveCount = 0;
+	static inline int MoveCount = 0;
+
+	uint32_t Key = 0;
+
+	FRelocatableComponent(uint32_t key = 0)
+		: Key(key)
+	{
+		++LiveCount;
+	}
+
+	FRelocatableComponent(const FRelocatableComponent& other)
+		: Key(other.Key)
+	{
+		++LiveCount;
+	}
+
+	FRelocatableComponent(FRelocatableComponent&& other) noexcept
+		: Key(other.Key)
+	{
+		++LiveCount;
+		++MoveCount;
+	}
+
+	FRelocatableComponent& operator=(const FRelocatableComponent& other) = default;
+
+	~FRelocatableComponent()
+	{
+		--LiveCount;
+	}
+};
+DeclareTriviallyRelocatable(FRelocatableComponent);
+
+namespace
+{
+	// Entity i has key i in both components.
+	std::vector<de2::EntityId> BuildRelocatedPool(de2::DOECS& ecs, uint32_t entityCount)
+	{
+		ecs.AddPool<FSelfRefComponent, FRelocatableComponent>();
+		std::vector<de2::EntityId> entities;
+		for (uint32_t i = 0; i < entityCount; ++i) {
+			entities.push_back(ecs.AddEntity(FSelfRefComponent(i), FRelocatableComponent(i)));
+		}
+		return entities;
+	}
+}
+
+// Flush and Defragment move the rows of a non trivially relocatable component with its move constructor and
+// destroy the moved-from and removed rows. Trivially relocatable rows are moved with memcpy.
+TEST_CASE(Relocate_MoveOnlyWhenNotTriviallyRelocatable)
+{
+	static_assert(!de2::IsTriviallyRelocatable<FSelfRefComponent>::value);
+	static_assert(de2::IsTriviallyRelocatable<FRelocatableComponent>::value);
+	static_assert(!std::is_trivially_copyable_v<FRelocatableComponent>);
+	auto isRemoved = [](uint32_t i) { return i % 3 == 0 || (i / 500) % 4 == 1; };
+	{
+		de2::DOECS ecs;
+		auto entities = BuildRelocatedPool(ecs, 20000);
+		CHECK(FSelfRefComponent::LiveCount == (int)entities.size());
+		CHECK(FRelocatableComponent::LiveCount == (int)entities.size());
+		FSelfRefComponent::MoveCount = 0;
+		FRelocatableComponent::MoveCount = 0;
+
+		uint32_t aliveCount = 0;
+		for (uint32_t i = 0; i < entities.size(); ++i) {
+			if (isRemoved(i))
+				ecs.RemoveEntity(entities[i]);
+			else
+				++aliveCount;
+		}
+		ecs.Flush();
+		auto flushMoveCount = FSelfRefComponent::MoveCount;
+		CHECK(flushMoveCount > 0);
+		CHECK(ecs.Defragment(std::chrono::seconds(10)));
+		CHECK(FSelfRefComponent::MoveCount > flushMoveCount);
+		CHECK(FRelocatableComponent::MoveCount == 0);
+		CHECK(FSelfRefComponent::LiveCount == (int)aliveCount);
+		CHECK(FRelocatableComponent::LiveCount == (int)aliveCount);
+
+		// Every row was constructed in place, and the components of a row stayed together.
+		bool relocated = true;
+		for (uint32_t i = 0; i < entities.size(); ++i) {
+			auto selfRef = ecs.ReadComponent<FSelfRefComponent>(entities[i]);
+			auto relocatable = ecs.ReadComponent<FRelocatableComponent>(entities[i]);
+			if (isRemoved(i)) {
+				relocated = relocated && !selfRef && !relocatable;
+				continue;
+			}
+			relocated = relocated && selfRef && relocatable && selfRef->Self == selfRef && selfRef->Key == i && relocatable->Key == i;
+		}
+		CHECK(relocated);
+	}
+	CHECK(FSelfRefComponent::LiveCount == 0);
+	CHECK(FRelocatableComponent::LiveCount == 0);
+}
+
+namespace
+{
+	// Longer than the small string buffer, so every copy owns heap memory and a missed destructor or a double free shows.
+	struct FTagComponent
+	{
+		std::string Value;
+	};
+
+	std::string MakeTag(uint32_t i)
+	{
+		return "tag number " + std::to_string(i) + " of the string component test";
+	}
+}
+
+// Non trivially copyable components through Gather/Scatter, snapshots, removal, Defragment and SortPool.
+TEST_CASE(Relocate_StringComponentLifecycle)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FTagComponent, FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (uint32_t i = 0; i < 6000; ++i) {
+		entities.push_back(ecs.AddEntity(FTagComponent{ MakeTag(i) }, FPositionComponent{ (float)i, 0.f, 0.f }));
+	}
+	auto snapshot = ecs.Snapshot();
+
+	// Gather assigns into constructed strings.
+	std::vector<FTagComponent> tags(entities.size(), FTagComponent{ "not gathered" });
+	CHECK(ecs.Gather(entities.data(), entities.size(), tags.data()) == entities.size());
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		CHECK(tags[i].Value == MakeTag(i));
+		tags[i].Value += " scattered";
+	}
+	// Scatter detaches the snapshotted chunks.
+	CHECK(ecs.Scatter(entities.data(), entities.size(), tags.data()) == entities.size());
+
+	for (uint32_t i = 0; i < entities.size(); i += 3) {
+		CHECK(ecs.RemoveEntity(entities[i]));
+	}
+	ecs.Flush();
+	CHECK(ecs.Defragment(std::chrono::seconds(10)));
+	// Reverses the order of the rows.
+	CHECK(ecs.SortPool<FTagComponent, FPositionComponent>([](const FTagComponent&, const FPositionComponent& pos) { return -pos.x; }));
+
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		auto tag = ecs.ReadComponent<FTagComponent>(entities[i]);
+		CHECK((tag == nullptr) == (i % 3 == 0));
+		if (tag)
+			CHECK(tag->Value == MakeTag(i) + " scattered");
+	}
+
+	// The snapshot still has the strings as they were.
+	uint32_t snapshotCount = 0;
+	for (uint32_t c = 0; c < snapshot.GetChunkCount(0); ++c) {
+		const void* components = nullptr;
+		const void* positions = nullptr;
+		auto count = snapshot.GetComponents(0, c, typeid(FTagComponent).hash_code(), components);
+		snapshot.GetComponents(0, c, typeid(FPositionComponent).hash_code(), positions);
+		for (uint32_t row = 0; row < count; ++row) {
+			auto i = (uint32_t)((const FPositionComponent*)positions)[row].x;
+			CHECK(((const FTagComponent*)components)[row].Value == MakeTag(i));
+		}
+		snapshotCount += count;
+	}
+	CHECK(snapshotCount == entities.size());
+}
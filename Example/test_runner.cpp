@@ -0,0 +1,33 @@
+#include <cstring>
+#include "test_runner.h"
+
+namespace test
+{
+	std::vector<TestCase>& GetTests()
+	{
+		static std::vector<TestCase> Tests;
+		return Tests;
+	}
+
+	int FailureCount = 0;
+}
+
+// Runs the tests whose name starts with argv[1], or every test. Returns 1 if a test failed.
+int main(int argc, char** argv)
+{
+	const char* prefix = argc > 1 ? argv[1] : "";
+	int failedTests = 0;
+	int runCount = 0;
+	for (auto& testCase : test::GetTests()) {
+		if (strncmp(testCase.Name, prefix, strlen(prefix)) != 0)
+			continue;
+		test::FailureCount = 0;
+		testCase.Fn();
+		++runCount;
+		std::printf("%s %s\n", test::FailureCount == 0 ? "[ OK ]" : "[FAIL]", testCase.Name);
+		if (test::FailureCount != 0)
+			++failedTests;
+	}
+	std::printf("%d of %d tests failed\n", failedTests, runCount);
+	return failedTests == 0 && runCount > 0 ? 0 : 1;
+}
@@ -0,0 +1,77 @@
+#pragma once
+// Feature tests of de2 and de, built into doecs_tests and registered with ctest per suite.
+// A test named Suite_Case runs with "doecs_tests Suite". See test_runner.cpp.
+#include <cstdio>
+#include <functional>
+#include <vector>
+#include "../doecs2.h"
+
+namespace test
+{
+	struct TestCase
+	{
+		const char* Name;
+		void (*Fn)();
+	};
+
+	std::vector<TestCase>& GetTests();
+	// Failed CHECKs of the running test.
+	extern int FailureCount;
+	// Heap allocations of doecs_tests so far, from any thread. See test_allocations.cpp.
+	uint64_t GetAllocationCount();
+
+	struct TestRegistrar
+	{
+		TestRegistrar(const char* name, void (*fn)())
+		{
+			GetTests().push_back({ name, fn });
+		}
+	};
+
+	//
+	// LambdaSystem
+	//
+	// System over ComponentTypes calling fn(entityCount, components). For tests which need a system inline.
+	template<typename ... ComponentTypes>
+	class LambdaSystem : public de2::ISystem
+	{
+		std::function<void(uint32_t, const de2::ComponentsArg&)> Fn;
+		de2::ExecutionPolicy Policy;
+
+	public:
+		LambdaSystem(std::function<void(uint32_t, const de2::ComponentsArg&)> fn, de2::ExecutionPolicy policy = {})
+			: Fn(std::move(fn))
+			, Policy(policy)
+		{}
+
+		std::size_t GetComponentHashes(const uint64_t*& pHashes) override
+		{
+			static const uint64_t ComponentHashes[] = { typeid(ComponentTypes).hash_code()... };
+			pHashes = ComponentHashes;
+			return sizeof...(ComponentTypes);
+		}
+
+		void Execute(uint32_t entityCount, const de2::ComponentsArg& components) override
+		{
+			Fn(entityCount, components);
+		}
+
+		de2::ExecutionPolicy GetExecutionPolicy() override
+		{
+			return Policy;
+		}
+	};
+}
+
+#define TEST_CASE(name) \
+	static void name(); \
+	static test::TestRegistrar name##Registrar(#name, name); \
+	static void name()
+
+#define CHECK(...) \
+	do { \
+		if (!(__VA_ARGS__)) { \
+			++test::FailureCount; \
+			std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #__VA_ARGS__); \
+		} \
+	} while (0)
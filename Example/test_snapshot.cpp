@@ -0,0 +1,102 @@
+#include "test_runner.h"
+#include "Components.h"
+#include "MovementSystem.h"
+
+namespace
+{
+	// Sum of the y of every position in the snapshot, and the number of positions.
+	float SumSnapshotY(const de2::WorldSnapshot& snapshot, uint32_t& count)
+	{
+		float sum = 0.f;
+		count = 0;
+		for (std::size_t p = 0; p < snapshot.GetPoolCount(); ++p) {
+			for (uint32_t c = 0; c < snapshot.GetChunkCount(p); ++c) {
+				const void* components = nullptr;
+				auto rowCount = snapshot.GetComponents(p, c, typeid(FPositionComponent).hash_code(), components);
+				auto positions = (const FPositionComponent*)components;
+				for (uint32_t i = 0; i < rowCount; ++i) {
+					sum += positions[i].y;
+				}
+				count += rowCount;
+			}
+		}
+		return sum;
+	}
+}
+
+TEST_CASE(Snapshot_WritesAfterSnapshotAreNotVisible)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 3000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+	}
+	auto snapshot = ecs.Snapshot();
+
+	MovementSystem2 movement;
+	ecs.RunSystem(&movement);
+	ecs.SetComponent(entities[0], FPositionComponent{ 0.f, 100.f, 0.f });
+
+	uint32_t count = 0;
+	CHECK(SumSnapshotY(snapshot, count) == 0.f);
+	CHECK(count == 3000);
+	CHECK(ecs.GetComponent<FPositionComponent>(entities[0])->y == 100.f);
+	CHECK(ecs.GetComponent<FPositionComponent>(entities[1])->y == 1.f);
+
+	auto snapshot2 = ecs.Snapshot();
+	CHECK(SumSnapshotY(snapshot2, count) == 100.f + 2999.f);
+}
+
+TEST_CASE(Snapshot_AddRemoveAfterSnapshot)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 2000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ 0.f, 1.f, 0.f }));
+	}
+	auto snapshot = ecs.Snapshot();
+	for (int i = 0; i < 2000; i += 2) {
+		ecs.RemoveEntity(entities[i]);
+	}
+	ecs.Flush();
+	for (int i = 0; i < 500; ++i) {
+		ecs.AddEntity(FPositionComponent{ 0.f, 5.f, 0.f });
+	}
+
+	uint32_t count = 0;
+	CHECK(SumSnapshotY(snapshot, count) == 2000.f);
+	CHECK(count == 2000);
+	auto snapshot2 = ecs.Snapshot();
+	CHECK(SumSnapshotY(snapshot2, count) == 1000.f + 2500.f);
+	CHECK(count == 1500);
+	for (int i = 1; i < 2000; i += 2) {
+		CHECK(ecs.GetComponent<FPositionComponent>(entities[i])->y == 1.f);
+	}
+}
+
+TEST_CASE(Snapshot_RunSystemAndOutliveWorld)
+{
+	de2::WorldSnapshot snapshot;
+	{
+		de2::DOECS ecs;
+		ecs.AddPool<FPositionComponent, FRotationComponent>();
+		ecs.AddPool<FPositionComponent>();
+		for (int i = 0; i < 100; ++i) {
+			ecs.AddEntity(FPositionComponent{ 0.f, 2.f, 0.f }, FRotationComponent{});
+			ecs.AddEntity(FPositionComponent{ 0.f, 3.f, 0.f });
+		}
+		snapshot = ecs.Snapshot();
+	}
+
+	float sum = 0.f;
+	test::LambdaSystem<FPositionComponent> reader([&sum](uint32_t count, const de2::ComponentsArg& components) {
+		auto positions = (const FPositionComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			sum += positions[i].y;
+		}
+	});
+	snapshot.RunSystem(&reader);
+	CHECK(sum == 500.f);
+}
@@ -0,0 +1,102 @@
+#include "test_runner.h"
+#include "Components.h"
+
+namespace
+{
+	constexpr uint32_t EntityCount = 20000;
+
+	// Entity i has HitPoint i and a shuffled position x.
+	std::vector<de2::EntityId> BuildShuffledPool(de2::DOECS& ecs)
+	{
+		ecs.AddPool<FPositionComponent, FLifeformComponent>();
+		std::vector<de2::EntityId> entities;
+		for (uint32_t i = 0; i < EntityCount; ++i) {
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)(i * 7919 % EntityCount), 0.f, 0.f }, FLifeformComponent{ i, 0 }));
+		}
+		return entities;
+	}
+
+	float GetKey(const FPositionComponent& pos, const FLifeformComponent&)
+	{
+		return pos.x;
+	}
+
+	// Positions in row order.
+	std::vector<float> GetRowOrder(de2::DOECS& ecs)
+	{
+		std::vector<float> order;
+		ecs.ForEach<FPositionComponent>([&order](de2::EntityId, FPositionComponent& pos) {
+			order.push_back(pos.x);
+		});
+		return order;
+	}
+
+	// The index follows the moved rows and the components of a row stay together.
+	bool CheckEntities(de2::DOECS& ecs, const std::vector<de2::EntityId>& entities)
+	{
+		for (uint32_t i = 0; i < entities.size(); ++i) {
+			auto pos = ecs.ReadComponent<FPositionComponent>(entities[i]);
+			auto lifeform = ecs.ReadComponent<FLifeformComponent>(entities[i]);
+			if (!pos || !lifeform || pos->x != (float)(i * 7919 % EntityCount) || lifeform->HitPoint != i)
+				return false;
+		}
+		return true;
+	}
+}
+
+TEST_CASE(Sort_WholePool)
+{
+	de2::DOECS ecs;
+	auto entities = BuildShuffledPool(ecs);
+	CHECK(ecs.SortPool<FPositionComponent, FLifeformComponent>(GetKey));
+	auto order = GetRowOrder(ecs);
+	CHECK(order.size() == EntityCount);
+	CHECK(std::is_sorted(order.begin(), order.end()));
+	CHECK(CheckEntities(ecs, entities));
+	// Not an archetype of the world.
+	CHECK(!ecs.SortPool<FPositionComponent>([](const FPositionComponent& pos) { return pos.x; }));
+}
+
+// A few chunk pairs per call ends in the same order as the whole sort.
+TEST_CASE(Sort_SpreadOverCalls)
+{
+	de2::DOECS ecs;
+	auto entities = BuildShuffledPool(ecs);
+	uint32_t callCount = 1;
+	while (!ecs.SortPool<FPositionComponent, FLifeformComponent>(GetKey, 2) && callCount < 10000) {
+		++callCount;
+	}
+	CHECK(callCount > 1 && callCount < 10000);
+	auto order = GetRowOrder(ecs);
+	CHECK(order.size() == EntityCount);
+	CHECK(std::is_sorted(order.begin(), order.end()));
+	CHECK(CheckEntities(ecs, entities));
+}
+
+// Pending removals block the sort. A snapshot keeps the order it was taken in.
+TEST_CASE(Sort_PendingRemovalsAndSnapshot)
+{
+	de2::DOECS ecs;
+	auto entities = BuildShuffledPool(ecs);
+	CHECK(ecs.RemoveEntity(entities.back()));
+	CHECK(!ecs.SortPool<FPositionComponent, FLifeformComponent>(GetKey));
+	ecs.Flush();
+	entities.pop_back();
+
+	auto before = GetRowOrder(ecs);
+	auto snapshot = ecs.Snapshot();
+	CHECK(ecs.SortPool<FPositionComponent, FLifeformComponent>(GetKey));
+	auto order = GetRowOrder(ecs);
+	CHECK(std::is_sorted(order.begin(), order.end()));
+	CHECK(CheckEntities(ecs, entities));
+
+	std::vector<float> snapshotOrder;
+	for (uint32_t c = 0; c < snapshot.GetChunkCount(0); ++c) {
+		const void* components = nullptr;
+		auto count = snapshot.GetComponents(0, c, typeid(FPositionComponent).hash_code(), components);
+		for (uint32_t row = 0; row < count; ++row) {
+			snapshotOrder.push_back(((const FPositionComponent*)components)[row].x);
+		}
+	}
+	CHECK(snapshotOrder == before);
+}
@@ -0,0 +1,108 @@
+#include "test_runner.h"
+#include "Components.h"
+
+struct FStunTestComponent
+{
+	float Remaining;
+};
+DeclareSparseComponent(FStunTestComponent);
+
+struct FTargetTestComponent
+{
+	de2::EntityId Target;
+};
+DeclareSparseComponent(FTargetTestComponent);
+
+TEST_CASE(Sparse_AddOverwriteRemove)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	std::vector<de2::EntityId> entities;
+	for (uint32_t i = 0; i < 5000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+	}
+	CHECK(ecs.AddComponent(de2::INVALID_ENTITY_ID - 1, FStunTestComponent{ 1.f }) == nullptr);
+	CHECK(ecs.GetComponent<FStunTestComponent>(entities[0]) == nullptr);
+	CHECK(!ecs.RemoveComponent<FStunTestComponent>(entities[0]));
+
+	// Spread over many pages.
+	for (uint32_t i = 0; i < entities.size(); i += 3) {
+		CHECK(ecs.AddComponent(entities[i], FStunTestComponent{ (float)i })->Remaining == (float)i);
+	}
+	CHECK(ecs.AddComponent(entities[3], FStunTestComponent{ -3.f })->Remaining == -3.f);
+	CHECK(ecs.SetComponent(entities[1], FStunTestComponent{ 1.f }) == nullptr);
+	CHECK(ecs.SetComponent(entities[6], FStunTestComponent{ -6.f })->Remaining == -6.f);
+	// The removed component is replaced by the last one, whose entity must still find it.
+	for (uint32_t i = 0; i < entities.size(); i += 6) {
+		CHECK(ecs.RemoveComponent<FStunTestComponent>(entities[i]));
+		CHECK(!ecs.RemoveComponent<FStunTestComponent>(entities[i]));
+	}
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		auto stun = ecs.GetComponent<FStunTestComponent>(entities[i]);
+		CHECK((stun != nullptr) == (i % 3 == 0 && i % 6 != 0));
+		if (stun)
+			CHECK(stun->Remaining == (i == 3 ? -3.f : (float)i));
+		CHECK(ecs.GetComponent<FPositionComponent>(entities[i])->x == (float)i);
+	}
+
+	// Removing the entity removes its sparse components at Flush().
+	CHECK(ecs.RemoveEntity(entities[9]));
+	ecs.Flush();
+	CHECK(ecs.GetComponent<FStunTestComponent>(entities[9]) == nullptr);
+	CHECK(ecs.GetComponent<FStunTestComponent>(entities[15])->Remaining == 15.f);
+}
+
+// ForEach gives the same entities whether the sparse set or the pools are the smaller side.
+TEST_CASE(Sparse_ForEach)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent>();
+	ecs.AddPool<FPositionComponent, FLifeformComponent>();
+	ecs.AddPool<FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (uint32_t i = 0; i < 6000; ++i) {
+		if (i % 3 == 0)
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }));
+		else if (i % 3 == 1)
+			entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FLifeformComponent{ i, i }));
+		else
+			entities.push_back(ecs.AddEntity(FRotationComponent{}));
+	}
+	// Few stunned entities, every entity has a target.
+	for (uint32_t i = 0; i < entities.size(); ++i) {
+		if (i % 50 == 0)
+			ecs.AddComponent(entities[i], FStunTestComponent{ 1.f });
+		ecs.AddComponent(entities[i], FTargetTestComponent{ entities[i] });
+	}
+
+	std::vector<de2::EntityId> stunned;
+	auto visitedCount = ecs.ForEach<FPositionComponent, FStunTestComponent>([&stunned](de2::EntityId entity, FPositionComponent& pos, FStunTestComponent& stun) {
+		stunned.push_back(entity);
+		stun.Remaining = pos.x;
+	});
+	CHECK(visitedCount == stunned.size());
+	std::vector<de2::EntityId> expected;
+	for (uint32_t i = 0; i < entities.size(); i += 50) {
+		if (i % 3 != 2)
+			expected.push_back(entities[i]);
+	}
+	std::sort(stunned.begin(), stunned.end());
+	std::sort(expected.begin(), expected.end());
+	CHECK(stunned == expected);
+	CHECK(ecs.GetComponent<FStunTestComponent>(entities[150])->Remaining == 150.f);
+
+	// The pools with a lifeform are the smaller side.
+	uint32_t targetCount = 0;
+	visitedCount = ecs.ForEach<FLifeformComponent, FTargetTestComponent>([&targetCount](de2::EntityId entity, FLifeformComponent& lifeform, FTargetTestComponent& target) {
+		CHECK(target.Target == entity);
+		CHECK(lifeform.HitPoint % 3 == 1);
+		++targetCount;
+	});
+	CHECK(visitedCount == 2000 && targetCount == 2000);
+
+	// Only sparse components.
+	visitedCount = ecs.ForEach<FStunTestComponent, FTargetTestComponent>([](de2::EntityId entity, FStunTestComponent&, FTargetTestComponent& target) {
+		CHECK(target.Target == entity);
+	});
+	CHECK(visitedCount == 120);
+}
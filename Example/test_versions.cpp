@@ -0,0 +1,97 @@
+#include "test_runner.h"
+#include "Components.h"
+#include "../doecs2_spatial.h"
+
+namespace
+{
+	// Chunks of the pools with a position whose position column changed since epochs, which are advanced.
+	std::size_t CountChangedPositionChunks(de2::DOECS& ecs, std::unordered_map<uint64_t, uint64_t>& epochs)
+	{
+		std::size_t changedCount = 0;
+		ecs.ForEachPoolWith(typeid(FPositionComponent).hash_code(), [&](uint64_t poolHash, de2::impl::IArchetypePool* pool) {
+			std::vector<de2::impl::ChangedChunk> changed;
+			uint32_t chunkCount = 0;
+			epochs[poolHash] = pool->GetChangedChunks(typeid(FPositionComponent).hash_code(), epochs[poolHash], changed, chunkCount);
+			changedCount += changed.size();
+		});
+		return changedCount;
+	}
+}
+
+// Accessing one column doesn't mark the other columns of the chunk written.
+TEST_CASE(Versions_OnlyWrittenColumnsChange)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 5000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)i, 0.f, 0.f }, FRotationComponent{}));
+	}
+	std::unordered_map<uint64_t, uint64_t> epochs;
+	CHECK(CountChangedPositionChunks(ecs, epochs) > 1);
+	CHECK(CountChangedPositionChunks(ecs, epochs) == 0);
+
+	test::LambdaSystem<FRotationComponent> spin([](uint32_t count, const de2::ComponentsArg& components) {
+		auto rotations = (FRotationComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			rotations[i].w += 1.f;
+		}
+	});
+	ecs.AddSystem(&spin);
+	ecs.RunSystems();
+	ecs.RemoveSystem(&spin);
+	std::vector<FRotationComponent> rotations(entities.size());
+	CHECK(ecs.Scatter(entities.data(), entities.size(), rotations.data()) == entities.size());
+	std::vector<FPositionComponent> positions(entities.size());
+	CHECK(ecs.Gather(entities.data(), entities.size(), positions.data()) == entities.size());
+	CHECK(ecs.GetComponent<FRotationComponent>(entities[0]) != nullptr);
+	CHECK(ecs.ReadComponent<FPositionComponent>(entities[1])->x == 1.f);
+	CHECK(CountChangedPositionChunks(ecs, epochs) == 0);
+
+	ecs.SetComponent(entities[4999], FPositionComponent{ 1.f, 2.f, 3.f });
+	CHECK(CountChangedPositionChunks(ecs, epochs) == 1);
+	ecs.GetComponent<FPositionComponent>(entities[0])->y = 1.f;
+	CHECK(CountChangedPositionChunks(ecs, epochs) == 1);
+
+	// Moving rows changes every column.
+	ecs.RemoveEntity(entities[0]);
+	ecs.Flush();
+	CHECK(CountChangedPositionChunks(ecs, epochs) >= 1);
+}
+
+// A system over rotations doesn't make the grid re-index the position chunks.
+TEST_CASE(Versions_SpatialGridSkipsUnrelatedWrites)
+{
+	de2::DOECS ecs;
+	ecs.AddPool<FPositionComponent, FRotationComponent>();
+	std::vector<de2::EntityId> entities;
+	for (int i = 0; i < 5000; ++i) {
+		entities.push_back(ecs.AddEntity(FPositionComponent{ (float)(i % 100), (float)(i / 100), 0.f }, FRotationComponent{}));
+	}
+	de2::SpatialGrid<FPositionComponent> grid(10.f);
+	CHECK(grid.Update(ecs) > 1);
+	CHECK(grid.GetEntityCount() == entities.size());
+
+	test::LambdaSystem<FRotationComponent> spin([](uint32_t count, const de2::ComponentsArg& components) {
+		auto rotations = (FRotationComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			rotations[i].w += 1.f;
+		}
+	});
+	ecs.AddSystem(&spin);
+	ecs.RunSystems();
+	CHECK(grid.Update(ecs) == 0);
+
+	test::LambdaSystem<FPositionComponent> mover([](uint32_t count, const de2::ComponentsArg& components) {
+		auto positions = (FPositionComponent*)components[0];
+		for (uint32_t i = 0; i < count; ++i) {
+			positions[i].z += 1.f;
+		}
+	});
+	ecs.AddSystem(&mover);
+	ecs.RunSystems();
+	CHECK(grid.Update(ecs) > 1);
+	CHECK(grid.GetEntityCount() == entities.size());
+	ecs.RemoveSystem(&mover);
+	ecs.RemoveSystem(&spin);
+}
@@ -9,8 +9,12 @@
 #include <unordered_map>
 #include <vector>
 #include <array>
+#include <tuple>
 #include <cstdlib>
+#include <cstring>
+#include <algorithm>
 #include <mutex>
+#include <atomic>
 #include <assert.h>
 
 // Create a cpp file and define IMPLEMENT_DOECS then include this header file.
@@ -25,17 +29,32 @@ namespace de
 		constexpr int ChunkSize = 16 * 1024; // Usually CPU has 32 kb L1 cache and I decide to use half of it.
 		constexpr int CacheLineSize = 64;
 		class FEntityIdGen {
-			std::mutex Mutex;
-			EntityId NextId = 1;
+			std::atomic<EntityId> NextId = 1;
 
 		public:
+			// Ids handed to a thread at once by GenBlock.
+			static constexpr EntityId BlockSize = 64;
+
 			FEntityIdGen() = default;
 			FEntityIdGen(EntityId startId)
 				: NextId(startId) {}
 
 			EntityId Gen() {
-				std::lock_guard l(Mutex);
-				return NextId++;
+				return NextId.fetch_add(1, std::memory_order_relaxed);
+			}
+
+			// Ids from a block owned by the calling thread.
+			// Threads creating many entities do not contend on NextId, and their ids are mostly consecutive.
+			EntityId GenBlock() {
+				thread_local FEntityIdGen* owner = nullptr;
+				thread_local EntityId next = 0;
+				thread_local EntityId end = 0;
+				if (owner != this || next == end) {
+					owner = this;
+					next = NextId.fetch_add(BlockSize, std::memory_order_relaxed);
+					end = next + BlockSize;
+				}
+				return next++;
 			}
 		};
 		extern FEntityIdGen EntityIdGen;
@@ -104,6 +123,18 @@ namespace de
 		{
 		};
 
+		template<typename Types, typename CheckingType>
+		struct has_any_type;
+
+		template<typename... Types, typename CheckingType>
+		struct has_any_type<std::tuple<Types...>, CheckingType> : std::disjunction<has_type<Types, CheckingType>...> {};
+
+		// The pool has all required and none of the excluded components of the system.
+		template<typename SystemType, typename PoolTuple>
+		struct matches_system : std::bool_constant<
+			has_all_type<typename SystemType::Tuple, PoolTuple>::value &&
+			!has_any_type<typename SystemType::ExcludedTuple, PoolTuple>::value> {};
+
 		template<std::size_t N, typename T, typename... types>
 		struct GetNthType
 		{
@@ -125,23 +156,28 @@ namespace de
 		public:
 			using Tuple = std::tuple<ComponentTypes...>;
 			static constexpr uint32_t EntitySize = SizeOf<ComponentTypes...>::Value;
-			static constexpr uint32_t ElementCountPerChunk = (ChunkSize - sizeof(void*) - sizeof(uint32_t)) / EntitySize;
+			// Count, Prev and Next are the header. Every row also stores its entity id.
+			static constexpr uint32_t ElementCountPerChunk = (ChunkSize - sizeof(void*) * 2 - sizeof(uint32_t)) / (EntitySize + sizeof(EntityId));
 			static constexpr uint32_t ComponentCount = sizeof...(ComponentTypes);
 
 			struct Chunk
 			{
 			public:
 				std::tuple<std::array<ComponentTypes, ElementCountPerChunk>...> Components;
-				uint32_t Count = 0;
-				Chunk* Next = nullptr;
+				// Entity id of each row.
+				std::array<EntityId, ElementCountPerChunk> Entities;
+				// Rows are reserved with compare-exchange so that CreateEntity can run on many threads.
+				std::atomic<uint32_t> Count = 0;
+				Chunk* Prev = nullptr;
+				std::atomic<Chunk*> Next = nullptr;
 
 				void* operator new(std::size_t size)
 				{
 #ifdef _MSC_VER
 					return _aligned_malloc(size, CacheLineSize);
 #else
-					// not tested.
-					return std::aligned_alloc(size, CacheLineSize);
+					// aligned_alloc requires the size to be a multiple of the alignment.
+					return std::aligned_alloc(CacheLineSize, (size + CacheLineSize - 1) / CacheLineSize * CacheLineSize);
 #endif
 				}
 
@@ -161,19 +197,37 @@ namespace de
 					return &std::get<std::array<ComponentType, ElementCountPerChunk>>(Components)[index];
 				}
 
-				void DeleteChunkHierarchy()
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> CopyRow(uint32_t dest, const Chunk& srcChunk, uint32_t src)
 				{
-					if (!Next)
-						return;
-					Next->DeleteChunkHierarchy();
-					delete Next;
-					Next = nullptr;
+				}
+
+				// Copies a row from another chunk, or from this chunk.
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> CopyRow(uint32_t dest, const Chunk& srcChunk, uint32_t src)
+				{
+					auto& componentArray = std::get<I>(Components);
+					memcpy(&componentArray[dest], &std::get<I>(srcChunk.Components)[src],
+						sizeof(typename std::remove_reference_t<decltype(componentArray)>::value_type));
+					CopyRow<I + 1>(dest, srcChunk, src);
 				}
 			};
 
 			static_assert(sizeof(Chunk) <= ChunkSize, "Invalid chunk size. Array alignment problem?");
+
+			// EntityToComponent is split by id block so that threads creating entities rarely share a lock.
+			static constexpr uint32_t IndexShardBits = 4;
+			static constexpr uint32_t IndexShardCount = 1 << IndexShardBits;
+			struct alignas(CacheLineSize) IndexShard
+			{
+				std::mutex Mutex;
+				std::unordered_map<EntityId, std::pair<Chunk*, uint32_t> > EntityToComponent;
+			};
+
 			Chunk* RootChunk;
-			std::unordered_map<EntityId, std::pair<Chunk*, uint32_t> > EntityToComponent;
+			// Every chunk before LastChunk is full. Rows are added to and removed from the end of LastChunk.
+			std::atomic<Chunk*> LastChunk = nullptr;
+			std::array<IndexShard, IndexShardCount> Index;
 			std::vector<EntityId> PendingRemove;
 			std::mutex Mutex;
 
@@ -186,93 +240,164 @@ namespace de
 			void Initialize()
 			{
 				assert(!RootChunk);
-				RootChunk = new Chunk;
+				RootChunk = LastChunk = new Chunk;
 			}
 
 			void Destroy()
 			{
 				if (!RootChunk)
 					return;
-				auto next = RootChunk->Next;
+				Chunk* next = RootChunk->Next;
 				delete RootChunk;
-				RootChunk = nullptr;
+				RootChunk = LastChunk = nullptr;
 				while (next)
 				{
 					auto p = next;
-					delete p;
 					next = next->Next;
+					delete p;
 				}
+				for (auto& shard : Index) {
+					shard.EntityToComponent.clear();
+				}
+				PendingRemove.clear();
 			}
 
+			IndexShard& GetIndexShard(EntityId id)
+			{
+				// Fibonacci hashing of the id block. A plain modulo makes the keys of a shard strided, which slows the maps down.
+				return Index[((id / FEntityIdGen::BlockSize) * 0x9E3779B97F4A7C15ull) >> (64 - IndexShardBits)];
+			}
+
+			// Each removed row is filled with the last row of the pool. O(1) per removed entity.
+			// Moves rows and reads the index without the shard locks, so it must not run concurrently with
+			// CreateEntity, HasEntity, GetComponent or RemoveEntity.
 			void Flush()
 			{
 				std::sort(PendingRemove.begin(), PendingRemove.end());
 				PendingRemove.erase(std::unique(PendingRemove.begin(), PendingRemove.end()), PendingRemove.end());
-				while (!PendingRemove.empty()) {
-					auto rit = PendingRemove.rbegin();
-					int consecutiveCount = 1;
-					void* chunk;
-					uint32_t index;
-					auto has = HasEntity(*rit, chunk, index);
-					assert(has);
-					++rit;
-					for ( ; rit != PendingRemove.rend(); ++rit)
-					{
-						void* chunk2;
-						uint32_t index2;
-						has = HasEntity(*rit, chunk2, index2);
-						assert(has);
-						if (chunk == chunk2 && index2 + 1 == index) {
-							++consecutiveCount;
-							index = index2;
-						}
-						else {
-							break;
-						}
+				Chunk* lastChunk = LastChunk;
+				for (auto entity : PendingRemove) {
+					auto& entityToComponent = GetIndexShard(entity).EntityToComponent;
+					auto it = entityToComponent.find(entity);
+					assert(it != entityToComponent.end());
+					auto chunk = it->second.first;
+					auto index = it->second.second;
+					entityToComponent.erase(it);
+
+					auto lastIndex = lastChunk->Count - 1;
+					if (chunk != lastChunk || index != lastIndex) {
+						chunk->CopyRow(index, *lastChunk, lastIndex);
+						auto movedEntity = lastChunk->Entities[lastIndex];
+						chunk->Entities[index] = movedEntity;
+						GetIndexShard(movedEntity).EntityToComponent[movedEntity] = { chunk, index };
+					}
+					--lastChunk->Count;
+
+					if (lastChunk->Count == 0 && lastChunk != RootChunk) {
+						auto emptyChunk = lastChunk;
+						lastChunk = emptyChunk->Prev;
+						lastChunk->Next = nullptr;
+						delete emptyChunk;
 					}
-					PendingRemove.erase(PendingRemove.end() - consecutiveCount, PendingRemove.end());
-					Memmove((Chunk*)chunk, index, consecutiveCount);
 				}
+				LastChunk = lastChunk;
+				PendingRemove.clear();
 			}
 
+			// Thread safe against other CreateEntity calls and against HasEntity, GetComponent and RemoveEntity,
+			// which take the shard lock. Systems and Flush must not run at the same time.
 			EntityId CreateEntity()
 			{
 				static_assert(ElementCountPerChunk > 50, "Entity is too big");
-				auto entityId = EntityIdGen.Gen();
-				auto chunk = RootChunk;
-				while (chunk)
+				auto entityId = EntityIdGen.GenBlock();
+				auto chunk = LastChunk.load(std::memory_order_acquire);
+				uint32_t componentIndex;
+				while (true)
 				{
-					if (chunk->Count < ElementCountPerChunk)
-					{
-						auto componentIndex = chunk->Count++;
-						EntityToComponent[entityId] = { chunk, componentIndex };
-						return entityId;
+					componentIndex = chunk->Count.load(std::memory_order_relaxed);
+					if (componentIndex < ElementCountPerChunk) {
+						if (chunk->Count.compare_exchange_weak(componentIndex, componentIndex + 1, std::memory_order_relaxed))
+							break;
+						continue;
 					}
-					if (!chunk->Next)
+
+					auto next = chunk->Next.load(std::memory_order_acquire);
+					if (!next)
 					{
-						// create new chunk
-						chunk->Next = new Chunk;
+						// create new chunk. The thread which loses the race uses the winner's chunk.
+						auto newChunk = new Chunk;
+						newChunk->Prev = chunk;
+						if (chunk->Next.compare_exchange_strong(next, newChunk, std::memory_order_acq_rel))
+							next = newChunk;
+						else
+							delete newChunk;
 					}
+					auto expected = chunk;
+					LastChunk.compare_exchange_strong(expected, next, std::memory_order_acq_rel);
+					chunk = next;
+				}
+				chunk->Entities[componentIndex] = entityId;
+				auto& shard = GetIndexShard(entityId);
+				std::lock_guard l(shard.Mutex);
+				shard.EntityToComponent[entityId] = { chunk, componentIndex };
+				return entityId;
+			}
+
+			// Array of the component in the chunk. nullptr if the pool does not have the component.
+			template<typename ComponentType>
+			static ComponentType* GetComponentsOrNull(Chunk* chunk)
+			{
+				if constexpr (has_type<ComponentType, Tuple>::value)
+					return &std::get<std::array<ComponentType, ElementCountPerChunk>>(chunk->Components)[0];
+				else
+					return nullptr;
+			}
+
+			template<typename SystemType, typename ... SystemComponentTypes, typename ... OptionalComponentTypes>
+			static void ExecuteChunk(SystemType* system, Chunk* chunk, std::tuple<SystemComponentTypes...> dummy, std::tuple<OptionalComponentTypes...> optionalDummy)
+			{
+				system->Execute(chunk->Count, &std::get< std::array<SystemComponentTypes, ElementCountPerChunk>>(chunk->Components)[0]...,
+					GetComponentsOrNull<OptionalComponentTypes>(chunk)...);
+			}
+
+			template<typename SystemType>
+			static void ExecuteChunkIfMatches(SystemType* system, Chunk* chunk)
+			{
+				if constexpr (matches_system<SystemType, Tuple>::value)
+					ExecuteChunk(system, chunk, typename SystemType::Tuple{}, typename SystemType::OptionalTuple{});
+			}
+
+			template<typename SystemType, typename ... SystemComponentTypes, typename ... OptionalComponentTypes>
+			void RunSystem(SystemType* system, std::tuple<SystemComponentTypes...> dummy, std::tuple<OptionalComponentTypes...> optionalDummy = {})
+			{
+				Chunk* chunk = RootChunk;
+				while (chunk)
+				{
+					ExecuteChunk(system, chunk, dummy, optionalDummy);
 					chunk = chunk->Next;
 				}
-				return INVALID_ENTITY_ID;
 			}
 
-			template<typename SystemType, typename ... ComponentTypes>
-			void RunSystem(SystemType* system, std::tuple<ComponentTypes...> dummy)
+			// Runs the matching systems in order on a chunk before moving to the next chunk,
+			// so the chunk is still in cache for the second and later systems.
+			template<typename ... SystemTypes>
+			void RunSystems(SystemTypes* ... systems)
 			{
-				auto chunk = RootChunk;
+				Chunk* chunk = RootChunk;
 				while (chunk)
 				{
-					system->Execute(chunk->Count, &std::get< std::array<ComponentTypes, ElementCountPerChunk>>(chunk->Components)[0]...);
+					(ExecuteChunkIfMatches(systems, chunk), ...);
 					chunk = chunk->Next;
 				}
 			}
 
 			bool HasEntity(EntityId id, void*& chunk, uint32_t& index)
 			{
-				auto it = EntityToComponent.find(id);
-				if (it != EntityToComponent.end())
+				auto& shard = GetIndexShard(id);
+				std::lock_guard l(shard.Mutex);
+				auto& entityToComponent = shard.EntityToComponent;
+				auto it = entityToComponent.find(id);
+				if (it != entityToComponent.end())
 				{
 					chunk = it->second.first;
 					index = it->second.second;
@@ -281,66 +406,7 @@ namespace de
 				return false;
 			}
 
-			template<std::size_t I>
-			void MemmoveRecursive(Chunk* chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{
-				assert(consecutiveCount >= 1);
-				auto numNeedToMove = (chunk->Count - (removingIndex + consecutiveCount));
-				if (chunk->Count == ElementCountPerChunk) {
-					if (numNeedToMove) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						memmove(&componentArray[removingIndex],
-							&componentArray[removingIndex + consecutiveCount],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numNeedToMove);
-					}
-					if (chunk->Next && chunk->Next->Count > 0) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						auto nextChunk = chunk->Next;
-						auto& nextComponentArray = std::get<I>(nextChunk->Components);
-						auto numCopyFromNextChunk = std::min(consecutiveCount, nextChunk->Count);
-						memcpy(&componentArray[ElementCountPerChunk - consecutiveCount],
-							&nextComponentArray[0],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numCopyFromNextChunk);
-						MemmoveRecursive<I>(nextChunk, 0, numCopyFromNextChunk);
-					}
-					else
-					{
-						if constexpr (I == sizeof...(ComponentTypes) - 1) {
-							assert(chunk->Count >= consecutiveCount);
-							chunk->Count -= consecutiveCount;
-						}
-					}
-				}
-				else {
-					if (numNeedToMove) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						memmove(&componentArray[removingIndex],
-							&componentArray[removingIndex + consecutiveCount],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numNeedToMove);
-					}
-					if constexpr (I == sizeof...(ComponentTypes) - 1)
-					{
-						assert(chunk->Count >= consecutiveCount);
-						chunk->Count -= consecutiveCount;
-						if (chunk->Next) {
-							chunk->DeleteChunkHierarchy();
-						}
-					}
-				}
-			}
-
-			template<std::size_t I>
-			std::enable_if_t<I == sizeof...(ComponentTypes)> Memmove(Chunk* chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{				
-			}
-
-			template<std::size_t I = 0>
-			std::enable_if_t<I < sizeof...(ComponentTypes)> Memmove(Chunk * chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{
-				MemmoveRecursive<I>(chunk, removingIndex, consecutiveCount);
-				Memmove<I + 1>(chunk, removingIndex, consecutiveCount);
-			}
-
+			// Two threads removing the same entity both push it. Flush drops the duplicate.
 			bool RemoveEntity(EntityId id)
 			{
 				void* chunk;
@@ -370,14 +436,31 @@ namespace de
 		typename std::enable_if_t < I < sizeof...(Tp)> RunSystemImpl(SystemType* system, std::tuple<Tp...>& pools)
 		{
 			auto& pool = std::get<I>(pools);
-			if constexpr (has_all_type<SystemType::Tuple, std::remove_reference<decltype(pool)>::type::Tuple>::value)
+			if constexpr (matches_system<SystemType, typename std::remove_reference<decltype(pool)>::type::Tuple>::value)
 			{
-				pool.RunSystem(system, SystemType::Tuple{});
+				pool.RunSystem(system, typename SystemType::Tuple{}, typename SystemType::OptionalTuple{});
 			}
 
 			RunSystemImpl<I + 1>(system, pools);
 		}
 
+		template<std::size_t I, typename... Tp, typename ... SystemTypes>
+		typename std::enable_if_t<I == sizeof...(Tp)> RunSystemsImpl(std::tuple<Tp...>& pools, SystemTypes* ... systems)
+		{ }
+
+		template<std::size_t I = 0, typename... Tp, typename ... SystemTypes>
+		typename std::enable_if_t < I < sizeof...(Tp)> RunSystemsImpl(std::tuple<Tp...>& pools, SystemTypes* ... systems)
+		{
+			auto& pool = std::get<I>(pools);
+			using PoolTuple = typename std::remove_reference<decltype(pool)>::type::Tuple;
+			if constexpr ((matches_system<SystemTypes, PoolTuple>::value || ...))
+			{
+				pool.RunSystems(systems...);
+			}
+
+			RunSystemsImpl<I + 1>(pools, systems...);
+		}
+
 		template<std::size_t I = 0, typename ... PoolTypes>
 		inline typename std::enable_if<I == sizeof...(PoolTypes)>::type
 			RemoveEntityImpl(EntityId entityId, std::tuple<PoolTypes...>& pools)
@@ -410,11 +493,11 @@ namespace de
 			auto& pool = std::get<I>(pools);
 			[[maybe_unused]] void* chunk;
 			[[maybe_unused]] uint32_t index;
-			if constexpr (has_type<ComponentType, std::remove_reference_t<decltype(pool)>::Tuple>::value)
+			if constexpr (has_type<ComponentType, typename std::remove_reference_t<decltype(pool)>::Tuple>::value)
 			{
 				if (pool.HasEntity(entityId, chunk, index))
 				{
-					return pool.GetComponent<ComponentType>(chunk, index);
+					return pool.template GetComponent<ComponentType>(chunk, index);
 				}
 			}
 
@@ -463,10 +546,16 @@ namespace de
 		}
 	}
 	
+	// Execute(count, ComponentTypes*..., OptionalComponentTypes*...) is called for every chunk of the matching pools.
+	// Pools with any of the excluded components are skipped. Optional components are nullptr for the pools without them.
+	// Redeclare ExcludedTuple or OptionalTuple in the system to use them.
+	// e.g. using ExcludedTuple = std::tuple<FWeaponComponent>;
 	template<typename ... ComponentTypes>
 	struct System
 	{
 		using Tuple = std::tuple<ComponentTypes...>;
+		using ExcludedTuple = std::tuple<>;
+		using OptionalTuple = std::tuple<>;
 	};
 
 	template<typename ... PoolTypes>
@@ -505,6 +594,15 @@ namespace de
 		impl::RunSystemImpl(system, entityPools);
 	}
 	
+	// Runs several systems in one pass over the chunks. Each chunk is given to the matching systems in order.
+	// Use it for systems which read and write the same components one after another.
+	// e.g. de::RunSystems(pools, &integrateSystem, &clampSystem);
+	template<typename EntityPoolsType, typename ... SystemTypes>
+	void RunSystems(EntityPoolsType& entityPools, SystemTypes* ... systems)
+	{
+		impl::RunSystemsImpl(entityPools, systems...);
+	}
+
 	template <typename ComponentType, typename EntityPoolsType>
 	ComponentType* GetComponent(EntityId entityId, EntityPoolsType& entityPools)
 	{
@@ -3,20 +3,307 @@
 // https://fastbirddev.blogspot.com
 
 // change this if you are not compiling DOECS as a part of a dll.
+#ifndef DOECS_IN_DLL
 #define DOECS_IN_DLL 1
+#endif
 
 #include "doecs2.h"
+#include <condition_variable>
+#include <deque>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 namespace de2
 {
 	namespace impl {
 		DLL_EXPORT FEntityIdGen EntityIdGen;
+		std::mutex GenerateEntityIdMutex;
 		DLL_EXPORT EntityId GenerateEntityId() //  If you get an error in this line, check the define 'DOECS_IN_DLL' at the top of this file.
 		{
-			static std::mutex Mutex;
-			std::lock_guard lock(Mutex);
+			std::lock_guard lock(GenerateEntityIdMutex);
 			return EntityIdGen.Gen();
 		}
+
+		DLL_EXPORT EntityId ReserveEntityIds(EntityId count)
+		{
+			std::lock_guard lock(GenerateEntityIdMutex);
+			return EntityIdGen.Reserve(count);
+		}
+
+		DLL_EXPORT void AdvanceEntityIds(EntityId next)
+		{
+			std::lock_guard lock(GenerateEntityIdMutex);
+			EntityIdGen.Advance(next);
+		}
+
+		DLL_EXPORT bool MapFile(const char* path, MappedFile& file)
+		{
+#ifdef _WIN32
+			HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+			if (handle == INVALID_HANDLE_VALUE)
+				return false;
+			LARGE_INTEGER size;
+			HANDLE mapping = nullptr;
+			if (GetFileSizeEx(handle, &size) && size.QuadPart > 0)
+				mapping = CreateFileMappingA(handle, nullptr, PAGE_WRITECOPY, 0, 0, nullptr);
+			CloseHandle(handle);
+			if (!mapping)
+				return false;
+			// Copy on write view. Pages are read from the file on first access.
+			auto data = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+			if (!data) {
+				CloseHandle(mapping);
+				return false;
+			}
+			file.Data = (char*)data;
+			file.Size = (std::size_t)size.QuadPart;
+			file.Handle = mapping;
+			return true;
+#else
+			int fd = open(path, O_RDONLY);
+			if (fd < 0)
+				return false;
+			struct stat st;
+			void* data = MAP_FAILED;
+			if (fstat(fd, &st) == 0 && st.st_size > 0)
+				data = mmap(nullptr, (std::size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+			close(fd);
+			if (data == MAP_FAILED)
+				return false;
+			file.Data = (char*)data;
+			file.Size = (std::size_t)st.st_size;
+			return true;
+#endif
+		}
+
+		DLL_EXPORT void UnmapFile(MappedFile& file)
+		{
+			if (!file.Data)
+				return;
+#ifdef _WIN32
+			UnmapViewOfFile(file.Data);
+			CloseHandle(file.Handle);
+#else
+			munmap(file.Data, file.Size);
+#endif
+			file = MappedFile();
+		}
+
+		// Largest arena of a worker so far.
+		std::atomic<std::size_t> SharedArenaCapacity = FrameArena::MinBlockSize;
+
+		// Resets the arena of a thread which runs the tasks of the workers, to at least the largest of those arenas.
+		void ResetSharedArena()
+		{
+			auto& arena = GetFrameArena();
+			auto capacity = arena.GetCapacity();
+			auto sharedCapacity = SharedArenaCapacity.load();
+			while (capacity > sharedCapacity && !SharedArenaCapacity.compare_exchange_weak(sharedCapacity, capacity)) {}
+			arena.Reset(std::max(capacity, sharedCapacity));
+		}
+
+		// Gives the arena of a thread which helps the workers as much free space as the arena of a worker,
+		// without releasing what the thread allocated in it.
+		void ReserveSharedArena()
+		{
+			GetFrameArena().Reserve(SharedArenaCapacity.load());
+		}
+
+		// Vectors of AcquireComponentsArg() by nesting depth. A deque, so a deeper one doesn't move those in use.
+		struct ComponentsArgStack
+		{
+			std::deque<ComponentsArg> Args;
+			std::size_t Depth = 0;
+		};
+
+		static ComponentsArgStack& GetComponentsArgStack()
+		{
+			thread_local ComponentsArgStack Stack;
+			return Stack;
+		}
+
+		DLL_EXPORT ComponentsArg& AcquireComponentsArg(std::size_t count)
+		{
+			auto& stack = GetComponentsArgStack();
+			if (stack.Depth == stack.Args.size())
+				stack.Args.emplace_back();
+			auto& components = stack.Args[stack.Depth++];
+			components.resize(count);
+			return components;
+		}
+
+		DLL_EXPORT void ReleaseComponentsArg()
+		{
+			auto& stack = GetComponentsArgStack();
+			assert(stack.Depth > 0);
+			--stack.Depth;
+		}
+
+		// Makes the ComponentsArgs of a thread which runs the tasks of the workers ready before its first task,
+		// so the thread which happens to run the systems for the first time in a steady frame doesn't allocate them.
+		void ReserveComponentsArgs()
+		{
+			constexpr std::size_t Depth = 4;
+			constexpr std::size_t ComponentCount = 16;
+			auto& stack = GetComponentsArgStack();
+			while (stack.Args.size() < Depth) {
+				stack.Args.emplace_back();
+				stack.Args.back().reserve(ComponentCount);
+			}
+		}
+
+		//
+		// WorkerPool
+		//
+		// Queued tasks are unordered. Taking one swaps it with the last, so the queue keeps its capacity
+		// and steady frames don't allocate.
+		class WorkerPool
+		{
+			struct Task
+			{
+				TaskFn Fn;
+				void* Context;
+				std::size_t Begin;
+				std::size_t End;
+				TaskGroup* Group;
+			};
+
+			std::mutex Mutex;
+			std::condition_variable TaskAdded;
+			std::condition_variable TaskDone;
+			std::vector<Task> Tasks;
+			std::vector<std::thread> Threads;
+			// Workers which reached WorkerMain(). Notified on TaskDone.
+			std::size_t StartedCount = 0;
+			bool Stopping = false;
+
+			void Run(Task task)
+			{
+				task.Fn(task.Context, task.Begin, task.End);
+				std::lock_guard l(Mutex);
+				// Notified under the lock, so a waiter can't miss it or destroy the group before it is read.
+				if (task.Group->Pending.fetch_sub(1) == 1)
+					TaskDone.notify_all();
+			}
+
+			void WorkerMain()
+			{
+				ResetSharedArena();
+				ReserveComponentsArgs();
+				std::unique_lock l(Mutex);
+				++StartedCount;
+				TaskDone.notify_all();
+				for (;;) {
+					TaskAdded.wait(l, [this]() { return Stopping || !Tasks.empty(); });
+					if (Tasks.empty())
+						return;
+					auto task = Tasks.back();
+					Tasks.pop_back();
+					l.unlock();
+					Run(task);
+					// Nothing a finished task allocated in the frame arena is used anymore.
+					ResetSharedArena();
+					l.lock();
+				}
+			}
+
+		public:
+			~WorkerPool()
+			{
+				{
+					std::lock_guard l(Mutex);
+					Stopping = true;
+				}
+				TaskAdded.notify_all();
+				for (auto& thread : Threads) {
+					thread.join();
+				}
+			}
+
+			// Returns once the new workers have their arena, so they don't allocate it in a later frame.
+			// The queue has room for a ParallelFor nested in every range of another, so how many tasks are queued
+			// at once, which depends on the scheduling, doesn't grow it in a steady frame.
+			void Reserve(uint32_t count)
+			{
+				std::unique_lock l(Mutex);
+				while (Threads.size() < count) {
+					Threads.emplace_back([this]() { WorkerMain(); });
+				}
+				Tasks.reserve((std::size_t)(Threads.size() + 1) * (Threads.size() + 1));
+				TaskDone.wait(l, [this]() { return StartedCount == Threads.size(); });
+			}
+
+			void Submit(TaskGroup& group, TaskFn fn, void* context, std::size_t begin, std::size_t end)
+			{
+				group.Pending.fetch_add(1);
+				{
+					std::lock_guard l(Mutex);
+					Tasks.push_back({ fn, context, begin, end, &group });
+				}
+				TaskAdded.notify_one();
+			}
+
+			void Wait(TaskGroup& group)
+			{
+				// The tasks of the group may run on this thread.
+				ReserveSharedArena();
+				ReserveComponentsArgs();
+				std::unique_lock l(Mutex);
+				while (group.Pending.load() > 0) {
+					auto it = std::find_if(Tasks.begin(), Tasks.end(), [&group](const Task& task) { return task.Group == &group; });
+					if (it == Tasks.end()) {
+						TaskDone.wait(l);
+						continue;
+					}
+					auto task = *it;
+					*it = Tasks.back();
+					Tasks.pop_back();
+					l.unlock();
+					{
+						// The arena of the waiting thread isn't ours to reset. Only what the task allocated is released.
+						FrameArenaScope arenaScope;
+						Run(task);
+					}
+					l.lock();
+				}
+			}
+		};
+
+		static WorkerPool& GetWorkerPool()
+		{
+			static WorkerPool Pool;
+			return Pool;
+		}
+
+		DLL_EXPORT void ReserveWorkers(uint32_t count)
+		{
+			GetWorkerPool().Reserve(count);
+		}
+
+		DLL_EXPORT void SubmitTask(TaskGroup& group, TaskFn fn, void* context, std::size_t begin, std::size_t end)
+		{
+			GetWorkerPool().Submit(group, fn, context, begin, end);
+		}
+
+		DLL_EXPORT void WaitTasks(TaskGroup& group)
+		{
+			GetWorkerPool().Wait(group);
+		}
+	}
+
+	DLL_EXPORT FrameArena& GetFrameArena()
+	{
+		thread_local FrameArena Arena;
+		return Arena;
 	}
 
 	DOECS::~DOECS()
@@ -25,5 +312,227 @@ namespace de2
 		{
 			delete p.second;
 		}
+		for (auto p : SparseSets)
+		{
+			delete p.second;
+		}
+		// The pools released the mapped chunks.
+		impl::UnmapFile(Image);
+	}
+
+	bool DOECS::SaveImage(const char* path)
+	{
+		DOECS_PROFILE_SCOPE(profileScope, "SaveImage", "Phase");
+		Flush();
+		std::vector<impl::IArchetypePool*> pools;
+		for (auto& pool : Pools) {
+			if (pool.second->GetEntityCount() == 0)
+				continue;
+			if (!pool.second->IsMappable())
+				return false;
+			pools.push_back(pool.second);
+		}
+
+		FILE* file = fopen(path, "wb");
+		if (!file)
+			return false;
+		uint64_t offset = 0;
+		bool written = true;
+		auto write = [&](const void* data, std::size_t size) {
+			if (written && size > 0)
+				written = fwrite(data, 1, size, file) == size;
+			offset += size;
+		};
+		auto pad = [&](uint64_t alignment) {
+			static const char zeros[impl::ImagePageSize] = {};
+			write(zeros, (std::size_t)((alignment - offset % alignment) % alignment));
+		};
+
+		impl::ImageHeader header = { impl::ImageMagic, (uint32_t)pools.size(), impl::ImageVersion, 1 };
+		std::vector<impl::ImagePool> descs(pools.size());
+		// Rewritten with the offsets at the end.
+		write(&header, sizeof(header));
+		write(descs.data(), descs.size() * sizeof(impl::ImagePool));
+		std::vector<impl::ImageEntity> index;
+		std::vector<impl::ImageColumn> columns;
+		for (std::size_t i = 0; i < pools.size() && written; ++i) {
+			pad(impl::ImagePageSize);
+			descs[i].ChunkOffset = offset;
+			index.clear();
+			written = pools[i]->WriteImage(file, descs[i], index);
+			offset += descs[i].ChunkCount * descs[i].ChunkStride;
+			descs[i].IndexOffset = offset;
+			write(index.data(), index.size() * sizeof(impl::ImageEntity));
+			for (auto& entity : index) {
+				header.NextEntityId = std::max(header.NextEntityId, entity.Entity + 1);
+			}
+			descs[i].ColumnOffset = offset;
+			columns.clear();
+			pools[i]->GetImageColumns(columns);
+			descs[i].ColumnCount = (uint32_t)columns.size();
+			write(columns.data(), columns.size() * sizeof(impl::ImageColumn));
+		}
+		DOECS_PROFILE_ADD(profileScope, "bytes", offset);
+		if (written)
+			written = fseek(file, 0, SEEK_SET) == 0;
+		write(&header, sizeof(header));
+		write(descs.data(), descs.size() * sizeof(impl::ImagePool));
+		return fclose(file) == 0 && written;
+	}
+
+	bool DOECS::OpenImage(const char* path)
+	{
+		DOECS_PROFILE_SCOPE(profileScope, "OpenImage", "Phase");
+		if (Image.Data)
+			return false;
+		impl::MappedFile image;
+		if (!impl::MapFile(path, image))
+			return false;
+
+		// Everything is validated before the first pool is changed.
+		auto header = (const impl::ImageHeader*)image.Data;
+		auto descs = (const impl::ImagePool*)(image.Data + sizeof(impl::ImageHeader));
+		bool valid = image.Size >= sizeof(impl::ImageHeader) && header->Magic == impl::ImageMagic && header->Version == impl::ImageVersion &&
+			sizeof(impl::ImageHeader) + (uint64_t)header->PoolCount * sizeof(impl::ImagePool) <= image.Size;
+		std::vector<impl::IArchetypePool*> pools;
+		for (uint32_t i = 0; valid && i < header->PoolCount; ++i) {
+			auto& desc = descs[i];
+			auto it = Pools.find(desc.PoolHash);
+			valid = it != Pools.end() &&
+				desc.ChunkOffset % impl::ImagePageSize == 0 &&
+				desc.ChunkOffset + (uint64_t)desc.ChunkCount * desc.ChunkStride <= desc.IndexOffset &&
+				desc.IndexOffset + (uint64_t)desc.EntityCount * sizeof(impl::ImageEntity) <= image.Size &&
+				desc.ColumnOffset + (uint64_t)desc.ColumnCount * sizeof(impl::ImageColumn) <= image.Size &&
+				it->second->CanMapImage(image.Data, desc);
+			if (valid)
+				pools.push_back(it->second);
+		}
+		if (!valid) {
+			impl::UnmapFile(image);
+			return false;
+		}
+
+		for (uint32_t i = 0; i < header->PoolCount; ++i) {
+			auto& desc = descs[i];
+			pools[i]->MapImage(image.Data, desc);
+			auto index = (const impl::ImageEntity*)(image.Data + desc.IndexOffset);
+			EntityPoolMap.reserve(EntityPoolMap.size() + desc.EntityCount);
+			for (uint32_t e = 0; e < desc.EntityCount; ++e) {
+				EntityPoolMap[index[e].Entity] = desc.PoolHash;
+			}
+			DOECS_PROFILE_ADD(profileScope, "entities", desc.EntityCount);
+		}
+		impl::AdvanceEntityIds(header->NextEntityId);
+		Image = image;
+		return true;
+	}
+
+	FrameHandle& FrameHandle::operator=(FrameHandle&& other) noexcept
+	{
+		if (this != &other) {
+			Wait();
+			Ecs = other.Ecs;
+			other.Ecs = nullptr;
+		}
+		return *this;
+	}
+
+	FrameHandle::~FrameHandle()
+	{
+		Wait();
+	}
+
+	bool FrameHandle::IsReady() const
+	{
+		return !Ecs || Ecs->AsyncFrameTasks.Pending.load() == 0;
+	}
+
+	void FrameHandle::Wait()
+	{
+		if (!Ecs)
+			return;
+		impl::WaitTasks(Ecs->AsyncFrameTasks);
+		Ecs->EndAsyncFrame();
+		Ecs = nullptr;
+	}
+
+	WorldSnapshot& WorldSnapshot::operator=(WorldSnapshot&& other) noexcept
+	{
+		if (this != &other) {
+			for (auto p : Pools) {
+				delete p;
+			}
+			Pools = std::move(other.Pools);
+			other.Pools.clear();
+		}
+		return *this;
+	}
+
+	WorldSnapshot::~WorldSnapshot()
+	{
+		for (auto p : Pools) {
+			delete p;
+		}
+	}
+
+	void WorldSnapshot::RunSystem(ISystem* system) const
+	{
+		std::vector<int32_t> columns;
+		impl::ComponentsArgLease lease(0);
+		auto& components = lease.Get();
+		for (auto pool : Pools)
+		{
+			columns.clear();
+			if (!pool->GetColumns(system, columns))
+				continue;
+
+			components.resize(columns.size());
+			auto chunkCount = pool->GetChunkCount();
+			for (uint32_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+				uint32_t count = 0;
+				for (std::size_t c = 0; c < columns.size(); ++c) {
+					const void* column = nullptr;
+					count = pool->GetColumn(chunkIndex, columns[c], column);
+					components[c] = const_cast<void*>(column);
+				}
+				if (count > 0)
+					system->Execute(count, components);
+			}
+		}
+	}
+
+	bool WorldSnapshot::ExportColumns(const uint64_t* hashes, std::size_t hashCount, ColumnExport& exp) const
+	{
+		exp.Layouts.assign(hashCount, ColumnLayout{});
+		exp.Chunks.clear();
+		exp.Columns.clear();
+		exp.EntityCount = 0;
+		if (hashCount == 0)
+			return false;
+
+		for (std::size_t p = 0; p < Pools.size(); ++p) {
+			auto pool = Pools[p];
+			bool hasAll = true;
+			for (std::size_t c = 0; c < hashCount && hasAll; ++c) {
+				hasAll = pool->GetColumnLayout(hashes[c], exp.Layouts[c]);
+			}
+			if (!hasAll)
+				continue;
+
+			auto chunkCount = pool->GetChunkCount();
+			for (uint32_t chunkIndex = 0; chunkIndex < chunkCount; ++chunkIndex) {
+				ColumnExport::Chunk chunk;
+				chunk.PoolIndex = (uint32_t)p;
+				chunk.Count = pool->GetEntities(chunkIndex, chunk.Entities);
+				for (std::size_t c = 0; c < hashCount; ++c) {
+					const void* components = nullptr;
+					pool->GetComponents(chunkIndex, hashes[c], components);
+					exp.Columns.push_back(components);
+				}
+				exp.Chunks.push_back(chunk);
+				exp.EntityCount += chunk.Count;
+			}
+		}
+		return !exp.Chunks.empty();
 	}
-}
\ No newline at end of file
+}
@@ -5,12 +5,31 @@
 
 #include <cstddef>
 #include <vector>
+#include <array>
 #include <unordered_map>
 #include <mutex>
+#include <atomic>
+#include <tuple>
+#include <cstring>
+#include <typeinfo>
+#include <string>
+#include <chrono>
+#include <thread>
 #include <assert.h>
 #include <algorithm>
+#include <functional>
+#include <memory>
+#include <cstdio>
+#include <cstdlib>
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <xmmintrin.h>
+#endif
 
 #include "doecs_type.h"
+#include "doecs_profile.h"
+#if DOECS_PROFILE && defined(__GNUG__)
+#include <cxxabi.h>
+#endif
 
 #ifndef DOECS_IN_DLL
 #define DOECS_IN_DLL 0
@@ -19,7 +38,9 @@
 #if DOECS_IN_DLL
 // Platform dependent code
 #ifndef DLL_EXPORT
-#	ifdef _WINDLL
+#	if !defined(_WIN32)
+#		define DLL_EXPORT __attribute__((visibility("default")))
+#	elif defined(_WINDLL)
 #		define DLL_EXPORT __declspec(dllexport)
 #	else
 #		define DLL_EXPORT __declspec(dllimport)
@@ -34,29 +55,434 @@
 
 namespace de2
 {
+	//
+	// FrameArena
+	//
+	// Bump allocator for the transient data of a frame. Each thread has its own, see GetFrameArena().
+	// Nothing is freed piece by piece. Reset() rewinds the whole arena, merging the blocks of a frame which
+	// needed more than one, so steady frames don't allocate. Rewind() goes back to a GetMark() and keeps the blocks.
+	// Destructors are not run.
+	class FrameArena
+	{
+	public:
+		static constexpr std::size_t MinBlockSize = 64 * 1024;
+
+		// Position returned by GetMark().
+		struct Mark
+		{
+			std::size_t Block = 0;
+			std::size_t Used = 0;
+		};
+
+	private:
+		struct Block
+		{
+			char* Data;
+			std::size_t Size;
+		};
+
+		std::vector<Block> Blocks;
+		// Block allocated from and the bytes used in it. The blocks after it are free.
+		std::size_t Current = 0;
+		std::size_t Used = 0;
+
+	public:
+		FrameArena() = default;
+		FrameArena(const FrameArena&) = delete;
+		FrameArena& operator=(const FrameArena&) = delete;
+
+		~FrameArena()
+		{
+			for (auto& block : Blocks) {
+				::operator delete(block.Data);
+			}
+		}
+
+		void* Allocate(std::size_t size, std::size_t alignment = alignof(std::max_align_t))
+		{
+			for (; Current < Blocks.size(); ++Current, Used = 0) {
+				auto& block = Blocks[Current];
+				auto p = ((uintptr_t)block.Data + Used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+				if (p + size <= (uintptr_t)block.Data + block.Size) {
+					Used = p + size - (uintptr_t)block.Data;
+					return (void*)p;
+				}
+				if (Current + 1 == Blocks.size())
+					break;
+			}
+			auto blockSize = std::max(MinBlockSize, size + alignment);
+			if (!Blocks.empty())
+				blockSize = std::max(blockSize, Blocks.back().Size * 2);
+			Blocks.push_back({ (char*)::operator new(blockSize), blockSize });
+			Current = Blocks.size() - 1;
+			Used = 0;
+			return Allocate(size, alignment);
+		}
+
+		// Uninitialized storage for count objects.
+		template<typename T>
+		T* Allocate(std::size_t count)
+		{
+			return (T*)Allocate(count * sizeof(T), alignof(T));
+		}
+
+		// Makes sure a block after the current position has size free bytes, so they are allocated without a new block.
+		// Nothing allocated is invalidated.
+		void Reserve(std::size_t size)
+		{
+			for (auto b = Current; b < Blocks.size(); ++b) {
+				if (Blocks[b].Size - (b == Current ? Used : 0) >= size)
+					return;
+			}
+			Blocks.push_back({ (char*)::operator new(size), size });
+		}
+
+		Mark GetMark() const
+		{
+			return { Current, Used };
+		}
+
+		// Invalidates everything allocated since mark was taken. The blocks are kept for the next allocations.
+		void Rewind(const Mark& mark)
+		{
+			Current = mark.Block;
+			Used = mark.Used;
+		}
+
+		// Invalidates everything allocated since the previous Reset().
+		// Keeps one block of the capacity used so far, or of minCapacity if it is larger.
+		void Reset(std::size_t minCapacity = 0)
+		{
+			std::size_t capacity = std::max(GetCapacity(), minCapacity);
+			if (Blocks.size() > 1 || (capacity > 0 && (Blocks.empty() || Blocks.back().Size < capacity))) {
+				for (auto& block : Blocks) {
+					::operator delete(block.Data);
+				}
+				Blocks.clear();
+				Blocks.push_back({ (char*)::operator new(capacity), capacity });
+			}
+			Current = 0;
+			Used = 0;
+		}
+
+		std::size_t GetCapacity() const
+		{
+			std::size_t capacity = 0;
+			for (auto& block : Blocks) {
+				capacity += block.Size;
+			}
+			return capacity;
+		}
+
+		std::size_t GetUsedBytes() const
+		{
+			std::size_t used = Used;
+			for (std::size_t b = 0; b < Current && b < Blocks.size(); ++b) {
+				used += Blocks[b].Size;
+			}
+			return used;
+		}
+	};
+
+	// Arena of the calling thread. The de2 workers reset theirs after each task, growing it to the largest arena
+	// a worker needed so far, so a worker which takes a bigger task for the first time doesn't allocate in a steady frame.
+	// Other threads own their arena: de2 only rewinds what it allocated in it itself (see FrameArenaScope),
+	// and DOECS::EndFrame() resets it once per frame, so systems and events can keep what they allocate until then.
+	DLL_EXPORT FrameArena& GetFrameArena();
+
+	//
+	// FrameAllocator
+	//
+	// Allocates from the frame arena of the calling thread. Deallocation does nothing.
+	// Containers using it must not outlive the frame.
+	template<typename T>
+	struct FrameAllocator
+	{
+		using value_type = T;
+
+		FrameAllocator() = default;
+		template<typename U>
+		FrameAllocator(const FrameAllocator<U>&) {}
+
+		T* allocate(std::size_t count)
+		{
+			return GetFrameArena().Allocate<T>(count);
+		}
+
+		void deallocate(T*, std::size_t) {}
+
+		template<typename U>
+		bool operator==(const FrameAllocator<U>&) const { return true; }
+		template<typename U>
+		bool operator!=(const FrameAllocator<U>&) const { return false; }
+	};
+
+	template<typename T>
+	using FrameVector = std::vector<T, FrameAllocator<T>>;
+
+	//
+	// FrameArenaScope
+	//
+	// Rewinds the arena of the calling thread to where it was when the scope was entered.
+	// de2 calls which allocate temporaries in the caller's arena run in one, so they never release what the caller allocated.
+	class FrameArenaScope
+	{
+		FrameArena& Arena;
+		FrameArena::Mark Mark;
+
+	public:
+		FrameArenaScope()
+			: Arena(GetFrameArena())
+			, Mark(Arena.GetMark())
+		{}
+		FrameArenaScope(const FrameArenaScope&) = delete;
+		FrameArenaScope& operator=(const FrameArenaScope&) = delete;
+
+		~FrameArenaScope()
+		{
+			Arena.Rewind(Mark);
+		}
+	};
+
+	namespace impl
+	{
+		// ComponentsArg of the calling thread at the current nesting depth, resized to count. Kept across calls,
+		// so passing the arrays to systems, events and observers doesn't allocate in a steady frame.
+		DLL_EXPORT ComponentsArg& AcquireComponentsArg(std::size_t count);
+		DLL_EXPORT void ReleaseComponentsArg();
+
+		// Holds an AcquireComponentsArg() for a scope. A system which calls ForEach() gets the next one,
+		// so the arrays it was passed stay valid.
+		class ComponentsArgLease
+		{
+			ComponentsArg& Components;
+
+		public:
+			explicit ComponentsArgLease(std::size_t count)
+				: Components(AcquireComponentsArg(count))
+			{}
+			ComponentsArgLease(const ComponentsArgLease&) = delete;
+			ComponentsArgLease& operator=(const ComponentsArgLease&) = delete;
+
+			~ComponentsArgLease()
+			{
+				ReleaseComponentsArg();
+			}
+
+			ComponentsArg& Get()
+			{
+				return Components;
+			}
+		};
+	}
+
+#if DOECS_PROFILE
+	namespace impl
+	{
+		// Readable type name for the profiler. Demangled on gcc and clang.
+		inline std::string TypeName(const std::type_info& type)
+		{
+#if defined(__GNUG__)
+			int status = 0;
+			char* demangled = abi::__cxa_demangle(type.name(), nullptr, nullptr, &status);
+			if (status == 0 && demangled) {
+				std::string name(demangled);
+				std::free(demangled);
+				return name;
+			}
+#endif
+			return type.name();
+		}
+	}
+#endif
+
 	class DOECS;
+
+	//
+	// ExecutionPolicy
+	//
+	// How much of its pools a system processes per DOECS::RunSystem(). The limits combine.
+	// A limited run stops at a chunk boundary and the next run resumes at that chunk of the same pool.
+	// A run never goes past the end of the pools, so no chunk is processed twice in one run.
+	// The resume point is a chunk index, so a Flush() or Defragment() between two runs of a pass
+	// can move rows across it: they are processed twice or wait for the next pass.
+	struct ExecutionPolicy
+	{
+		// Runs once every Interval calls. 1 runs on every call.
+		uint32_t Interval = 1;
+		// Processes 1/Slices of the matching non empty chunks per run, round-robin. 1 processes all of them.
+		uint32_t Slices = 1;
+		// Stops after the chunk which passed the budget. At least one chunk is processed. 0 is unlimited.
+		uint32_t BudgetMicroseconds = 0;
+	};
+
 	class ISystem
 	{
+#if DOECS_PROFILE
+		std::string Name;
+#endif
+
 	public:
 		volatile bool Done = false;
 
+		virtual ~ISystem() = default;
 		virtual std::size_t GetComponentHashes(const uint64_t*& pHashes) = 0;
+		// components has the required components in the order of GetComponentHashes(),
+		// followed by the optional components in the order of GetOptionalComponentHashes().
 		virtual void Execute(uint32_t entityCount, const de2::ComponentsArg& components) = 0;
+
+		// Pools which have any of these components are skipped.
+		virtual std::size_t GetExcludedComponentHashes(const uint64_t*& pHashes)
+		{
+			pHashes = nullptr;
+			return 0;
+		}
+
+		// Passed to Execute() after the required components. nullptr for the pools without the component.
+		virtual std::size_t GetOptionalComponentHashes(const uint64_t*& pHashes)
+		{
+			pHashes = nullptr;
+			return 0;
+		}
+
+		// Read on every DOECS::RunSystem(). Defaults to every chunk on every run.
+		virtual ExecutionPolicy GetExecutionPolicy()
+		{
+			return {};
+		}
+
+		// Used by the profiler. Defaults to the type name, demangled only with DOECS_PROFILE.
+		virtual const char* GetName()
+		{
+#if DOECS_PROFILE
+			if (Name.empty())
+				Name = impl::TypeName(typeid(*this));
+			return Name.c_str();
+#else
+			return typeid(*this).name();
+#endif
+		}
 	};
 
 	class IEvent
 	{
 	public:
+		virtual ~IEvent() = default;
 		virtual std::size_t GetComponentHashes(const uint64_t*& pHashes) = 0;
 		virtual void Execute(const de2::ComponentsArg& components) = 0;
 	};
 
+	//
+	// IObserver
+	//
+	// Notified at Flush() of the entities which entered or are leaving the pools with all of its components.
+	// Each call covers a contiguous row range of one chunk: entities[i] and components[c][i] for i < entityCount,
+	// with the components in the order of GetComponentHashes().
+	// Don't add or remove entities in the callbacks.
+	class IObserver
+	{
+	public:
+		virtual ~IObserver() = default;
+		virtual std::size_t GetComponentHashes(const uint64_t*& pHashes) = 0;
+		// Entities added since the previous Flush().
+		virtual void OnAdd(uint32_t entityCount, const EntityId* entities, const de2::ComponentsArg& components) {}
+		// Entities removed by this Flush(). Called before the rows are removed.
+		virtual void OnRemove(uint32_t entityCount, const EntityId* entities, const de2::ComponentsArg& components) {}
+	};
+
 	template<std::size_t N, typename T>
 	constexpr size_t ArrayCount(const T(&arr)[N])
 	{
 		return N;
 	}
 
+	//
+	// PoolStats
+	//
+	struct PoolStats
+	{
+		static constexpr uint32_t FillHistogramBuckets = 10;
+
+		uint64_t Hash = 0;
+		// Readable only with DOECS_PROFILE. See ArchetypePool::GetName().
+		const char* Name = nullptr;
+		uint32_t ChunkCount = 0;
+		uint32_t EntityCount = 0;
+		uint32_t EntityCountPerChunk = 0;
+		// Chunk count by fill ratio. Bucket i holds chunks filled [i * 10%, (i + 1) * 10%), full chunks are in the last bucket.
+		uint32_t FillHistogram[FillHistogramBuckets] = {};
+		uint64_t BytesAllocated = 0;
+		// Bytes of the empty rows.
+		uint64_t BytesWasted = 0;
+	};
+
+	//
+	// ColumnLayout
+	//
+	// Layout of an exported component array. Fixed size fields without padding, so it can be passed to other languages as is.
+	// Row i of a column starts at i * Stride bytes.
+	struct ColumnLayout
+	{
+		uint64_t TypeHash = 0;
+		uint32_t Size = 0;
+		uint32_t Stride = 0;
+		uint32_t Alignment = 0;
+		// 0 if the rows must not be copied byte-wise, e.g. std::string members.
+		uint32_t TriviallyCopyable = 0;
+
+		template<typename ComponentType>
+		static ColumnLayout Of()
+		{
+			return { typeid(ComponentType).hash_code(), (uint32_t)sizeof(ComponentType), (uint32_t)sizeof(ComponentType),
+				(uint32_t)alignof(ComponentType), std::is_trivially_copyable_v<ComponentType> ? 1u : 0u };
+		}
+	};
+
+	//
+	// Prefab
+	//
+	// Handle of a row registered with DOECS::CreatePrefab().
+	struct Prefab
+	{
+		uint64_t PoolHash = 0;
+		uint32_t Index = (uint32_t)-1;
+	};
+
+	//
+	// IsColdComponent
+	//
+	// Cold components live outside of the chunk in an array per chunk indexed by the same row.
+	// Only the hot components set the entity count per chunk, and systems over them don't load the cold bytes.
+	// Mark rarely used large components (debug names, AI blackboards) with DeclareColdComponent() at global scope.
+	template<typename ComponentType>
+	struct IsColdComponent : std::false_type {};
+
+#define DeclareColdComponent(ComponentType) template<> struct de2::IsColdComponent<ComponentType> : std::true_type {}
+
+	//
+	// IsSparseComponent
+	//
+	// Sparse components are not part of any archetype. They live in a paged sparse set keyed by entity id,
+	// so adding and removing one is O(1) and doesn't move the entity's row to another pool.
+	// Mark short lived states (stun, burning, target lock) with DeclareSparseComponent() at global scope,
+	// then use DOECS::AddComponent(), RemoveComponent(), GetComponent() and ForEach().
+	template<typename ComponentType>
+	struct IsSparseComponent : std::false_type {};
+
+#define DeclareSparseComponent(ComponentType) template<> struct de2::IsSparseComponent<ComponentType> : std::true_type {}
+
+	//
+	// IsTriviallyRelocatable
+	//
+	// Rows of trivially relocatable components are moved between rows and chunks with memcpy,
+	// without the move constructor and destructor. True for trivially copyable types.
+	// Declare it at global scope with DeclareTriviallyRelocatable() for types which don't point into themselves,
+	// e.g. std::unique_ptr or a small vector whose inline buffer is not referenced by its own pointers.
+	template<typename ComponentType>
+	struct IsTriviallyRelocatable : std::is_trivially_copyable<ComponentType> {};
+
+#define DeclareTriviallyRelocatable(ComponentType) template<> struct de2::IsTriviallyRelocatable<ComponentType> : std::true_type {}
+
 	namespace impl
 	{
 		constexpr int ChunkSize = 16 * 1024; // Usually CPU has 32 kb L1 cache including instruction and data cache.
@@ -72,9 +498,82 @@ namespace de2
 			EntityId Gen() {
 				return NextId++;
 			}
+
+			// Returns the first id of count consecutive ids.
+			EntityId Reserve(EntityId count) {
+				auto first = NextId;
+				NextId += count;
+				return first;
+			}
+
+			// Ids below next are not generated anymore.
+			void Advance(EntityId next) {
+				NextId = std::max(NextId, next);
+			}
 		};
 
 		DLL_EXPORT EntityId GenerateEntityId();
+		DLL_EXPORT EntityId ReserveEntityIds(EntityId count);
+		DLL_EXPORT void AdvanceEntityIds(EntityId next);
+
+		// Lookups and copies of Gather/Scatter prefetch this many entries ahead.
+		constexpr uint32_t BatchPrefetchDistance = 16;
+		// Flushes removing fewer entities run on the calling thread.
+		constexpr std::size_t MinParallelFlushCount = 4096;
+
+		inline void Prefetch(const void* p)
+		{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+			_mm_prefetch((const char*)p, _MM_HINT_T0);
+#elif defined(__GNUC__) || defined(__clang__)
+			__builtin_prefetch(p);
+#endif
+		}
+
+		//
+		// Workers
+		//
+		// Threads shared by every DOECS, started on first use and kept until exit, so no thread is created per frame.
+		// Tasks submitted to a TaskGroup are waited together. A waiting thread runs the queued tasks of its group
+		// itself, so a task can submit and wait other tasks without running out of workers.
+		struct TaskGroup
+		{
+			std::atomic<uint32_t> Pending = 0;
+		};
+		using TaskFn = void (*)(void* context, std::size_t begin, std::size_t end);
+
+		// Starts workers until there are at least count.
+		DLL_EXPORT void ReserveWorkers(uint32_t count);
+		// fn(context, begin, end) runs on a worker. context must live until WaitTasks() returns.
+		DLL_EXPORT void SubmitTask(TaskGroup& group, TaskFn fn, void* context, std::size_t begin, std::size_t end);
+		DLL_EXPORT void WaitTasks(TaskGroup& group);
+
+		// Splits [0, count) into up to threadCount ranges and calls fn(begin, end) for each.
+		// The first range runs on the calling thread, the others on the workers.
+		template<typename F>
+		void ParallelFor(uint32_t threadCount, std::size_t count, F&& fn)
+		{
+			if (threadCount <= 1 || count <= 1) {
+				if (count > 0)
+					fn((std::size_t)0, count);
+				return;
+			}
+			threadCount = (uint32_t)std::min<std::size_t>(threadCount, count);
+			std::size_t step = (count + threadCount - 1) / threadCount;
+			ReserveWorkers(threadCount - 1);
+			TaskGroup group;
+			auto run = [](void* context, std::size_t begin, std::size_t end) {
+				(*(std::remove_reference_t<F>*)context)(begin, end);
+			};
+			for (uint32_t t = 1; t < threadCount; ++t) {
+				std::size_t begin = std::min(count, step * t);
+				std::size_t end = std::min(count, begin + step);
+				if (begin < end)
+					SubmitTask(group, run, (void*)&fn, begin, end);
+			}
+			fn((std::size_t)0, std::min(count, step));
+			WaitTasks(group);
+		}
 
 		template <class T>
 		uint64_t hash_combine(uint64_t& seed, const T& v)
@@ -107,103 +606,827 @@ namespace de2
 			static const auto Value = (sizeof(TFirst) + SizeOf<TRemaining...>::Value);
 		};
 
-		template <class _Ty, class _Alloc = std::allocator<_Ty>>
-		class SortedVector : public std::vector<_Ty, _Alloc> {
-			using super = std::vector<_Ty, _Alloc>;
-			using iterator = typename std::vector<_Ty, _Alloc>::iterator;
+		//
+		// HotColumn
+		//
+		// Component array in the chunk. Storage only: the chunk constructs its live rows and destroys them.
+		template<typename ComponentType, std::size_t Count>
+		class HotColumn
+		{
+			alignas(ComponentType) unsigned char Rows[sizeof(ComponentType) * Count];
 
 		public:
-			iterator insert(const _Ty& v) {
-				iterator it = std::lower_bound(super::begin(), super::end(), v);
-				if (it != super::end() && *it == v) {
-					*it = v;
-				}
-				else {
-					it = super::insert(it, v);
-				}
-				return it;
+			using value_type = ComponentType;
+
+			// User provided, so value initialization by std::tuple doesn't zero the rows.
+			HotColumn() {}
+			HotColumn(const HotColumn&) = delete;
+			HotColumn& operator=(const HotColumn&) = delete;
+
+			ComponentType& operator[](std::size_t index) { return ((ComponentType*)Rows)[index]; }
+			const ComponentType& operator[](std::size_t index) const { return ((const ComponentType*)Rows)[index]; }
+		};
+
+		//
+		// ColdColumn
+		//
+		// Component array of a cold component. Owns a separate allocation of Count rows.
+		// Storage only, like HotColumn.
+		template<typename ComponentType, std::size_t Count>
+		class ColdColumn
+		{
+			ComponentType* Rows;
+
+		public:
+			using value_type = ComponentType;
+
+			ColdColumn()
+				: Rows(std::allocator<ComponentType>().allocate(Count))
+			{
 			}
 
-			bool contains(const _Ty& v) const {
-				return std::binary_search(super::begin(), super::end(), v);
+			ColdColumn(const ColdColumn&) = delete;
+			ColdColumn& operator=(const ColdColumn&) = delete;
+
+			~ColdColumn()
+			{
+				std::allocator<ComponentType>().deallocate(Rows, Count);
 			}
 
-			bool erase(const _Ty& v) {
-				auto it = std::lower_bound(super::begin(), super::end(), v);
-				if (it != super::end() && *it == v) {
-					super::erase(it);
-					return true;
+			ComponentType& operator[](std::size_t index) { return Rows[index]; }
+			const ComponentType& operator[](std::size_t index) const { return Rows[index]; }
+		};
+
+		// Moves count rows from src to the uninitialized dest. src is left uninitialized.
+		template<typename ComponentType>
+		void RelocateRows(ComponentType* dest, ComponentType* src, std::size_t count)
+		{
+			if constexpr (IsTriviallyRelocatable<ComponentType>::value) {
+				std::memcpy((void*)dest, (const void*)src, count * sizeof(ComponentType));
+			}
+			else {
+				for (std::size_t i = 0; i < count; ++i) {
+					::new ((void*)(dest + i)) ComponentType(std::move(src[i]));
+					src[i].~ComponentType();
 				}
-				return false;
 			}
+		}
 
-		private:
-			void push_back(const _Ty& v) = delete;
-		};
+		template<typename ComponentType>
+		void CopyComponent(void* dest, const void* src)
+		{
+			*(ComponentType*)dest = *(const ComponentType*)src;
+		}
 
 		//
-		// IArchetypePool
+		// RelativePtr
 		//
-		class IArchetypePool
+		// Pointer stored as the distance from its own address. Objects linked by it stay linked
+		// when the memory holding them is mapped at another address. Copying keeps the target.
+		template<typename T>
+		class RelativePtr
 		{
+			// 0 is nullptr. A pointer never points at itself.
+			std::ptrdiff_t Offset = 0;
+
 		public:
-			virtual bool IsPoolFor(uint64_t componentHash) = 0;
-			virtual bool IsPoolFor(ISystem* system) = 0;
-			virtual EntityId CreateEntity() = 0;
-			virtual bool RemoveEntity(EntityId entity) = 0;
-			virtual uint32_t GetComponents(uint32_t chunkIndex, uint64_t hash, void*& components) = 0;
-			virtual void* GetComponent(EntityId entity, uint64_t componentHash) = 0;
-			virtual void* SetComponent(EntityId entity, uint64_t componentHash, void* comp) = 0;
-			virtual void PushEvent(EntityId entId, IEvent* evt) = 0;
-			virtual void RunEvents() = 0;
-			virtual void Flush() = 0;
+			RelativePtr() = default;
+			RelativePtr(T* p) { Set(p); }
+			RelativePtr(const RelativePtr& other) { Set(other.Get()); }
+
+			RelativePtr& operator=(const RelativePtr& other)
+			{
+				Set(other.Get());
+				return *this;
+			}
+
+			RelativePtr& operator=(T* p)
+			{
+				Set(p);
+				return *this;
+			}
+
+			T* Get() const
+			{
+				return Offset ? (T*)((char*)this + Offset) : nullptr;
+			}
+
+			void Set(T* p)
+			{
+				Offset = p ? (char*)p - (char*)this : 0;
+			}
+
+			operator T*() const { return Get(); }
+			T* operator->() const { return Get(); }
 		};
 
-		template<typename ... ComponentTypes>
-		class ArchetypePool : public IArchetypePool
+		//
+		// ISparseSet
+		//
+		class ISparseSet
 		{
-			uint64_t Hash;
-			std::vector<uint64_t> ComponentHashes;
-
 		public:
-			using Tuple = std::tuple<ComponentTypes...>;
-			using MovedFromTo = std::pair<uint32_t, uint32_t>;
-			static constexpr uint32_t EntitySize = SizeOf<ComponentTypes...>::Value;
-			static constexpr uint32_t EntityCountPerChunk = (ChunkSize - sizeof(void*) - sizeof(uint32_t)) / EntitySize;
-			static constexpr uint32_t ComponentCount = sizeof...(ComponentTypes);
+			virtual ~ISparseSet() = default;
+			// Returns false if the entity doesn't have the component.
+			virtual bool Remove(EntityId entity) = 0;
+			virtual uint32_t GetCount() const = 0;
+			virtual const EntityId* GetEntities() const = 0;
+			// New empty set of the same component.
+			virtual ISparseSet* CreateEmpty() const = 0;
+			// Moves every component into target, a set of the same component. Leaves this set empty.
+			virtual void MoveInto(ISparseSet* target) = 0;
+		};
 
-			struct Chunk
+		//
+		// SparseSet
+		//
+		// Components packed in a dense array, with a paged sparse array from entity id to dense index.
+		// Pages are allocated on the first component in their id range and freed with the last.
+		// Removal moves the last component into the hole.
+		template<typename ComponentType>
+		class SparseSet : public ISparseSet
+		{
+			static constexpr uint32_t PageSize = ChunkSize / sizeof(uint32_t);
+			static constexpr uint32_t InvalidIndex = (uint32_t)-1;
+
+			struct Page
 			{
-			public:
-				std::tuple<std::array<ComponentTypes, EntityCountPerChunk>...> Components;
-				constexpr static uint32_t InvalidIndex = -1;
+				uint32_t Dense[PageSize];
 				uint32_t Count = 0;
-				Chunk* Next = nullptr;
 
-				void* operator new(std::size_t size)
+				Page()
 				{
-#ifdef _MSC_VER
-					return _aligned_malloc(size, CacheLineSize);
-#else
-					// not tested.
-					return std::aligned_alloc(size, CacheLineSize);
-#endif
+					std::fill(Dense, Dense + PageSize, InvalidIndex);
 				}
+			};
 
-				void operator delete(void* p)
-				{
+			std::vector<Page*> Pages;
+			std::vector<EntityId> Entities;
+			std::vector<ComponentType> Components;
 
-#ifdef _MSC_VER
-					_aligned_free(p);
-#else
-					std::free(p);
-#endif
+		public:
+			SparseSet() = default;
+			SparseSet(const SparseSet&) = delete;
+			SparseSet& operator=(const SparseSet&) = delete;
+
+			~SparseSet()
+			{
+				for (auto page : Pages) {
+					delete page;
+				}
+			}
+
+			ComponentType* Find(EntityId entity)
+			{
+				auto pageIndex = entity / PageSize;
+				if (pageIndex >= Pages.size() || !Pages[pageIndex])
+					return nullptr;
+				auto index = Pages[pageIndex]->Dense[entity % PageSize];
+				return index == InvalidIndex ? nullptr : &Components[index];
+			}
+
+			// Adds or overwrites the component of the entity.
+			template<typename T>
+			ComponentType* Set(EntityId entity, T&& comp)
+			{
+				auto pageIndex = (std::size_t)(entity / PageSize);
+				if (pageIndex >= Pages.size())
+					Pages.resize(pageIndex + 1, nullptr);
+				auto& page = Pages[pageIndex];
+				if (!page)
+					page = new Page;
+				auto& index = page->Dense[entity % PageSize];
+				if (index != InvalidIndex) {
+					Components[index] = std::forward<T>(comp);
+					return &Components[index];
+				}
+				index = (uint32_t)Entities.size();
+				++page->Count;
+				Entities.push_back(entity);
+				Components.push_back(std::forward<T>(comp));
+				return &Components.back();
+			}
+
+			bool Remove(EntityId entity) override
+			{
+				auto pageIndex = entity / PageSize;
+				if (pageIndex >= Pages.size() || !Pages[pageIndex])
+					return false;
+				auto page = Pages[pageIndex];
+				auto index = page->Dense[entity % PageSize];
+				if (index == InvalidIndex)
+					return false;
+				auto last = (uint32_t)Entities.size() - 1;
+				if (index != last) {
+					auto lastEntity = Entities[last];
+					Entities[index] = lastEntity;
+					Components[index] = std::move(Components[last]);
+					Pages[lastEntity / PageSize]->Dense[lastEntity % PageSize] = index;
+				}
+				Entities.pop_back();
+				Components.pop_back();
+				page->Dense[entity % PageSize] = InvalidIndex;
+				if (--page->Count == 0) {
+					delete page;
+					Pages[pageIndex] = nullptr;
+				}
+				return true;
+			}
+
+			uint32_t GetCount() const override
+			{
+				return (uint32_t)Entities.size();
+			}
+
+			const EntityId* GetEntities() const override
+			{
+				return Entities.data();
+			}
+
+			ComponentType* GetComponents()
+			{
+				return Components.data();
+			}
+
+			ISparseSet* CreateEmpty() const override
+			{
+				return new SparseSet;
+			}
+
+			void MoveInto(ISparseSet* target) override
+			{
+				auto set = (SparseSet*)target;
+				for (std::size_t i = 0; i < Entities.size(); ++i) {
+					set->Set(Entities[i], std::move(Components[i]));
+				}
+				for (auto& page : Pages) {
+					delete page;
+					page = nullptr;
+				}
+				Pages.clear();
+				Entities.clear();
+				Components.clear();
+			}
+		};
+
+		// Position of each component among the components of the pack which are not sparse.
+		template<typename ... ComponentTypes>
+		constexpr std::array<std::size_t, sizeof...(ComponentTypes)> GetArchetypeIndices()
+		{
+			constexpr bool isSparse[] = { IsSparseComponent<ComponentTypes>::value... };
+			std::array<std::size_t, sizeof...(ComponentTypes)> indices{};
+			std::size_t next = 0;
+			for (std::size_t i = 0; i < sizeof...(ComponentTypes); ++i) {
+				indices[i] = next;
+				if (!isSparse[i])
+					++next;
+			}
+			return indices;
+		}
+
+		template <class _Ty, class _Alloc = std::allocator<_Ty>>
+		class SortedVector : public std::vector<_Ty, _Alloc> {
+			using super = std::vector<_Ty, _Alloc>;
+			using iterator = typename std::vector<_Ty, _Alloc>::iterator;
+
+		public:
+			iterator insert(const _Ty& v) {
+				iterator it = std::lower_bound(super::begin(), super::end(), v);
+				if (it != super::end() && *it == v) {
+					*it = v;
+				}
+				else {
+					it = super::insert(it, v);
+				}
+				return it;
+			}
+
+			bool contains(const _Ty& v) const {
+				return std::binary_search(super::begin(), super::end(), v);
+			}
+
+			bool erase(const _Ty& v) {
+				auto it = std::lower_bound(super::begin(), super::end(), v);
+				if (it != super::end() && *it == v) {
+					super::erase(it);
+					return true;
+				}
+				return false;
+			}
+
+		private:
+			void push_back(const _Ty& v) = delete;
+		};
+
+		//
+		// EntityMap
+		//
+		// Open addressing hash map keyed by EntityId with linear probing.
+		// Entries live in one array, so the slot of a key can be prefetched before the lookup.
+		// INVALID_ENTITY_ID marks an empty slot and can't be a key.
+		template<typename ValueType>
+		class EntityMap
+		{
+		public:
+			using value_type = std::pair<EntityId, ValueType>;
+
+			class iterator
+			{
+				friend class EntityMap;
+				value_type* Slot;
+				value_type* End;
+
+				iterator(value_type* slot, value_type* end)
+					: Slot(slot), End(end)
+				{
+					while (Slot != End && Slot->first == INVALID_ENTITY_ID)
+						++Slot;
+				}
+
+			public:
+				value_type& operator*() const { return *Slot; }
+				value_type* operator->() const { return Slot; }
+				iterator& operator++()
+				{
+					++Slot;
+					while (Slot != End && Slot->first == INVALID_ENTITY_ID)
+						++Slot;
+					return *this;
+				}
+				bool operator==(const iterator& other) const { return Slot == other.Slot; }
+				bool operator!=(const iterator& other) const { return Slot != other.Slot; }
+			};
+
+		private:
+			std::vector<value_type> Slots;
+			std::size_t Count = 0;
+			uint32_t Shift = 64;
+
+			std::size_t GetSlot(EntityId key) const
+			{
+				// Fibonacci hashing. Entity ids are mostly sequential.
+				return (std::size_t)((key * 0x9E3779B97F4A7C15ull) >> Shift);
+			}
+
+			std::size_t Mask() const
+			{
+				return Slots.size() - 1;
+			}
+
+			void Rehash(std::size_t slotCount)
+			{
+				std::vector<value_type> old;
+				old.swap(Slots);
+				Slots.assign(slotCount, value_type{ INVALID_ENTITY_ID, ValueType{} });
+				Shift = 64;
+				for (auto n = slotCount; n > 1; n >>= 1)
+					--Shift;
+				Count = 0;
+				for (auto& slot : old) {
+					if (slot.first != INVALID_ENTITY_ID)
+						(*this)[slot.first] = std::move(slot.second);
+				}
+			}
+
+		public:
+			iterator begin() { return iterator(Slots.data(), Slots.data() + Slots.size()); }
+			iterator end() { return iterator(Slots.data() + Slots.size(), Slots.data() + Slots.size()); }
+			std::size_t size() const { return Count; }
+			bool empty() const { return Count == 0; }
+
+			void clear()
+			{
+				Slots.clear();
+				Count = 0;
+				Shift = 64;
+			}
+
+			// Keeps the load factor under 3/4 up to count entries.
+			void reserve(std::size_t count)
+			{
+				std::size_t slotCount = 16;
+				while (slotCount * 3 < count * 4)
+					slotCount *= 2;
+				if (slotCount > Slots.size())
+					Rehash(slotCount);
+			}
+
+			void Prefetch(EntityId key) const
+			{
+				if (!Slots.empty())
+					impl::Prefetch(&Slots[GetSlot(key)]);
+			}
+
+			iterator find(EntityId key)
+			{
+				if (Slots.empty())
+					return end();
+				for (auto i = GetSlot(key);; i = (i + 1) & Mask()) {
+					if (Slots[i].first == key)
+						return iterator(&Slots[i], Slots.data() + Slots.size());
+					if (Slots[i].first == INVALID_ENTITY_ID)
+						return end();
+				}
+			}
+
+			ValueType& operator[](EntityId key)
+			{
+				assert(key != INVALID_ENTITY_ID);
+				// Only a new key grows the table, so updating an existing key never moves the entries.
+				auto it = find(key);
+				if (it != end())
+					return it->second;
+				if ((Count + 1) * 4 > Slots.size() * 3)
+					Rehash(std::max<std::size_t>(16, Slots.size() * 2));
+				auto i = GetSlot(key);
+				for (; Slots[i].first != INVALID_ENTITY_ID; i = (i + 1) & Mask()) {
+					if (Slots[i].first == key)
+						return Slots[i].second;
+				}
+				Slots[i].first = key;
+				++Count;
+				return Slots[i].second;
+			}
+
+			template<typename InputIt>
+			void insert(InputIt first, InputIt last)
+			{
+				for (; first != last; ++first) {
+					(*this)[first->first] = first->second;
+				}
+			}
+
+			std::size_t erase(EntityId key)
+			{
+				auto it = find(key);
+				if (it == end())
+					return 0;
+				// Backward shift deletion. Moves the following entries of the probe sequence into the hole.
+				auto hole = (std::size_t)(it.Slot - Slots.data());
+				for (auto i = (hole + 1) & Mask(); Slots[i].first != INVALID_ENTITY_ID; i = (i + 1) & Mask()) {
+					auto home = GetSlot(Slots[i].first);
+					if (((i - home) & Mask()) >= ((i - hole) & Mask())) {
+						Slots[hole] = std::move(Slots[i]);
+						hole = i;
+					}
+				}
+				Slots[hole] = value_type{ INVALID_ENTITY_ID, ValueType{} };
+				--Count;
+				return 1;
+			}
+		};
+
+		// Returns false if the pool does not match the system's query.
+		// Otherwise fills columns with the index of each required and optional component in componentHashes, -1 if missing.
+		inline bool MatchQuery(ISystem* system, const std::vector<uint64_t>& componentHashes, std::vector<int32_t>* columns)
+		{
+			auto findColumn = [&componentHashes](uint64_t hash) {
+				auto it = std::find(componentHashes.begin(), componentHashes.end(), hash);
+				return it == componentHashes.end() ? -1 : (int32_t)std::distance(componentHashes.begin(), it);
+			};
+
+			const uint64_t* hashes = nullptr;
+			auto count = system->GetExcludedComponentHashes(hashes);
+			for (std::size_t i = 0; i < count; ++i) {
+				if (findColumn(hashes[i]) >= 0)
+					return false;
+			}
+			count = system->GetComponentHashes(hashes);
+			for (std::size_t i = 0; i < count; ++i) {
+				auto column = findColumn(hashes[i]);
+				if (column < 0)
+					return false;
+				if (columns)
+					columns->push_back(column);
+			}
+			if (columns) {
+				count = system->GetOptionalComponentHashes(hashes);
+				for (std::size_t i = 0; i < count; ++i) {
+					columns->push_back(findColumn(hashes[i]));
+				}
+			}
+			return true;
+		}
+
+		//
+		// IPoolSnapshot
+		//
+		class IPoolSnapshot
+		{
+		public:
+			virtual ~IPoolSnapshot() = default;
+			virtual bool IsSnapshotFor(ISystem* system) = 0;
+			// See MatchQuery().
+			virtual bool GetColumns(ISystem* system, std::vector<int32_t>& columns) = 0;
+			virtual uint32_t GetChunkCount() = 0;
+			// Returns the row count. components is nullptr for column -1.
+			virtual uint32_t GetColumn(uint32_t chunkIndex, int32_t column, const void*& components) = 0;
+			virtual uint32_t GetComponents(uint32_t chunkIndex, uint64_t hash, const void*& components) = 0;
+			virtual uint32_t GetEntities(uint32_t chunkIndex, const EntityId*& entities) = 0;
+			// False if the pool doesn't have the component.
+			virtual bool GetColumnLayout(uint64_t hash, ColumnLayout& layout) = 0;
+		};
+
+		//
+		// ChangedChunk
+		//
+		// Read only view of a chunk written since an epoch. See IArchetypePool::GetChangedChunks().
+		struct ChangedChunk
+		{
+			uint32_t ChunkIndex;
+			uint32_t Count;
+			const EntityId* Entities;
+			const void* Components;
+		};
+
+		//
+		// BatchRequest
+		//
+		// Entity of a Gather/Scatter and the index of its value.
+		struct BatchRequest
+		{
+			EntityId Entity;
+			uint32_t ValueIndex;
+		};
+
+		//
+		// Image
+		//
+		// File written by DOECS::SaveImage(): ImageHeader, an ImagePool per pool,
+		// then per pool its chunks, page aligned and ChunkStride bytes apart, an ImageEntity per entity
+		// and an ImageColumn per component.
+		constexpr uint64_t ImageMagic = 0x31474d4953434544ull; // "DECSIMG1"
+		// Bump when the layout of the file changes.
+		constexpr uint32_t ImageVersion = 1;
+		constexpr uint32_t ImagePageSize = 4096;
+
+		struct ImageHeader
+		{
+			uint64_t Magic;
+			uint32_t PoolCount;
+			uint32_t Version;
+			// Above every entity of the image.
+			EntityId NextEntityId;
+		};
+
+		struct ImagePool
+		{
+			uint64_t PoolHash;
+			// sizeof(Chunk). An image is only opened by a build with the same chunk layout.
+			uint64_t ChunkSize;
+			uint64_t ChunkStride;
+			uint64_t ChunkOffset;
+			uint64_t IndexOffset;
+			uint32_t ChunkCount;
+			uint32_t EntityCount;
+			uint64_t WriteEpoch;
+			uint64_t ColumnOffset;
+			uint32_t ColumnCount;
+			uint32_t Padding;
+		};
+
+		// Layout of a component in the chunks of an image. A pool maps an image only if every column matches,
+		// so a component which changed size, alignment or place in the chunk is not read as the old one.
+		struct ImageColumn
+		{
+			uint64_t ComponentHash;
+			// Offset of the component array in the chunk.
+			uint64_t Offset;
+			uint32_t Size;
+			uint32_t Alignment;
+		};
+
+		struct ImageEntity
+		{
+			EntityId Entity;
+			uint32_t ChunkIndex;
+			uint32_t Row;
+		};
+
+		// Private writable mapping of a file. Writes are not written back.
+		struct MappedFile
+		{
+			char* Data = nullptr;
+			std::size_t Size = 0;
+			void* Handle = nullptr;
+		};
+
+		DLL_EXPORT bool MapFile(const char* path, MappedFile& file);
+		DLL_EXPORT void UnmapFile(MappedFile& file);
+
+		using ChunkFn = std::function<void(uint32_t entityCount, const EntityId* entities, const ComponentsArg& components)>;
+
+		//
+		// SystemSlice
+		//
+		// The part of a pool IArchetypePool::RunSystem() processes. Shared by the pools of one DOECS::RunSystem().
+		struct SystemSlice
+		{
+			// Chunk index to start at. Receives the chunk to resume at when the slice stops inside the pool.
+			uint32_t Cursor = 0;
+			// Non empty chunks left to process.
+			uint32_t ChunkBudget = (uint32_t)-1;
+			std::chrono::steady_clock::time_point Deadline = std::chrono::steady_clock::time_point::max();
+			uint32_t ChunkCount = 0;
+			uint32_t EntityCount = 0;
+		};
+
+		//
+		// IArchetypePool
+		//
+		class IArchetypePool
+		{
+		public:
+			virtual ~IArchetypePool() = default;
+			virtual bool IsPoolFor(uint64_t componentHash) = 0;
+			virtual bool HasComponent(uint64_t componentHash) = 0;
+			virtual bool IsPoolFor(ISystem* system) = 0;
+			virtual EntityId CreateEntity(EntityId entity) = 0;
+			virtual bool RemoveEntity(EntityId entity) = 0;
+			virtual uint32_t GetComponents(uint32_t chunkIndex, uint64_t hash, void*& components) = 0;
+			// The chunk is unshared and the column stamped, since the caller may write through the pointer.
+			virtual void* GetComponent(EntityId entity, uint64_t componentHash) = 0;
+			// Neither unshares nor stamps the chunk.
+			virtual const void* ReadComponent(EntityId entity, uint64_t componentHash) = 0;
+			virtual void* SetComponent(EntityId entity, uint64_t componentHash, void* comp) = 0;
+			// See MatchQuery().
+			virtual bool GetColumns(ISystem* system, std::vector<int32_t>& columns) = 0;
+			// Executes the system on the non empty chunks from slice.Cursor in one walk until the chunk budget
+			// or the deadline of slice runs out. columns come from GetColumns().
+			// Returns true if the walk reached the last chunk. Otherwise slice.Cursor is the chunk to resume at.
+			virtual bool RunSystem(ISystem* system, const std::vector<int32_t>& columns, SystemSlice& slice) = 0;
+			// Number of non empty chunks.
+			virtual uint32_t GetChunkCount() = 0;
+			// Index of the component in the pool, -1 if missing.
+			virtual int32_t FindColumn(uint64_t componentHash) = 0;
+			// Calls fn(entityCount, entities, components) for every non empty chunk, with the arrays of columns.
+			// The arrays are writable. Returns the number of entities visited.
+			virtual uint32_t ForEachChunk(const std::vector<int32_t>& columns, const ChunkFn& fn) = 0;
+			// Includes the entities pending removal.
+			virtual uint32_t GetEntityCount() = 0;
+			// False for the pools with cold components or components which are not trivially copyable.
+			virtual bool IsMappable() = 0;
+			// Writes the non empty chunks at the current position of file and appends their entities to index.
+			// Fills desc except the offsets. Returns false if a write fails.
+			virtual bool WriteImage(FILE* file, ImagePool& desc, std::vector<ImageEntity>& index) = 0;
+			// Appends the layout of each component, in column order.
+			virtual void GetImageColumns(std::vector<ImageColumn>& columns) = 0;
+			// True if the pool is empty and desc was written by a pool of the same layout.
+			virtual bool CanMapImage(const char* image, const ImagePool& desc) = 0;
+			// Links the chunks of the mapped image in place of the empty pool. See CanMapImage().
+			virtual void MapImage(char* image, const ImagePool& desc) = 0;
+			virtual void PushEvent(EntityId entId, IEvent* evt) = 0;
+			// Returns the number of events executed.
+			virtual uint32_t RunEvents() = 0;
+			// Flush() in three steps, so the chunks of several pools can be compacted on worker threads.
+			// BeginFlush() detaches the chunks, erases the removed entities from the index and returns the number of chunk jobs.
+			// FlushChunks(begin, end) compacts the chunks of the jobs [begin, end). Disjoint ranges may run concurrently.
+			// EndFlush() updates the index entries of the moved rows and returns the number of entities removed.
+			virtual uint32_t BeginFlush() = 0;
+			virtual void FlushChunks(uint32_t begin, uint32_t end) = 0;
+			virtual uint32_t EndFlush() = 0;
+
+			// Returns the number of entities removed.
+			uint32_t Flush()
+			{
+				FlushChunks(0, BeginFlush());
+				return EndFlush();
+			}
+			// While observed, the entities added are recorded for NotifyObservers().
+			virtual void SetObserved(bool observed) = 0;
+			// Calls OnAdd for the entities added since the previous call and OnRemove for the entities pending removal
+			// on the observers whose components the pool has. Call before Flush(). Returns the number of entities notified.
+			virtual uint32_t NotifyObservers(IObserver* const* observers, std::size_t observerCount) = 0;
+			virtual IPoolSnapshot* CreateSnapshot() = 0;
+			virtual const char* GetName() = 0;
+			virtual void GetStats(PoolStats& stats) = 0;
+			// Moves rows from the tail chunks into the holes of the front chunks until the deadline.
+			// Returns true when the pool is fully compacted.
+			virtual bool Defragment(std::chrono::steady_clock::time_point deadline) = 0;
+			// Appends the chunks whose componentHash column was written since sinceEpoch (every chunk for 0) and advances the write epoch.
+			// Any column counts when the pool doesn't have the component.
+			// Returns the epoch to pass next time. chunkCount receives the current chunk count.
+			// The pointers are valid until the next write to the pool.
+			virtual uint64_t GetChangedChunks(uint64_t componentHash, uint64_t sinceEpoch, std::vector<ChangedChunk>& changed, uint32_t& chunkCount) = 0;
+			// Copies the component of each requested entity to values[ValueIndex] (componentSize bytes each).
+			// Copy assigns non trivially copyable components, so values must hold constructed objects.
+			// Entities not in the pool are skipped. Returns the number of components copied.
+			virtual uint32_t Gather(uint64_t componentHash, const BatchRequest* requests, uint32_t count, void* values, std::size_t componentSize) = 0;
+			// Copies values[ValueIndex] to the component of each requested entity. Copy assigns like Gather().
+			virtual uint32_t Scatter(uint64_t componentHash, const BatchRequest* requests, uint32_t count, const void* values, std::size_t componentSize) = 0;
+			// Adds count entities with the ids [firstEntity, firstEntity + count), all copies of the prefab row.
+			// Returns the number of entities added.
+			virtual uint32_t Instantiate(uint32_t prefabIndex, EntityId firstEntity, uint32_t count) = 0;
+			// New empty pool of the same archetype.
+			virtual IArchetypePool* CreateEmpty() = 0;
+			// Links the non empty chunks of source, a pool of the same archetype, after the last chunk and takes its entities and events.
+			// Component data is not copied. source is left empty. Returns the number of chunks moved.
+			virtual uint32_t Splice(IArchetypePool* source) = 0;
+		};
+
+		template<typename ... ComponentTypes>
+		class ArchetypePool : public IArchetypePool
+		{
+			uint64_t Hash;
+			std::vector<uint64_t> ComponentHashes;
+#if DOECS_PROFILE
+			std::string Name;
+#endif
+
+		public:
+			using Tuple = std::tuple<ComponentTypes...>;
+			using MovedFromTo = std::pair<uint32_t, uint32_t>;
+			static constexpr uint32_t ComponentCount = sizeof...(ComponentTypes);
+			static constexpr uint32_t ColdComponentCount = (IsColdComponent<ComponentTypes>::value + ... + 0);
+			// Bytes per entity outside of the chunk.
+			static constexpr uint32_t ColdEntitySize = ((IsColdComponent<ComponentTypes>::value ? (uint32_t)sizeof(ComponentTypes) : 0) + ... + 0);
+			// Bytes per entity in the chunk.
+			static constexpr uint32_t EntitySize = SizeOf<ComponentTypes...>::Value - ColdEntitySize;
+			// Count, RefCount, Next, the column versions, the cold row pointers and the padding between the component arrays.
+			static constexpr uint32_t ChunkHeaderSize = CacheLineSize + ComponentCount * sizeof(uint64_t) + ColdComponentCount * sizeof(void*);
+			static constexpr uint32_t EntityCountPerChunk = (ChunkSize - ChunkHeaderSize) / (EntitySize + sizeof(EntityId));
+
+			template<typename ComponentType>
+			using Column = std::conditional_t<IsColdComponent<ComponentType>::value,
+				ColdColumn<ComponentType, EntityCountPerChunk>, HotColumn<ComponentType, EntityCountPerChunk>>;
+
+			struct Chunk
+			{
+			public:
+				std::tuple<Column<ComponentTypes>...> Components;
+				// Entity id of each row. Shared with snapshots together with the components.
+				std::array<EntityId, EntityCountPerChunk> Entities;
+				constexpr static uint32_t InvalidIndex = -1;
+				uint32_t Count = 0;
+				// Set in the reference count of the chunks of a mapped image. They are never deleted.
+				static constexpr uint32_t MappedFlag = 1u << 31;
+				// The pool holds one reference while the chunk is linked, every snapshot holds another.
+				std::atomic<uint32_t> RefCount = 1;
+				// Write epoch of the pool when each column was last written. See MarkWritten().
+				std::array<std::atomic<uint64_t>, ComponentCount> Versions = {};
+				// Relative, so the chunks of an image are linked wherever it is mapped.
+				RelativePtr<Chunk> Next;
+
+				// Only the rows in [0, Count) are constructed.
+				Chunk() = default;
+
+				// Copy for copy-on-write. The clone is owned by the pool only.
+				Chunk(const Chunk& other)
+					: Count(other.Count)
+					, Next(other.Next)
+				{
+					for (uint32_t c = 0; c < ComponentCount; ++c) {
+						Versions[c].store(other.Versions[c].load(std::memory_order_relaxed), std::memory_order_relaxed);
+					}
+					std::copy_n(&other.Entities[0], Count, &Entities[0]);
+					CopyRows<0>(other);
+				}
+
+				~Chunk()
+				{
+					DestroyRows<0>(0, Count);
+				}
+
+				bool IsShared() const
+				{
+					return (RefCount.load(std::memory_order_acquire) & ~MappedFlag) > 1;
+				}
+
+				void AddRef()
+				{
+					RefCount.fetch_add(1, std::memory_order_relaxed);
+				}
+
+				static void Release(Chunk* chunk)
+				{
+					if (chunk->RefCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+						delete chunk;
+				}
+
+				void* operator new(std::size_t size)
+				{
+#ifdef _MSC_VER
+					return _aligned_malloc(size, CacheLineSize);
+#else
+					// aligned_alloc requires the size to be a multiple of the alignment.
+					return std::aligned_alloc(CacheLineSize, (size + CacheLineSize - 1) / CacheLineSize * CacheLineSize);
+#endif
+				}
+
+				void operator delete(void* p)
+				{
+
+#ifdef _MSC_VER
+					_aligned_free(p);
+#else
+					std::free(p);
+#endif
 				}
 
 				template<typename ComponentType>
 				ComponentType* GetComponent(uint32_t index)
 				{
-					return &std::get<std::array<ComponentType, EntityCountPerChunk>>(Components)[index];
+					return &std::get<Column<ComponentType>>(Components)[index];
 				}
 
 				template<std::size_t I>
@@ -224,239 +1447,1142 @@ namespace de2
 					}
 				}
 
-				template<std::size_t I>
-				std::enable_if_t<I == sizeof...(ComponentTypes), void*> GetComponent(uint32_t componentTupleIndex, uint32_t entityIndex)
-				{
-					return nullptr;
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes), void*> GetComponent(uint32_t componentTupleIndex, uint32_t entityIndex)
+				{
+					return nullptr;
+				}
+
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes), void*> GetComponent(uint32_t componentTupleIndex, uint32_t entityIndex)
+				{
+					if (I == componentTupleIndex) {
+						return &std::get<I>(Components)[entityIndex];
+					}
+					else {
+						return GetComponent<I + 1>(componentTupleIndex, entityIndex);
+					}
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes), void*> SetComponent(uint32_t componentTupleIndex, uint32_t entityIndex, void* compData)
+				{
+					return nullptr;
+				}
+
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes), void*> SetComponent(uint32_t componentTupleIndex, uint32_t entityIndex, void* compData)
+				{
+					if (I == componentTupleIndex) {
+						auto* comp = &std::get<I>(Components)[entityIndex];
+						*comp = *(const decltype(comp))compData;
+						return comp;
+					}
+					else {
+						return SetComponent<I + 1>(componentTupleIndex, entityIndex, compData);
+					}
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> SetComponents(uint32_t entityIndex, std::tuple<ComponentTypes&&...>&& source)
+				{
+				}
+
+				// Constructs the unused row entityIndex from source.
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> SetComponents(uint32_t entityIndex, std::tuple<ComponentTypes&&...>&& source)
+				{
+					using ComponentType = std::tuple_element_t<I, Tuple>;
+					::new ((void*)&std::get<I>(Components)[entityIndex]) ComponentType(std::get<I>(std::move(source)));
+					SetComponents<I + 1>(entityIndex, std::forward<std::tuple<ComponentTypes&& ...>>(source));
+				}
+
+				// entities must be sorted in ascending order without duplicates.
+				// Removed rows are filled with the last row of the chunk. The moves are written to moved, at most count.
+				// Returns the number of rows moved.
+				uint32_t /*Chunk::*/RemoveEntities(const uint32_t* entities, uint32_t count, MovedFromTo* moved)
+				{
+					assert(count > 0);
+					assert(count <= Count);
+					uint32_t movedCount = 0;
+					for (auto it = entities + count; it != entities;) {
+						uint32_t index = *--it;
+						uint32_t lastIndex = Count - 1;
+						DestroyRows<0>(index, 1);
+						if (index != lastIndex) {
+							RelocateRow<0>(index, *this, lastIndex);
+							Entities[index] = Entities[lastIndex];
+							moved[movedCount++] = { lastIndex, index };
+						}
+						--Count;
+					}
+					return movedCount;
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> ConstructRows(uint32_t index, uint32_t count)
+				{
+				}
+
+				// Value initializes the unused rows [index, index + count).
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> ConstructRows(uint32_t index, uint32_t count)
+				{
+					std::uninitialized_value_construct_n(&std::get<I>(Components)[index], count);
+					ConstructRows<I + 1>(index, count);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> DestroyRows(uint32_t index, uint32_t count)
+				{
+				}
+
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> DestroyRows(uint32_t index, uint32_t count)
+				{
+					std::destroy_n(&std::get<I>(Components)[index], count);
+					DestroyRows<I + 1>(index, count);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> CopyRows(const Chunk& other)
+				{
+				}
+
+				// Copy constructs the rows [0, Count) from other.
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> CopyRows(const Chunk& other)
+				{
+					std::uninitialized_copy_n(&std::get<I>(other.Components)[0], Count, &std::get<I>(Components)[0]);
+					CopyRows<I + 1>(other);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> RelocateRow(uint32_t dest, Chunk& srcChunk, uint32_t src)
+				{
+				}
+
+				// Moves a row of srcChunk, possibly this chunk, to the unused row dest. The source row is left unused.
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> RelocateRow(uint32_t dest, Chunk& srcChunk, uint32_t src)
+				{
+					RelocateRows(&std::get<I>(Components)[dest], &std::get<I>(srcChunk.Components)[src], 1);
+					RelocateRow<I + 1>(dest, srcChunk, src);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> GetRow(uint32_t index, Tuple& row) const
+				{
+				}
+
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> GetRow(uint32_t index, Tuple& row) const
+				{
+					std::get<I>(row) = std::get<I>(Components)[index];
+					GetRow<I + 1>(index, row);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> SetRow(uint32_t index, Tuple& row)
+				{
+				}
+
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> SetRow(uint32_t index, Tuple& row)
+				{
+					std::get<I>(Components)[index] = std::move(std::get<I>(row));
+					SetRow<I + 1>(index, row);
+				}
+
+				template<std::size_t I>
+				std::enable_if_t<I == sizeof...(ComponentTypes)> FillRows(uint32_t index, uint32_t count, const Tuple& row)
+				{
+				}
+
+				// Copy constructs row in the unused rows [index, index + count), one component array at a time.
+				template<std::size_t I = 0>
+				std::enable_if_t < I < sizeof...(ComponentTypes)> FillRows(uint32_t index, uint32_t count, const Tuple& row)
+				{
+					std::uninitialized_fill_n(&std::get<I>(Components)[index], count, std::get<I>(row));
+					FillRows<I + 1>(index, count, row);
+				}
+			};
+
+			static_assert(sizeof(Chunk) <= ChunkSize, "Invalid chunk size. Array alignment problem?");
+			static constexpr bool Mappable = ColdComponentCount == 0 && (std::is_trivially_copyable_v<ComponentTypes> && ...);
+			static constexpr std::size_t ChunkStride = (sizeof(Chunk) + CacheLineSize - 1) / CacheLineSize * CacheLineSize;
+			Chunk* RootChunk;
+			EntityMap<std::pair<Chunk*, uint32_t>> EntityToComponent;
+			// In push order. Cleared by RunEvents(), keeping the capacity.
+			std::vector<std::pair<EntityId, IEvent*>> Events;
+
+			struct RemovingEntity {
+				EntityId Entity;
+				typename ArchetypePool::Chunk* Chunk;
+				uint32_t Index;
+				bool operator ==(const RemovingEntity& other) const { return Entity == other.Entity; }
+				bool operator <(const RemovingEntity& other) const {
+					return Chunk < other.Chunk ||
+						Chunk == other.Chunk && Index < other.Index;
+				}
+			};
+
+			SortedVector<RemovingEntity> PendingRemove;
+			// Chunk job of the current flush. The rows of PendingRemove [Begin, End) are in Chunk.
+			struct FlushJob
+			{
+				typename ArchetypePool::Chunk* Chunk;
+				uint32_t Begin;
+				uint32_t End;
+				uint32_t MovedCount;
+			};
+			std::vector<FlushJob> FlushJobs;
+			// Per PendingRemove entry. The moves of a job are written from its Begin.
+			std::vector<uint32_t> FlushIndices;
+			std::vector<MovedFromTo> FlushMoved;
+			// Shared chunk and its clone, in the order of PendingRemove. See DetachPendingRemoveChunks().
+			// A member rather than a FrameVector, since BeginFlush() may run on a worker.
+			std::vector<std::pair<Chunk*, Chunk*>> FlushDetached;
+			// Chunk list of the running Defragment(), so it finds the hole and the tail without walking the list.
+			std::vector<Chunk*> DefragmentChunks;
+			std::mutex Mutex;
+			// Advanced by GetChangedChunks(). Written chunks are stamped with it.
+			std::atomic<uint64_t> WriteEpoch = 1;
+			// Rows registered by DOECS::CreatePrefab().
+			std::vector<Tuple> Prefabs;
+			// Entities added since the previous NotifyObservers(). Recorded while Observed.
+			bool Observed = false;
+			std::vector<EntityId> Added;
+			// Incremental Sort() state. Odd-even merge of adjacent chunks.
+			uint32_t SortParity = 0;
+			uint32_t SortCursor = 0;
+			uint32_t SortCleanMerges = 0;
+
+			//
+			// ChunkSnapshot
+			//
+			class ChunkSnapshot : public IPoolSnapshot
+			{
+				std::vector<uint64_t> ComponentHashes;
+				// Chunk pointer and the row count at the time of the snapshot.
+				std::vector<std::pair<Chunk*, uint32_t>> Chunks;
+
+			public:
+				ChunkSnapshot(const std::vector<uint64_t>& componentHashes, Chunk* rootChunk)
+					: ComponentHashes(componentHashes)
+				{
+					for (auto chunk = rootChunk; chunk; chunk = chunk->Next) {
+						if (chunk->Count == 0)
+							continue;
+						chunk->AddRef();
+						Chunks.push_back({ chunk, chunk->Count });
+					}
+				}
+
+				~ChunkSnapshot() override
+				{
+					for (auto& it : Chunks) {
+						Chunk::Release(it.first);
+					}
+				}
+
+				bool IsSnapshotFor(ISystem* system) override
+				{
+					return MatchQuery(system, ComponentHashes, nullptr);
+				}
+
+				bool GetColumns(ISystem* system, std::vector<int32_t>& columns) override
+				{
+					return MatchQuery(system, ComponentHashes, &columns);
+				}
+
+				uint32_t GetColumn(uint32_t chunkIndex, int32_t column, const void*& components) override
+				{
+					components = nullptr;
+					if (chunkIndex >= Chunks.size())
+						return 0;
+					if (column >= 0) {
+						void* p = nullptr;
+						Chunks[chunkIndex].first->GetComponents((uint32_t)column, p);
+						components = p;
+					}
+					return Chunks[chunkIndex].second;
+				}
+
+				uint32_t GetChunkCount() override
+				{
+					return (uint32_t)Chunks.size();
+				}
+
+				uint32_t GetComponents(uint32_t chunkIndex, uint64_t hash, const void*& components) override
+				{
+					if (chunkIndex >= Chunks.size())
+						return 0;
+					auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), hash);
+					if (it == ComponentHashes.end())
+						return 0;
+					void* p = nullptr;
+					Chunks[chunkIndex].first->GetComponents((uint32_t)std::distance(ComponentHashes.begin(), it), p);
+					components = p;
+					return Chunks[chunkIndex].second;
+				}
+
+				uint32_t GetEntities(uint32_t chunkIndex, const EntityId*& entities) override
+				{
+					if (chunkIndex >= Chunks.size())
+						return 0;
+					entities = &Chunks[chunkIndex].first->Entities[0];
+					return Chunks[chunkIndex].second;
+				}
+
+				bool GetColumnLayout(uint64_t hash, ColumnLayout& layout) override
+				{
+					static const ColumnLayout Layouts[] = { ColumnLayout::Of<ComponentTypes>()... };
+					auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), hash);
+					if (it == ComponentHashes.end())
+						return false;
+					layout = Layouts[std::distance(ComponentHashes.begin(), it)];
+					return true;
+				}
+			};
+
+		public:
+			ArchetypePool(uint64_t hash, std::vector<uint64_t>&& componentHashes)
+				: Hash(hash)
+				, ComponentHashes(componentHashes)
+			{
+				RootChunk = new Chunk;
+#if DOECS_PROFILE
+				for (auto& typeName : { TypeName(typeid(ComponentTypes))... }) {
+					Name += Name.empty() ? "Pool<" : ", ";
+					Name += typeName;
+				}
+				Name += ">";
+#endif
+			}
+
+			~ArchetypePool()
+			{
+				auto chunk = RootChunk;
+				RootChunk = nullptr;
+				while (chunk)
+				{
+					Chunk* next = chunk->Next;
+					Chunk::Release(chunk);
+					chunk = next;
+				}
+			}
+
+			bool IsPoolFor(uint64_t componentHash) override
+			{
+				return Hash == componentHash;
+			}
+
+			bool HasComponent(uint64_t componentHash) override
+			{
+				return std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash) != ComponentHashes.end();
+			}
+
+			bool IsPoolFor(ISystem* system) override
+			{
+				return MatchQuery(system, ComponentHashes, nullptr);
+			}
+
+			bool GetColumns(ISystem* system, std::vector<int32_t>& columns) override
+			{
+				return MatchQuery(system, ComponentHashes, &columns);
+			}
+
+			bool RunSystem(ISystem* system, const std::vector<int32_t>& columns, SystemSlice& slice) override
+			{
+				ComponentsArgLease lease(columns.size());
+				auto& components = lease.Get();
+				bool hasDeadline = slice.Deadline != std::chrono::steady_clock::time_point::max();
+				uint32_t chunkIndex = 0;
+				auto chunk = RootChunk;
+				for (; chunk && chunkIndex < slice.Cursor; chunk = chunk->Next) {
+					++chunkIndex;
+				}
+				for (; chunk; chunk = chunk->Next, ++chunkIndex) {
+					if (chunk->Count == 0)
+						continue;
+					if (slice.ChunkBudget == 0 || (hasDeadline && slice.ChunkCount > 0 && std::chrono::steady_clock::now() >= slice.Deadline)) {
+						slice.Cursor = chunkIndex;
+						return false;
+					}
+					// Systems write through the arrays. Only their columns are stamped.
+					chunk = GetUnsharedChunk(chunk);
+					GetWritableColumns(chunk, columns, components);
+					system->Execute(chunk->Count, components);
+					slice.EntityCount += chunk->Count;
+					++slice.ChunkCount;
+					--slice.ChunkBudget;
+				}
+				return true;
+			}
+
+			uint32_t GetChunkCount() override
+			{
+				uint32_t chunkCount = 0;
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					chunkCount += chunk->Count > 0;
+				}
+				return chunkCount;
+			}
+
+			int32_t FindColumn(uint64_t componentHash) override
+			{
+				auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash);
+				return it == ComponentHashes.end() ? -1 : (int32_t)std::distance(ComponentHashes.begin(), it);
+			}
+
+			uint32_t ForEachChunk(const std::vector<int32_t>& columns, const ChunkFn& fn) override
+			{
+				uint32_t entityCount = 0;
+				ComponentsArgLease lease(columns.size());
+				auto& components = lease.Get();
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					if (chunk->Count == 0)
+						continue;
+					chunk = GetUnsharedChunk(chunk);
+					GetWritableColumns(chunk, columns, components);
+					fn(chunk->Count, chunk->Entities.data(), components);
+					entityCount += chunk->Count;
+				}
+				return entityCount;
+			}
+
+			uint32_t GetEntityCount() override
+			{
+				return (uint32_t)EntityToComponent.size();
+			}
+
+			bool IsMappable() override
+			{
+				return Mappable;
+			}
+
+			bool WriteImage(FILE* file, ImagePool& desc, std::vector<ImageEntity>& index) override
+			{
+				if (!Mappable)
+					return false;
+				std::vector<Chunk*> chunks;
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					if (chunk->Count > 0)
+						chunks.push_back(chunk);
+				}
+				desc.PoolHash = Hash;
+				desc.ChunkSize = sizeof(Chunk);
+				desc.ChunkStride = ChunkStride;
+				desc.ChunkCount = (uint32_t)chunks.size();
+				desc.EntityCount = 0;
+				desc.WriteEpoch = WriteEpoch.load(std::memory_order_relaxed);
+
+				// Two strides, so Next of the copy can point at the following chunk as it will be in the file.
+				auto buffer = (char*)Chunk::operator new(ChunkStride * 2);
+				bool written = true;
+				for (std::size_t c = 0; c < chunks.size() && written; ++c) {
+					std::memset(buffer, 0, ChunkStride);
+					auto copy = ::new (buffer) Chunk(*chunks[c]);
+					copy->RefCount.store(1 | Chunk::MappedFlag, std::memory_order_relaxed);
+					copy->Next = c + 1 < chunks.size() ? (Chunk*)(buffer + ChunkStride) : nullptr;
+					written = fwrite(buffer, 1, ChunkStride, file) == ChunkStride;
+					copy->~Chunk();
+					for (uint32_t row = 0; row < chunks[c]->Count; ++row) {
+						index.push_back({ chunks[c]->Entities[row], (uint32_t)c, row });
+					}
+					desc.EntityCount += chunks[c]->Count;
+				}
+				Chunk::operator delete(buffer);
+				return written;
+			}
+
+			void GetImageColumns(std::vector<ImageColumn>& columns) override
+			{
+				static constexpr uint32_t Sizes[] = { (uint32_t)sizeof(ComponentTypes)... };
+				static constexpr uint32_t Alignments[] = { (uint32_t)alignof(ComponentTypes)... };
+				for (uint32_t c = 0; c < ComponentCount; ++c) {
+					columns.push_back({ ComponentHashes[c], IsColdColumn[c] ? 0 : (uint64_t)GetColumnOffset(c), Sizes[c], Alignments[c] });
+				}
+			}
+
+			bool CanMapImage(const char* image, const ImagePool& desc) override
+			{
+				if (!Mappable || desc.ChunkSize != sizeof(Chunk) || desc.ChunkStride != ChunkStride || desc.ChunkCount == 0)
+					return false;
+				if (EntityToComponent.size() > 0 || RootChunk->Count > 0 || RootChunk->Next)
+					return false;
+				if (desc.ColumnCount != ComponentCount)
+					return false;
+				std::vector<ImageColumn> columns;
+				GetImageColumns(columns);
+				auto imageColumns = (const ImageColumn*)(image + desc.ColumnOffset);
+				if (!std::equal(columns.begin(), columns.end(), imageColumns, [](const ImageColumn& a, const ImageColumn& b) {
+					return a.ComponentHash == b.ComponentHash && a.Offset == b.Offset && a.Size == b.Size && a.Alignment == b.Alignment;
+				}))
+					return false;
+				auto index = (const ImageEntity*)(image + desc.IndexOffset);
+				return std::all_of(index, index + desc.EntityCount, [&desc](const ImageEntity& entity) {
+					return entity.ChunkIndex < desc.ChunkCount && entity.Row < EntityCountPerChunk;
+				});
+			}
+
+			void MapImage(char* image, const ImagePool& desc) override
+			{
+				// The chunks are not touched, so they are paged in by the first system which reads them.
+				auto chunks = image + desc.ChunkOffset;
+				Chunk::Release(RootChunk);
+				RootChunk = (Chunk*)chunks;
+				auto index = (const ImageEntity*)(image + desc.IndexOffset);
+				EntityToComponent.reserve(desc.EntityCount);
+				for (uint32_t i = 0; i < desc.EntityCount; ++i) {
+					EntityToComponent[index[i].Entity] = { (Chunk*)(chunks + index[i].ChunkIndex * ChunkStride), index[i].Row };
+					RecordAdded(index[i].Entity);
+				}
+				if (WriteEpoch.load(std::memory_order_relaxed) <= desc.WriteEpoch)
+					WriteEpoch.store(desc.WriteEpoch + 1, std::memory_order_relaxed);
+			}
+
+			// "Pool<A, B>" with DOECS_PROFILE, the mangled pool type otherwise.
+			const char* GetName() override
+			{
+#if DOECS_PROFILE
+				return Name.c_str();
+#else
+				return typeid(ArchetypePool).name();
+#endif
+			}
+
+			void GetStats(PoolStats& stats) override
+			{
+				stats = PoolStats();
+				stats.Hash = Hash;
+				stats.Name = GetName();
+				stats.EntityCountPerChunk = EntityCountPerChunk;
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					++stats.ChunkCount;
+					stats.EntityCount += chunk->Count;
+					auto bucket = std::min(chunk->Count * PoolStats::FillHistogramBuckets / EntityCountPerChunk, PoolStats::FillHistogramBuckets - 1);
+					++stats.FillHistogram[bucket];
+				}
+				stats.BytesAllocated = (uint64_t)stats.ChunkCount * (sizeof(Chunk) + EntityCountPerChunk * ColdEntitySize);
+				stats.BytesWasted = ((uint64_t)stats.ChunkCount * EntityCountPerChunk - stats.EntityCount) * (EntitySize + ColdEntitySize + sizeof(EntityId));
+			}
+
+			bool /*ArchetypePool::*/Defragment(std::chrono::steady_clock::time_point deadline) override
+			{
+				// Row indices in PendingRemove must stay valid until Flush.
+				if (!PendingRemove.empty())
+					return false;
+
+				// The hole moves forward and the tail backward, so a call walks the list once however many rows it moves.
+				auto& chunks = DefragmentChunks;
+				chunks.clear();
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					chunks.push_back(chunk);
+				}
+				auto getWritable = [this, &chunks](std::size_t i) {
+					if (chunks[i]->IsShared())
+						chunks[i] = DetachChunk(chunks[i], false, i > 0 ? chunks[i - 1] : nullptr);
+					MarkWritten(chunks[i]);
+					return chunks[i];
+				};
+
+				std::size_t holeIndex = 0;
+				std::size_t tailIndex = chunks.size() - 1;
+				while (true) {
+					while (holeIndex < tailIndex && chunks[holeIndex]->Count == EntityCountPerChunk)
+						++holeIndex;
+					if (holeIndex >= tailIndex)
+						return true;
+					if (std::chrono::steady_clock::now() >= deadline)
+						return false;
+
+					auto hole = getWritable(holeIndex);
+					auto tail = getWritable(tailIndex);
+
+					// Fill the hole from the end of the tail chunk.
+					auto moveCount = std::min(EntityCountPerChunk - hole->Count, tail->Count);
+					for (uint32_t i = 0; i < moveCount; ++i) {
+						auto src = tail->Count - 1 - i;
+						auto dest = hole->Count + i;
+						hole->RelocateRow(dest, *tail, src);
+						hole->Entities[dest] = tail->Entities[src];
+						EntityToComponent[hole->Entities[dest]] = { hole, dest };
+					}
+					hole->Count += moveCount;
+					tail->Count -= moveCount;
+
+					if (tail->Count == 0) {
+						chunks[--tailIndex]->Next = nullptr;
+						Chunk::Release(tail);
+					}
+				}
+			}
+
+			// Reorders the rows by keyFn(const ComponentTypes&...) in ascending order. Chunk row counts are kept.
+			// maxChunkPairs == 0 sorts the whole pool. Otherwise merges up to maxChunkPairs adjacent chunk pairs
+			// in odd-even order and continues from there on the next call.
+			// Returns true when the pool is sorted. Returns false without sorting while removals are pending.
+			template<typename KeyFn>
+			bool /*ArchetypePool::*/Sort(KeyFn& keyFn, uint32_t maxChunkPairs)
+			{
+				// Row indices in PendingRemove must stay valid until Flush.
+				if (!PendingRemove.empty())
+					return false;
+
+				std::vector<Chunk*> chunks;
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next) {
+					chunks.push_back(chunk);
+				}
+
+				if (maxChunkPairs == 0 || chunks.size() == 1) {
+					SortChunks(chunks.data(), (uint32_t)chunks.size(), keyFn);
+					SortParity = SortCursor = SortCleanMerges = 0;
+					return true;
+				}
+
+				auto pairCount = (uint32_t)chunks.size() - 1;
+				for (uint32_t i = 0; i < maxChunkPairs && SortCleanMerges < pairCount; ++i) {
+					if (SortCursor + 1 >= chunks.size()) {
+						SortParity ^= 1;
+						SortCursor = SortParity;
+						continue;
+					}
+					if (SortChunks(&chunks[SortCursor], 2, keyFn))
+						SortCleanMerges = 0;
+					else
+						++SortCleanMerges;
+					SortCursor += 2;
+				}
+				// Every adjacent pair is in order.
+				return SortCleanMerges >= pairCount;
+			}
+
+			// Component address of each requested entity and the index of its value.
+			using BatchRow = std::pair<char*, uint32_t>;
+
+			static constexpr bool IsColdColumn[] = { IsColdComponent<ComponentTypes>::value... };
+			static constexpr bool IsTriviallyCopyableColumn[] = { std::is_trivially_copyable_v<ComponentTypes>... };
+			static constexpr void (*CopyColumnComponent[])(void*, const void*) = { &impl::CopyComponent<ComponentTypes>... };
+
+			// Copy assigns a component of the column. memcpy for trivially copyable components.
+			static void CopyComponent(uint32_t column, void* dest, const void* src, std::size_t componentSize)
+			{
+				if (IsTriviallyCopyableColumn[column])
+					memcpy(dest, src, componentSize);
+				else
+					CopyColumnComponent[column](dest, src);
+			}
+
+			// Offset of the component array in a chunk. The same for every chunk. Hot columns only.
+			std::size_t GetColumnOffset(uint32_t column)
+			{
+				void* components = nullptr;
+				RootChunk->GetComponents(column, components);
+				return (char*)components - (char*)RootChunk;
+			}
+
+			// Component addresses of the requested entities in request order, so the last of duplicate Scatter requests wins.
+			// Not sorted by (chunk, row): the rows are prefetched ahead of the copies, which hides the jumps between chunks,
+			// and sorting shuffled requests made Gather 3-4x slower in doecs_bench at every size.
+			// The index slots are prefetched ahead of the lookups. writable detaches the shared chunks once each.
+			void ResolveBatch(const BatchRequest* requests, uint32_t count, uint32_t column, std::size_t componentSize, bool writable, std::vector<BatchRow>& rows)
+			{
+				auto cold = IsColdColumn[column];
+				auto columnOffset = cold ? 0 : GetColumnOffset(column);
+				rows.reserve(count);
+				for (uint32_t i = 0; i < count; ++i) {
+					if (i + BatchPrefetchDistance < count)
+						EntityToComponent.Prefetch(requests[i + BatchPrefetchDistance].Entity);
+					auto it = EntityToComponent.find(requests[i].Entity);
+					if (it == EntityToComponent.end())
+						continue;
+					// Detaching a chunk rewrites the index entries of its rows, so it is not read after that.
+					auto chunk = it->second.first;
+					auto row = it->second.second;
+					if (writable)
+						chunk = GetWritableChunk(chunk, column);
+					if (cold)
+						rows.push_back({ (char*)chunk->GetComponent(column, row), requests[i].ValueIndex });
+					else
+						rows.push_back({ (char*)chunk + columnOffset + row * componentSize, requests[i].ValueIndex });
+				}
+			}
+
+			uint32_t /*ArchetypePool::*/Gather(uint64_t componentHash, const BatchRequest* requests, uint32_t count, void* values, std::size_t componentSize) override
+			{
+				auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash);
+				if (it == ComponentHashes.end())
+					return 0;
+
+				auto column = (uint32_t)std::distance(ComponentHashes.begin(), it);
+				std::vector<BatchRow> rows;
+				ResolveBatch(requests, count, column, componentSize, false, rows);
+				for (std::size_t i = 0; i < rows.size(); ++i) {
+					if (i + BatchPrefetchDistance < rows.size())
+						Prefetch(rows[i + BatchPrefetchDistance].first);
+					CopyComponent(column, (char*)values + rows[i].second * componentSize, rows[i].first, componentSize);
+				}
+				return (uint32_t)rows.size();
+			}
+
+			uint32_t /*ArchetypePool::*/Scatter(uint64_t componentHash, const BatchRequest* requests, uint32_t count, const void* values, std::size_t componentSize) override
+			{
+				auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash);
+				if (it == ComponentHashes.end())
+					return 0;
+
+				auto column = (uint32_t)std::distance(ComponentHashes.begin(), it);
+				std::vector<BatchRow> rows;
+				ResolveBatch(requests, count, column, componentSize, true, rows);
+				for (std::size_t i = 0; i < rows.size(); ++i) {
+					if (i + BatchPrefetchDistance < rows.size())
+						Prefetch(rows[i + BatchPrefetchDistance].first);
+					CopyComponent(column, rows[i].first, (const char*)values + rows[i].second * componentSize, componentSize);
+				}
+				return (uint32_t)rows.size();
+			}
+
+			uint32_t AddPrefab(Tuple&& row)
+			{
+				Prefabs.push_back(std::move(row));
+				return (uint32_t)Prefabs.size() - 1;
+			}
+
+			uint32_t /*ArchetypePool::*/Instantiate(uint32_t prefabIndex, EntityId firstEntity, uint32_t count) override
+			{
+				if (prefabIndex >= Prefabs.size())
+					return 0;
+				const auto& row = Prefabs[prefabIndex];
+				EntityToComponent.reserve(EntityToComponent.size() + count);
+
+				uint32_t added = 0;
+				auto chunk = RootChunk;
+				while (added < count) {
+					if (chunk->Count < EntityCountPerChunk) {
+						auto begin = chunk->Count;
+						auto fillCount = std::min(EntityCountPerChunk - begin, count - added);
+						chunk->FillRows(begin, fillCount, row);
+						for (uint32_t i = 0; i < fillCount; ++i) {
+							auto entity = firstEntity + added + i;
+							chunk->Entities[begin + i] = entity;
+							EntityToComponent[entity] = { chunk, begin + i };
+							RecordAdded(entity);
+						}
+						chunk->Count += fillCount;
+						added += fillCount;
+						MarkWritten(chunk);
+					}
+					if (!chunk->Next && added < count)
+						chunk->Next = new Chunk;
+					chunk = chunk->Next;
+				}
+				return added;
+			}
+
+			IArchetypePool* CreateEmpty() override
+			{
+				return new ArchetypePool(Hash, std::vector<uint64_t>(ComponentHashes));
+			}
+
+			uint32_t /*ArchetypePool::*/Splice(IArchetypePool* source) override
+			{
+				auto other = (ArchetypePool*)source;
+				assert(other->Hash == Hash);
+				assert(other->PendingRemove.empty());
+
+				// Unlink the chunks of the source. Empty chunks are released.
+				std::vector<Chunk*> chunks;
+				for (auto chunk = other->RootChunk; chunk;) {
+					Chunk* next = chunk->Next;
+					chunk->Next = nullptr;
+					if (chunk->Count > 0)
+						chunks.push_back(chunk);
+					else
+						Chunk::Release(chunk);
+					chunk = next;
 				}
+				other->RootChunk = new Chunk;
+				if (chunks.empty())
+					return 0;
 
-				template<std::size_t I = 0>
-				std::enable_if_t < I < sizeof...(ComponentTypes), void*> GetComponent(uint32_t componentTupleIndex, uint32_t entityIndex)
-				{
-					if (I == componentTupleIndex) {
-						return &std::get<I>(Components)[entityIndex];
-					}
-					else {
-						return GetComponent<I + 1>(componentTupleIndex, entityIndex);
+				for (std::size_t i = 0; i + 1 < chunks.size(); ++i) {
+					chunks[i]->Next = chunks[i + 1];
+				}
+				for (auto chunk : chunks) {
+					MarkWritten(chunk);
+					for (uint32_t i = 0; i < chunk->Count; ++i) {
+						RecordAdded(chunk->Entities[i]);
 					}
 				}
 
-				template<std::size_t I>
-				std::enable_if_t<I == sizeof...(ComponentTypes), void*> SetComponent(uint32_t componentTupleIndex, uint32_t entityIndex, void* compData)
-				{
-					return nullptr;
+				Chunk* tail = RootChunk;
+				while (tail->Next)
+					tail = tail->Next;
+				if (tail == RootChunk && RootChunk->Count == 0) {
+					Chunk::Release(RootChunk);
+					RootChunk = chunks[0];
 				}
-
-				template<std::size_t I = 0>
-				std::enable_if_t < I < sizeof...(ComponentTypes), void*> SetComponent(uint32_t componentTupleIndex, uint32_t entityIndex, void* compData)
-				{
-					if (I == componentTupleIndex) {
-						auto& componentArray = std::get<I>(Components);
-						auto* comp = &componentArray[entityIndex];
-						memcpy(comp, compData, sizeof(std::remove_reference_t<decltype(componentArray)>::value_type));
-						return comp;
-					}
-					else {
-						return SetComponent<I + 1>(componentTupleIndex, entityIndex, compData);
-					}
+				else {
+					tail->Next = chunks[0];
 				}
 
-				void DeleteChunkHierarchy()
-				{
-					if (!Next)
-						return;
-					Next->DeleteChunkHierarchy();
-					delete Next;
-					Next = nullptr;
+				EntityToComponent.reserve(EntityToComponent.size() + other->EntityToComponent.size());
+				EntityToComponent.insert(other->EntityToComponent.begin(), other->EntityToComponent.end());
+				other->EntityToComponent.clear();
+				Events.insert(Events.end(), other->Events.begin(), other->Events.end());
+				other->Events.clear();
+				return (uint32_t)chunks.size();
+			}
+
+			IPoolSnapshot* CreateSnapshot() override
+			{
+				return new ChunkSnapshot(ComponentHashes, RootChunk);
+			}
+
+			uint64_t GetChangedChunks(uint64_t componentHash, uint64_t sinceEpoch, std::vector<ChangedChunk>& changed, uint32_t& chunkCount) override
+			{
+				auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash);
+				auto componentIndex = (uint32_t)std::distance(ComponentHashes.begin(), it);
+				auto column = it == ComponentHashes.end() ? -1 : (int32_t)componentIndex;
+				// Writes from now on are stamped with the new epoch.
+				auto epoch = WriteEpoch.fetch_add(1, std::memory_order_relaxed);
+				chunkCount = 0;
+				for (auto chunk = RootChunk; chunk; chunk = chunk->Next, ++chunkCount) {
+					if (GetVersion(chunk, column) < sinceEpoch)
+						continue;
+					void* components = nullptr;
+					if (it != ComponentHashes.end())
+						chunk->GetComponents(componentIndex, components);
+					changed.push_back({ chunkCount, chunk->Count, &chunk->Entities[0], components });
 				}
+				return epoch + 1;
+			}
 
-				template<std::size_t I>
-				std::enable_if_t<I == sizeof...(ComponentTypes)> SetComponents(uint32_t entityIndex, std::tuple<ComponentTypes&&...>&& source)
-				{
+			// Stamps the column with the current write epoch.
+			void MarkWritten(Chunk* chunk, uint32_t column)
+			{
+				auto epoch = WriteEpoch.load(std::memory_order_relaxed);
+				if (chunk->Versions[column].load(std::memory_order_relaxed) != epoch)
+					chunk->Versions[column].store(epoch, std::memory_order_relaxed);
+			}
+
+			// Stamps every column. Adding, removing and moving rows changes them all.
+			void MarkWritten(Chunk* chunk)
+			{
+				for (uint32_t c = 0; c < ComponentCount; ++c) {
+					MarkWritten(chunk, c);
 				}
+			}
 
-				template<std::size_t I = 0>
-				std::enable_if_t < I < sizeof...(ComponentTypes)> SetComponents(uint32_t entityIndex, std::tuple<ComponentTypes&&...>&& source)
-				{
-					std::get<I>(Components)[entityIndex] = std::get<I>(source);
-					SetComponents<I + 1>(entityIndex, std::forward<std::tuple<ComponentTypes&& ...>>(source));
+			// Epoch of the last write to the column, or to any column for -1.
+			static uint64_t GetVersion(const Chunk* chunk, int32_t column)
+			{
+				if (column >= 0)
+					return chunk->Versions[column].load(std::memory_order_relaxed);
+				uint64_t version = 0;
+				for (auto& columnVersion : chunk->Versions) {
+					version = std::max(version, columnVersion.load(std::memory_order_relaxed));
 				}
+				return version;
+			}
 
-				uint32_t FindLastValidIndexWhileRemoving(const std::vector<uint32_t>& entities,
-					const std::vector<MovedFromTo>& invalidatedIndex) const
-				{
-					assert(!entities.empty());
-					if (Count == 0)
-						return InvalidIndex;
+			// Returns a chunk which is safe to write, without stamping it.
+			// If a snapshot still reads the chunk, it is replaced by a private copy.
+			Chunk* GetUnsharedChunk(Chunk* chunk)
+			{
+				if (chunk->IsShared())
+					chunk = DetachChunk(chunk);
+				return chunk;
+			}
 
-					for (uint32_t i = Count - 1; i >= 0; --i) {
-						if (std::find_if(invalidatedIndex.begin(), invalidatedIndex.end(), [i](const MovedFromTo& v) {return v.first == i; })
-							!= invalidatedIndex.end())
-							continue;
+			// Unshares the chunk and stamps every column.
+			Chunk* GetWritableChunk(Chunk* chunk)
+			{
+				chunk = GetUnsharedChunk(chunk);
+				MarkWritten(chunk);
+				return chunk;
+			}
 
-						if (i > entities.back())
-							return i;
+			// Unshares the chunk and stamps one column.
+			Chunk* GetWritableChunk(Chunk* chunk, uint32_t column)
+			{
+				chunk = GetUnsharedChunk(chunk);
+				MarkWritten(chunk, column);
+				return chunk;
+			}
 
-						if (std::find(entities.rbegin(), entities.rend(), i) == entities.rend())
-							return i;
-					}
-					return InvalidIndex;
+			// Fills components with the arrays of the columns (nullptr for -1) and stamps them.
+			void GetWritableColumns(Chunk* chunk, const std::vector<int32_t>& columns, ComponentsArg& components)
+			{
+				for (std::size_t c = 0; c < columns.size(); ++c) {
+					components[c] = nullptr;
+					if (columns[c] < 0)
+						continue;
+					chunk->GetComponents((uint32_t)columns[c], components[c]);
+					MarkWritten(chunk, (uint32_t)columns[c]);
 				}
+			}
 
-				std::vector<MovedFromTo> /*Chunk::*/RemoveEntities(const std::vector<uint32_t>& entities)
-				{
-					assert(!entities.empty());
-					assert(entities.size() <= Count);
-					std::vector<MovedFromTo> invalidatedIndex;
-					for (uint32_t index : entities) {
-						uint32_t lastValidIndex = FindLastValidIndexWhileRemoving(entities, invalidatedIndex);
-						if (lastValidIndex != InvalidIndex) {
-							Memcpy<0>(index, lastValidIndex);
-							invalidatedIndex.push_back({ lastValidIndex, index });
-						}
-						--Count;
+			// updatePendingRemove false leaves the entries of PendingRemove pointing at the old chunk.
+			// prev is the chunk before chunk if the caller knows it. Otherwise the list is walked to find it.
+			Chunk* DetachChunk(Chunk* chunk, bool updatePendingRemove = true, Chunk* prev = nullptr)
+			{
+				auto clone = new Chunk(*chunk);
+				if (RootChunk == chunk) {
+					RootChunk = clone;
+				}
+				else {
+					if (!prev) {
+						prev = RootChunk;
+						while (prev->Next != chunk)
+							prev = prev->Next;
 					}
-					return invalidatedIndex;
+					assert(prev->Next == chunk);
+					prev->Next = clone;
 				}
 
-				template<std::size_t I>
-				std::enable_if_t<I == sizeof...(ComponentTypes)> Memcpy(uint32_t dest, uint32_t src)
-				{
+				for (uint32_t i = 0; i < clone->Count; ++i) {
+					EntityToComponent[clone->Entities[i]] = { clone, i };
 				}
 
-				template<std::size_t I = 0>
-				std::enable_if_t < I < sizeof...(ComponentTypes)> Memcpy(uint32_t dest, uint32_t src)
-				{
-					auto& componentArray = std::get<I>(Components);
-					memcpy(&componentArray[dest], &componentArray[src],
-						sizeof(std::remove_reference_t<decltype(componentArray)>::value_type));
-					Memcpy<I + 1>(dest, src);
+				if (updatePendingRemove) {
+					bool pendingRemoveChanged = false;
+					for (auto& it : PendingRemove) {
+						if (it.Chunk == chunk) {
+							it.Chunk = clone;
+							pendingRemoveChanged = true;
+						}
+					}
+					if (pendingRemoveChanged)
+						std::sort(PendingRemove.begin(), PendingRemove.end());
 				}
-			};
 
-			static_assert(sizeof(Chunk) <= ChunkSize, "Invalid chunk size. Array alignment problem?");
-			Chunk* RootChunk;
-			std::unordered_map<EntityId, std::pair<Chunk*, uint32_t> > EntityToComponent;
-			std::unordered_map<Chunk*, std::array<EntityId, EntityCountPerChunk>> EntityIdsPerChunk;
-			std::unordered_map<EntityId, std::vector<IEvent*>> Events;
+				Chunk::Release(chunk);
+				return clone;
+			}
 
-			struct RemovingEntity {
-				EntityId Entity;
-				Chunk* Chunk;
-				uint32_t Index;
-				bool operator ==(const RemovingEntity& other) const { return Entity == other.Entity; }
-				bool operator <(const RemovingEntity& other) const {
-					return Chunk < other.Chunk ||
-						Chunk == other.Chunk && Index < other.Index;
+			template<typename KeyFn, std::size_t ... Is>
+			static auto GetSortKey(KeyFn& keyFn, const Chunk* chunk, uint32_t index, std::index_sequence<Is...>)
+			{
+				return keyFn(std::get<Is>(chunk->Components)[index]...);
+			}
+
+			// Sorts the rows of the chunks as one sequence. Replaces shared chunks in chunks.
+			// Returns false if the rows were already in order.
+			template<typename KeyFn>
+			bool SortChunks(Chunk** chunks, uint32_t chunkCount, KeyFn& keyFn)
+			{
+				using KeyType = decltype(GetSortKey(keyFn, chunks[0], 0, std::index_sequence_for<ComponentTypes...>{}));
+				// Key and position in the sequence.
+				std::vector<std::pair<KeyType, uint32_t>> keys;
+				std::vector<std::pair<Chunk*, uint32_t>> rows;
+				for (uint32_t c = 0; c < chunkCount; ++c) {
+					for (uint32_t i = 0; i < chunks[c]->Count; ++i) {
+						keys.push_back({ GetSortKey(keyFn, chunks[c], i, std::index_sequence_for<ComponentTypes...>{}), (uint32_t)rows.size() });
+						rows.push_back({ chunks[c], i });
+					}
+				}
+				std::sort(keys.begin(), keys.end());
+				bool sorted = true;
+				for (uint32_t i = 0; i < keys.size() && sorted; ++i) {
+					sorted = keys[i].second == i;
+				}
+				if (sorted)
+					return false;
+
+				std::vector<Tuple> sortedRows(keys.size());
+				std::vector<EntityId> sortedEntities(keys.size());
+				for (uint32_t i = 0; i < keys.size(); ++i) {
+					auto& src = rows[keys[i].second];
+					src.first->GetRow(src.second, sortedRows[i]);
+					sortedEntities[i] = src.first->Entities[src.second];
 				}
-			};
 
-			SortedVector<RemovingEntity> PendingRemove;
-			std::mutex Mutex;
+				// Detach first. Detaching rewrites the index entries of the chunk.
+				for (uint32_t c = 0; c < chunkCount; ++c) {
+					chunks[c] = GetWritableChunk(chunks[c]);
+				}
+				uint32_t next = 0;
+				for (uint32_t c = 0; c < chunkCount; ++c) {
+					auto chunk = chunks[c];
+					for (uint32_t i = 0; i < chunk->Count; ++i, ++next) {
+						chunk->SetRow(i, sortedRows[next]);
+						chunk->Entities[i] = sortedEntities[next];
+						EntityToComponent[sortedEntities[next]] = { chunk, i };
+					}
+				}
+				return true;
+			}
 
-		public:
-			ArchetypePool(uint64_t hash, std::vector<uint64_t>&& componentHashes)
-				: Hash(hash)
-				, ComponentHashes(componentHashes)
-			{
-				RootChunk = new Chunk;
+			void RecacheMovedEntities(Chunk* chunk, const MovedFromTo* movedEntities, uint32_t count) {
+				for (uint32_t i = 0; i < count; ++i) {
+					EntityToComponent[chunk->Entities[movedEntities[i].second]] = { chunk, movedEntities[i].second };
+				}
 			}
 
-			~ArchetypePool()
+			// Detaching modifies PendingRemove. It is remapped and sorted once for all the chunks.
+			void DetachPendingRemoveChunks()
 			{
-				if (!RootChunk)
+				auto& detached = FlushDetached;
+				detached.clear();
+				for (auto& it : PendingRemove) {
+					if (it.Chunk->IsShared() && (detached.empty() || detached.back().first != it.Chunk))
+						detached.push_back({ it.Chunk, nullptr });
+				}
+				if (detached.empty())
 					return;
-				auto next = RootChunk->Next;
-				delete RootChunk;
-				RootChunk = nullptr;
-				while (next)
-				{
-					auto p = next;
-					delete p;
-					next = next->Next;
+				for (auto& it : detached) {
+					it.second = DetachChunk(it.first, false);
+				}
+				// The rows of a chunk are contiguous and the chunks are in the order of detached.
+				std::size_t d = 0;
+				for (auto& it : PendingRemove) {
+					if (it.Chunk != detached[d].first && d + 1 < detached.size() && it.Chunk == detached[d + 1].first)
+						++d;
+					if (it.Chunk == detached[d].first)
+						it.Chunk = detached[d].second;
 				}
+				std::sort(PendingRemove.begin(), PendingRemove.end());
 			}
 
-			bool IsPoolFor(uint64_t componentHash) override
+			void RecordAdded(EntityId entity)
 			{
-				return Hash == componentHash;
+				if (Observed)
+					Added.push_back(entity);
 			}
 
-			bool IsPoolFor(ISystem* system) override
+			void SetObserved(bool observed) override
 			{
-				const uint64_t* systemComponents;
-				auto count = system->GetComponentHashes(systemComponents);
-				bool contains = true;
-				for (std::size_t i = 0; i < count; ++i) {
-					if (std::find(ComponentHashes.begin(), ComponentHashes.end(), systemComponents[i]) == ComponentHashes.end())
-						return false;
-				}
-				return true;
+				Observed = observed;
+				if (!observed)
+					Added.clear();
 			}
 
-			void RecacheMovedEntities(Chunk* chunk, std::vector<MovedFromTo>&& movedEntities) {
-				auto& entityIds = EntityIdsPerChunk[chunk];
-				for (auto& it : movedEntities) {
-					entityIds[it.second] = entityIds[it.first];
-					EntityToComponent[entityIds[it.second]] = { chunk, it.second };
-					EntityToComponent.erase(entityIds[it.first]);
-					entityIds[it.first] = 0;
+			// Calls notify(observer, entityCount, entities, components) for each observer and each contiguous run of rows.
+			// rows are sorted by chunk and row.
+			template<typename NotifyFn>
+			void NotifySpans(const std::vector<std::pair<IObserver*, std::vector<uint32_t>>>& observers,
+				const std::vector<std::pair<Chunk*, uint32_t>>& rows, NotifyFn&& notify)
+			{
+				for (auto& observer : observers) {
+					ComponentsArgLease lease(observer.second.size());
+					auto& components = lease.Get();
+					for (std::size_t begin = 0; begin < rows.size();) {
+						auto chunk = rows[begin].first;
+						auto end = begin + 1;
+						while (end < rows.size() && rows[end].first == chunk && rows[end].second == rows[end - 1].second + 1)
+							++end;
+						for (std::size_t c = 0; c < observer.second.size(); ++c) {
+							components[c] = chunk->GetComponent(observer.second[c], rows[begin].second);
+						}
+						notify(observer.first, (uint32_t)(end - begin), &chunk->Entities[rows[begin].second], components);
+						begin = end;
+					}
 				}
 			}
 
-			void /*ArchetypePool::*/Flush() override
+			uint32_t /*ArchetypePool::*/NotifyObservers(IObserver* const* observers, std::size_t observerCount) override
 			{
-				std::vector<uint32_t> indexToRemove;
-				Chunk* lastChunk = nullptr;
-				for (size_t i = 0; i < PendingRemove.size(); ++i)
-				{
-					if (lastChunk == nullptr || lastChunk == PendingRemove[i].Chunk) {
-						lastChunk = PendingRemove[i].Chunk;
-						indexToRemove.push_back(PendingRemove[i].Index);
+				if (!Observed)
+					return 0;
+
+				std::vector<std::pair<IObserver*, std::vector<uint32_t>>> matched;
+				for (std::size_t o = 0; o < observerCount; ++o) {
+					const uint64_t* hashes = nullptr;
+					auto count = observers[o]->GetComponentHashes(hashes);
+					std::vector<uint32_t> columns;
+					for (std::size_t i = 0; i < count; ++i) {
+						auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), hashes[i]);
+						if (it == ComponentHashes.end())
+							break;
+						columns.push_back((uint32_t)std::distance(ComponentHashes.begin(), it));
 					}
-					else {
-						if (!indexToRemove.empty()) {
-							RecacheMovedEntities(lastChunk, lastChunk->RemoveEntities(indexToRemove));
-							indexToRemove.clear();
-						}
-						lastChunk = PendingRemove[i].Chunk;
-						indexToRemove.push_back(PendingRemove[i].Index);
+					if (columns.size() == count)
+						matched.push_back({ observers[o], std::move(columns) });
+				}
+
+				// Observers may write the components, so the chunks are detached from snapshots.
+				std::vector<std::pair<Chunk*, uint32_t>> rows;
+				rows.reserve(Added.size());
+				for (auto entity : Added) {
+					auto it = EntityToComponent.find(entity);
+					if (it != EntityToComponent.end())
+						rows.push_back(it->second);
+				}
+				std::sort(rows.begin(), rows.end());
+				for (std::size_t i = 0; i < rows.size();) {
+					auto chunk = rows[i].first;
+					auto writable = GetWritableChunk(chunk);
+					for (; i < rows.size() && rows[i].first == chunk; ++i) {
+						rows[i].first = writable;
 					}
 				}
-				if (!indexToRemove.empty()) {
-					RecacheMovedEntities(lastChunk, lastChunk->RemoveEntities(indexToRemove));
+				NotifySpans(matched, rows, [](IObserver* observer, uint32_t count, const EntityId* entities, const ComponentsArg& components) {
+					observer->OnAdd(count, entities, components);
+				});
+				auto notifiedCount = (uint32_t)rows.size();
+				Added.clear();
+
+				DetachPendingRemoveChunks();
+				rows.clear();
+				for (auto& it : PendingRemove) {
+					MarkWritten(it.Chunk);
+					rows.push_back({ it.Chunk, it.Index });
+				}
+				NotifySpans(matched, rows, [](IObserver* observer, uint32_t count, const EntityId* entities, const ComponentsArg& components) {
+					observer->OnRemove(count, entities, components);
+				});
+				return notifiedCount + (uint32_t)rows.size();
+			}
+
+			uint32_t /*ArchetypePool::*/BeginFlush() override
+			{
+				// Detach shared chunks first.
+				DetachPendingRemoveChunks();
+				for (auto& it : PendingRemove) {
+					MarkWritten(it.Chunk);
+				}
+
+				for (auto& it : PendingRemove) {
+					EntityToComponent.erase(it.Entity);
+				}
+
+				// PendingRemove is sorted by chunk, so the rows of a chunk are contiguous.
+				FlushJobs.clear();
+				FlushIndices.resize(PendingRemove.size());
+				FlushMoved.resize(PendingRemove.size());
+				for (uint32_t i = 0; i < (uint32_t)PendingRemove.size(); ++i) {
+					FlushIndices[i] = PendingRemove[i].Index;
+					if (FlushJobs.empty() || FlushJobs.back().Chunk != PendingRemove[i].Chunk)
+						FlushJobs.push_back({ PendingRemove[i].Chunk, i, i, 0 });
+					FlushJobs.back().End = i + 1;
+				}
+				return (uint32_t)FlushJobs.size();
+			}
+
+			void /*ArchetypePool::*/FlushChunks(uint32_t begin, uint32_t end) override
+			{
+				for (auto j = begin; j < end; ++j) {
+					auto& job = FlushJobs[j];
+					job.MovedCount = job.Chunk->RemoveEntities(&FlushIndices[job.Begin], job.End - job.Begin, &FlushMoved[job.Begin]);
+				}
+			}
+
+			uint32_t /*ArchetypePool::*/EndFlush() override
+			{
+				for (auto& job : FlushJobs) {
+					RecacheMovedEntities(job.Chunk, &FlushMoved[job.Begin], job.MovedCount);
 				}
+				FlushJobs.clear();
+				auto removedCount = (uint32_t)PendingRemove.size();
 				PendingRemove.clear();
 
-				
-				/*while (!PendingRemove.empty()) {
-					auto rit = PendingRemove.rbegin();
-					int consecutiveCount = 1;
-					void* chunk;
-					uint32_t index;
-					auto has = HasEntity(*rit, chunk, index);
-					assert(has);
-					++rit;
-					for (; rit != PendingRemove.rend(); ++rit)
-					{
-						void* chunk2;
-						uint32_t index2;
-						has = HasEntity(*rit, chunk2, index2);
-						assert(has);
-						if (chunk == chunk2 && index2 + 1 == index) {
-							++consecutiveCount;
-							index = index2;
-						}
-						else {
-							break;
-						}
-					}
-					PendingRemove.erase(PendingRemove.end() - consecutiveCount, PendingRemove.end());
-					Memmove((Chunk*)chunk, index, consecutiveCount);
-				}*/
+				return removedCount;
 			}
 
-			EntityId CreateEntity() override
+			EntityId CreateEntity(EntityId entity) override
 			{
 				static_assert(EntityCountPerChunk > 50, "Entity is too big");
 				auto chunk = RootChunk;
@@ -464,10 +2590,12 @@ namespace de2
 				{
 					if (chunk->Count < EntityCountPerChunk)
 					{
-						auto entity = GenerateEntityId();
 						auto componentIndex = chunk->Count++;
 						EntityToComponent[entity] = { chunk, componentIndex };
-						EntityIdsPerChunk[chunk][componentIndex] = entity;
+						chunk->Entities[componentIndex] = entity;
+						chunk->ConstructRows(componentIndex, 1);
+						MarkWritten(chunk);
+						RecordAdded(entity);
 						return entity;
 					}
 					if (!chunk->Next)
@@ -480,12 +2608,6 @@ namespace de2
 				return INVALID_ENTITY_ID;
 			}
 			
-			EntityId /*ArchetypePool::*/AddEntity(std::tuple<ComponentTypes&&...>&& components) {
-				static_assert(EntityCountPerChunk > 50, "Entity is too big");
-				auto entity = GenerateEntityId();
-				return AddEntity(entity, std::forward<std::tuple<ComponentTypes && ...>>(components));
-			}
-
 			EntityId /*ArchetypePool::*/AddEntity(EntityId entity, std::tuple<ComponentTypes&& ...>&& components) {
 				static_assert(EntityCountPerChunk > 50, "Entity is too big");
 				auto chunk = RootChunk;
@@ -495,8 +2617,10 @@ namespace de2
 					{
 						auto componentIndex = chunk->Count++;
 						EntityToComponent[entity] = { chunk, componentIndex };
-						EntityIdsPerChunk[chunk][componentIndex] = entity;
+						chunk->Entities[componentIndex] = entity;
 						chunk->SetComponents(componentIndex, std::forward<std::tuple<ComponentTypes && ...>>(components));
+						MarkWritten(chunk);
+						RecordAdded(entity);
 						return entity;
 					}
 					if (!chunk->Next)
@@ -526,20 +2650,35 @@ namespace de2
 				if (it == ComponentHashes.end())
 					return 0;
 
-				return chunk->GetComponents((uint32_t)std::distance(ComponentHashes.begin(), it), components);
+				// Systems write through the returned array.
+				auto column = (uint32_t)std::distance(ComponentHashes.begin(), it);
+				chunk = GetWritableChunk(chunk, column);
+				return chunk->GetComponents(column, components);
 			}
 
 			void* GetComponent(EntityId entity, uint64_t componentHash) override
 			{
 				void* chunk;
 				uint32_t index;
-				if (HasEntity(entity, chunk, index))
+				auto column = FindColumn(componentHash);
+				if (column >= 0 && HasEntity(entity, chunk, index))
 				{
-					return GetComponent(chunk, index, componentHash);
+					// The returned pointer is writable.
+					return GetWritableChunk((Chunk*)chunk, (uint32_t)column)->GetComponent((uint32_t)column, index);
 				}
 				return nullptr;
 			}
 
+			const void* ReadComponent(EntityId entity, uint64_t componentHash) override
+			{
+				void* chunk;
+				uint32_t index;
+				auto column = FindColumn(componentHash);
+				if (column >= 0 && HasEntity(entity, chunk, index))
+					return ((Chunk*)chunk)->GetComponent((uint32_t)column, index);
+				return nullptr;
+			}
+
 			void* GetComponent(void* chunk, uint32_t index, uint64_t componentHash)
 			{
 				auto it = std::find(ComponentHashes.begin(), ComponentHashes.end(), componentHash);
@@ -559,9 +2698,10 @@ namespace de2
 			{
 				void* chunk;
 				uint32_t index;
-				if (HasEntity(entity, chunk, index))
+				auto column = FindColumn(componentHash);
+				if (column >= 0 && HasEntity(entity, chunk, index))
 				{
-					return SetComponent(chunk, index, componentHash, comp);
+					return GetWritableChunk((Chunk*)chunk, (uint32_t)column)->SetComponent((uint32_t)column, index, comp);
 				}
 				return nullptr;
 			}
@@ -587,66 +2727,6 @@ namespace de2
 				return false;
 			}
 
-			template<std::size_t I>
-			void MemmoveRecursive(Chunk* chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{
-				assert(consecutiveCount >= 1);
-				auto numNeedToMove = (chunk->Count - (removingIndex + consecutiveCount));
-				if (chunk->Count == EntityCountPerChunk) {
-					if (numNeedToMove) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						memmove(&componentArray[removingIndex],
-							&componentArray[removingIndex + consecutiveCount],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numNeedToMove);
-					}
-					if (chunk->Next && chunk->Next->Count > 0) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						auto nextChunk = chunk->Next;
-						auto& nextComponentArray = std::get<I>(nextChunk->Components);
-						auto numCopyFromNextChunk = std::min(consecutiveCount, nextChunk->Count);
-						memcpy(&componentArray[EntityCountPerChunk - consecutiveCount],
-							&nextComponentArray[0],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numCopyFromNextChunk);
-						MemmoveRecursive<I>(nextChunk, 0, numCopyFromNextChunk);
-					}
-					else
-					{
-						if constexpr (I == sizeof...(ComponentTypes) - 1) {
-							assert(chunk->Count >= consecutiveCount);
-							chunk->Count -= consecutiveCount;
-						}
-					}
-				}
-				else {
-					if (numNeedToMove) {
-						auto& componentArray = std::get<I>(chunk->Components);
-						memmove(&componentArray[removingIndex],
-							&componentArray[removingIndex + consecutiveCount],
-							sizeof(std::remove_reference_t<decltype(componentArray)>::value_type) * numNeedToMove);
-					}
-					if constexpr (I == sizeof...(ComponentTypes) - 1)
-					{
-						assert(chunk->Count >= consecutiveCount);
-						chunk->Count -= consecutiveCount;
-						if (chunk->Next) {
-							chunk->DeleteChunkHierarchy();
-						}
-					}
-				}
-			}
-
-			template<std::size_t I>
-			std::enable_if_t<I == sizeof...(ComponentTypes)> Memmove(Chunk * chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{
-			}
-
-			template<std::size_t I = 0>
-			std::enable_if_t < I < sizeof...(ComponentTypes)> Memmove(Chunk * chunk, uint32_t removingIndex, uint32_t consecutiveCount)
-			{
-				MemmoveRecursive<I>(chunk, removingIndex, consecutiveCount);
-				Memmove<I + 1>(chunk, removingIndex, consecutiveCount);
-			}
-
 			bool RemoveEntity(EntityId entity) override
 			{
 				void* chunk;
@@ -662,56 +2742,227 @@ namespace de2
 
 			void PushEvent(EntityId entId, IEvent* evt) override
 			{
-				Events[entId].push_back(evt);
+				Events.push_back({ entId, evt });
+			}
+
+			uint32_t RunEvents() override
+			{
+				uint32_t eventCount = 0;
+				// By index. Events pushed by an event run in the same call.
+				for (std::size_t e = 0; e < Events.size(); ++e) {
+					auto it = Events[e];
+					void* chunk;
+					uint32_t index;
+					if (HasEntity(it.first, chunk, index)) {
+						chunk = GetUnsharedChunk((Chunk*)chunk);
+						const uint64_t* componentHashes = nullptr;
+						auto count = it.second->GetComponentHashes(componentHashes);
+						ComponentsArgLease lease(count);
+						auto& components = lease.Get();
+						for (size_t i = 0; i < count; ++i)
+						{
+							auto column = FindColumn(componentHashes[i]);
+							assert(column >= 0);
+							MarkWritten((Chunk*)chunk, (uint32_t)column);
+							components[i] = ((Chunk*)chunk)->GetComponent((uint32_t)column, index);
+						}
+						it.second->Execute(components);
+						++eventCount;
+					}
+					delete it.second;
+				}
+				Events.clear();
+				return eventCount;
+			}
+		};
+
+		template<std::size_t I = 0, typename ... ComponentTypes>
+		void ComponentsHash(uint64_t & hash)
+		{
+			hash_combine(hash, typeid(std::tuple_element_t<I, std::tuple<ComponentTypes...>>).hash_code());
+			if constexpr (I + 1 < sizeof...(ComponentTypes)) {
+				ComponentsHash<I + 1, ComponentTypes...>(hash);
 			}
+		}
+	}
+
+	//
+	// ColumnExport
+	//
+	// Read only component arrays of a WorldSnapshot. See WorldSnapshot::ExportColumns().
+	struct ColumnExport
+	{
+		struct Chunk
+		{
+			uint32_t PoolIndex;
+			uint32_t Count;
+			const EntityId* Entities;
+		};
+
+		// One per requested component, in request order.
+		std::vector<ColumnLayout> Layouts;
+		std::vector<Chunk> Chunks;
+		// Array of component c in chunk i is Columns[i * Layouts.size() + c], Chunks[i].Count rows.
+		std::vector<const void*> Columns;
+		uint32_t EntityCount = 0;
+
+		const void* GetColumn(std::size_t chunkIndex, std::size_t component) const
+		{
+			return Columns[chunkIndex * Layouts.size() + component];
+		}
+
+		template<typename ComponentType>
+		const ComponentType* GetColumn(std::size_t chunkIndex, std::size_t component) const
+		{
+			assert(Layouts[component].TypeHash == typeid(ComponentType).hash_code());
+			return (const ComponentType*)GetColumn(chunkIndex, component);
+		}
+	};
+
+	//
+	// WorldSnapshot
+	//
+	// Immutable view of the chunks at the time of DOECS::Snapshot().
+	// Chunks are shared with the DOECS and copied only when the DOECS writes to them,
+	// so it can be read from another thread while the DOECS runs the next frame.
+	class WorldSnapshot
+	{
+		std::vector<impl::IPoolSnapshot*> Pools;
+
+	public:
+		WorldSnapshot() = default;
+		WorldSnapshot(std::vector<impl::IPoolSnapshot*>&& pools)
+			: Pools(std::move(pools))
+		{}
+		WorldSnapshot(WorldSnapshot&& other) noexcept
+			: Pools(std::move(other.Pools))
+		{
+			other.Pools.clear();
+		}
+		WorldSnapshot(const WorldSnapshot&) = delete;
+		WorldSnapshot& operator=(const WorldSnapshot&) = delete;
+		WorldSnapshot& operator=(WorldSnapshot&& other) noexcept;
+		~WorldSnapshot();
+
+		std::size_t GetPoolCount() const
+		{
+			return Pools.size();
+		}
+
+		uint32_t GetChunkCount(std::size_t poolIndex) const
+		{
+			return Pools[poolIndex]->GetChunkCount();
+		}
+
+		uint32_t GetComponents(std::size_t poolIndex, uint32_t chunkIndex, uint64_t hash, const void*& components) const
+		{
+			return Pools[poolIndex]->GetComponents(chunkIndex, hash, components);
+		}
+
+		uint32_t GetEntities(std::size_t poolIndex, uint32_t chunkIndex, const EntityId*& entities) const
+		{
+			return Pools[poolIndex]->GetEntities(chunkIndex, entities);
+		}
+
+		// The system must not write to the components.
+		void RunSystem(ISystem* system) const;
+
+		// Points exp at the arrays of the components of every chunk of the pools which have all of them. Nothing is copied.
+		// The arrays are valid while the snapshot lives. Returns false if no entity has all of them.
+		bool ExportColumns(const uint64_t* hashes, std::size_t hashCount, ColumnExport& exp) const;
 
-			void RunEvents() override
-			{
-				for (auto& it : Events) {
-					void* chunk;
-					uint32_t index;
-					if (HasEntity(it.first, chunk, index)){
-						for (auto& evt : it.second) {
-							const uint64_t* componentHashes = nullptr;
-							auto count = evt->GetComponentHashes(componentHashes);
-							ComponentsArg components;
-							for (size_t i = 0; i < count; ++i)
-							{
-								auto pComponent = GetComponent(chunk, index, componentHashes[i]);
-								assert(pComponent);
-								components.push_back(pComponent);
-							}
-							evt->Execute(components);
-							delete evt;
-						}
-					}
-					else {
-						for (auto& evt : it.second) {
-							delete evt;
-						}
-					}
-				}
-				Events.clear();
-			}
-		};
+		template<typename ... ComponentTypes>
+		bool ExportColumns(ColumnExport& exp) const
+		{
+			const uint64_t hashes[] = { typeid(ComponentTypes).hash_code()... };
+			return ExportColumns(hashes, sizeof...(ComponentTypes), exp);
+		}
+	};
 
-		template<std::size_t I = 0, typename ... ComponentTypes>
-		void ComponentsHash(uint64_t & hash)
+	//
+	// FrameHandle
+	//
+	// Frame started by DOECS::RunSystemsAsync(). Waits in the destructor.
+	class FrameHandle
+	{
+		friend class DOECS;
+		DOECS* Ecs = nullptr;
+
+	public:
+		FrameHandle() = default;
+		FrameHandle(FrameHandle&& other) noexcept
+			: Ecs(other.Ecs)
 		{
-			hash_combine(hash, typeid(std::tuple_element_t<I, std::tuple<ComponentTypes...>>).hash_code());
-			if constexpr (I + 1 < sizeof...(ComponentTypes)) {
-				ComponentsHash<I + 1, ComponentTypes...>(hash);
-			}
+			other.Ecs = nullptr;
 		}
-	}
+		FrameHandle(const FrameHandle&) = delete;
+		FrameHandle& operator=(const FrameHandle&) = delete;
+		FrameHandle& operator=(FrameHandle&& other) noexcept;
+		~FrameHandle();
+
+		bool IsReady() const;
+		// Blocks until the frame is done. The DOECS can be used again after this.
+		void Wait();
+	};
 
 	class DOECS
 	{
+		friend class FrameHandle;
 		using PoolContainer = std::unordered_map<uint64_t, impl::IArchetypePool*>;
 		PoolContainer Pools;
-		std::unordered_map<EntityId, uint64_t> EntityPoolMap;
+		impl::EntityMap<uint64_t> EntityPoolMap;
 		std::vector<ISystem*> Systems;
+		std::vector<IObserver*> Observers;
 		std::unordered_map<ISystem*, std::vector<ISystem*>> SystemDependencies;
+		std::vector<EntityId> PendingRemove;
+		std::mutex PendingRemoveMutex;
+		// Sparse set of each sparse component, keyed by the component hash.
+		std::unordered_map<uint64_t, impl::ISparseSet*> SparseSets;
+
+		// Pools matched by a system and the column of each required and optional component.
+		// Built on the first run. Cleared when a pool is added.
+		struct SystemQuery
+		{
+			// Required, excluded and optional hashes the query was built from.
+			// A different system at the same address rebuilds it.
+			const uint64_t* Hashes[3] = {};
+			std::size_t HashCounts[3] = {};
+			using Match = std::pair<impl::IArchetypePool*, std::vector<int32_t>>;
+			// Sorted by pool address.
+			std::vector<Match> Pools;
+		};
+		// Shared, so a run keeps its query while another thread rebuilds or erases the entry.
+		std::unordered_map<ISystem*, std::shared_ptr<const SystemQuery>> SystemQueries;
+		std::mutex SystemQueriesMutex;
+
+		// Progress of the systems with an ExecutionPolicy. Guarded by SystemQueriesMutex.
+		struct SystemCursor
+		{
+			uint64_t RunCount = 0;
+			// Pool and chunk index in that pool to resume at. nullptr starts a new pass.
+			// SystemQuery::Pools is sorted by pool address, so the pool is found again after the query is rebuilt.
+			impl::IArchetypePool* Pool = nullptr;
+			uint32_t Chunk = 0;
+		};
+		std::unordered_map<ISystem*, SystemCursor> SystemCursors;
+
+		// Ids reserved by ReserveEntityIds(). Empty by default.
+		std::atomic<EntityId> NextEntityId = 0;
+		EntityId EndEntityId = 0;
+
+		// Image opened by OpenImage(). Unmapped after the pools are deleted.
+		impl::MappedFile Image;
+
+		// Frame started by RunSystemsAsync() until FrameHandle::Wait(). The untouched pools are flushed while the systems run,
+		// so removals and events for them are queued in DeferredOps (nullptr event for a removal) and applied at Wait().
+		std::atomic<bool> AsyncFrame = false;
+		impl::TaskGroup AsyncFrameTasks;
+		std::vector<impl::IArchetypePool*> TouchedPools;
+		std::vector<impl::IArchetypePool*> UntouchedPools;
+		std::vector<std::pair<EntityId, IEvent*>> DeferredOps;
+		std::mutex DeferredOpsMutex;
+		// Observers are called from one thread at a time.
+		std::mutex ObserversMutex;
 	public:
 
 		~DOECS();
@@ -719,9 +2970,104 @@ namespace de2
 		template<typename ... ComponentTypes>
 		PoolContainer::iterator AddPool()
 		{
+			static_assert(!(IsSparseComponent<ComponentTypes>::value || ...), "Sparse components are added with AddComponent().");
 			uint64_t hash = 0;
 			impl::ComponentsHash<0, ComponentTypes...>(hash);
-			return Pools.insert({ hash, new impl::ArchetypePool<ComponentTypes...>(hash, { typeid(ComponentTypes).hash_code()... }) }).first;
+			auto it = Pools.find(hash);
+			if (it != Pools.end())
+				return it;
+			ClearSystemQueries();
+			it = Pools.insert({ hash, new impl::ArchetypePool<ComponentTypes...>(hash, { typeid(ComponentTypes).hash_code()... }) }).first;
+			UpdateObserved(it->second);
+			return it;
+		}
+
+		// Entities created by this DOECS take their ids from a block of count ids reserved in the global generator,
+		// then from the global generator once the block is used up.
+		// e.g. a level built on a loader thread and merged into the main world with MergeInto().
+		void ReserveEntityIds(EntityId count)
+		{
+			auto first = impl::ReserveEntityIds(count);
+			EndEntityId = first + count;
+			NextEntityId.store(first);
+		}
+
+		EntityId GenerateEntityId()
+		{
+			if (NextEntityId.load(std::memory_order_relaxed) < EndEntityId) {
+				auto entity = NextEntityId.fetch_add(1, std::memory_order_relaxed);
+				if (entity < EndEntityId)
+					return entity;
+			}
+			return impl::GenerateEntityId();
+		}
+
+		// Returns the first of count consecutive ids.
+		EntityId GenerateEntityIds(EntityId count)
+		{
+			if (NextEntityId.load(std::memory_order_relaxed) + count <= EndEntityId) {
+				auto first = NextEntityId.fetch_add(count, std::memory_order_relaxed);
+				if (first + count <= EndEntityId)
+					return first;
+			}
+			return impl::ReserveEntityIds(count);
+		}
+
+		// Registers a fully initialized row to copy with Instantiate(). The pool is created if needed.
+		template<typename ... ComponentTypes>
+		Prefab CreatePrefab(ComponentTypes&& ... components)
+		{
+			auto it = AddPool<std::decay_t<ComponentTypes>...>();
+			auto pool = (impl::ArchetypePool<std::decay_t<ComponentTypes>...>*)(it->second);
+			return { it->first, pool->AddPrefab(std::make_tuple(std::forward<ComponentTypes>(components)...)) };
+		}
+
+		// Adds count copies of the prefab. Whole runs of rows are filled per component array.
+		// The new entities have the ids [returned id, returned id + count). Returns INVALID_ENTITY_ID for an invalid prefab.
+		EntityId Instantiate(const Prefab& prefab, uint32_t count)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "Instantiate", "Phase");
+			DOECS_PROFILE_ADD(profileScope, "entities", count);
+			auto it = Pools.find(prefab.PoolHash);
+			if (it == Pools.end() || count == 0)
+				return INVALID_ENTITY_ID;
+			auto firstEntity = GenerateEntityIds(count);
+			if (it->second->Instantiate(prefab.Index, firstEntity, count) != count)
+				return INVALID_ENTITY_ID;
+			EntityPoolMap.reserve(EntityPoolMap.size() + count);
+			for (uint32_t i = 0; i < count; ++i) {
+				EntityPoolMap[firstEntity + i] = prefab.PoolHash;
+			}
+			return firstEntity;
+		}
+
+		// Moves every entity of this DOECS into main by linking whole chunks into main's pools. No row is copied.
+		// Pools main does not have are created. Pending removals are flushed first. Systems are not moved.
+		// Call on the thread which runs main, after the thread which built this DOECS is done with it.
+		void MergeInto(DOECS& main)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "MergeInto", "Phase");
+			Flush();
+			for (auto& pool : Pools) {
+				auto it = main.Pools.find(pool.first);
+				if (it == main.Pools.end()) {
+					main.ClearSystemQueries();
+					it = main.Pools.insert({ pool.first, pool.second->CreateEmpty() }).first;
+					main.UpdateObserved(it->second);
+				}
+				[[maybe_unused]] auto chunkCount = it->second->Splice(pool.second);
+				DOECS_PROFILE_ADD(profileScope, "chunks", chunkCount);
+			}
+			DOECS_PROFILE_ADD(profileScope, "entities", EntityPoolMap.size());
+			main.EntityPoolMap.reserve(main.EntityPoolMap.size() + EntityPoolMap.size());
+			main.EntityPoolMap.insert(EntityPoolMap.begin(), EntityPoolMap.end());
+			EntityPoolMap.clear();
+			for (auto& set : SparseSets) {
+				auto it = main.SparseSets.find(set.first);
+				if (it == main.SparseSets.end())
+					it = main.SparseSets.insert({ set.first, set.second->CreateEmpty() }).first;
+				set.second->MoveInto(it->second);
+			}
 		}
 
 		void AddSystem(ISystem* system)
@@ -732,6 +3078,33 @@ namespace de2
 		void RemoveSystem(ISystem* system)
 		{
 			Systems.erase(std::remove(Systems.begin(), Systems.end(), system), Systems.end());
+			std::lock_guard l(SystemQueriesMutex);
+			SystemQueries.erase(system);
+			SystemCursors.erase(system);
+		}
+
+		// The observer is notified at every Flush() until it is removed.
+		void AddObserver(IObserver* observer)
+		{
+			Observers.push_back(observer);
+			for (auto& pool : Pools) {
+				UpdateObserved(pool.second);
+			}
+		}
+
+		void RemoveObserver(IObserver* observer)
+		{
+			Observers.erase(std::remove(Observers.begin(), Observers.end(), observer), Observers.end());
+			for (auto& pool : Pools) {
+				UpdateObserved(pool.second);
+			}
+		}
+
+		// Call when a system changes its component hashes, or before deleting a system which was run but not added.
+		void ClearSystemQueries()
+		{
+			std::lock_guard l(SystemQueriesMutex);
+			SystemQueries.clear();
 		}
 
 		template<typename ... ComponentTypes>
@@ -756,7 +3129,7 @@ namespace de2
 			if (!pool)
 				return INVALID_ENTITY_ID;
 
-			auto entity = pool->CreateEntity();
+			auto entity = pool->CreateEntity(GenerateEntityId());
 			if (entity != INVALID_ENTITY_ID) {
 				EntityPoolMap[entity] = poolHash;
 			}
@@ -772,7 +3145,7 @@ namespace de2
 				return INVALID_ENTITY_ID;
 			}
 			auto pool = (impl::ArchetypePool<ComponentTypes...>*)(it->second);
-			auto entity = pool->AddEntity(std::forward_as_tuple<ComponentTypes...>(std::forward<ComponentTypes>(components)...));
+			auto entity = pool->AddEntity(GenerateEntityId(), std::forward_as_tuple<ComponentTypes...>(std::forward<ComponentTypes>(components)...));
 			EntityPoolMap[entity] = poolHash;
 			return entity;
 		}
@@ -795,64 +3168,207 @@ namespace de2
 			auto pool = GetPoolForEntity(entity);
 			if (!pool)
 				return false;
-			return pool->RemoveEntity(entity);
+			if (DeferForAsyncFrame(pool, entity, nullptr))
+				return true;
+			if (!pool->RemoveEntity(entity))
+				return false;
+			std::lock_guard l(PendingRemoveMutex);
+			PendingRemove.push_back(entity);
+			return true;
 		}
 
 			template<typename ComponentType>
 			ComponentType* GetComponent(EntityId entity)
 			{
+				if constexpr (IsSparseComponent<ComponentType>::value) {
+					auto set = GetSparseSet<ComponentType>(false);
+					return set ? set->Find(entity) : nullptr;
+				}
 				auto pool = GetPoolForEntity(entity);
 				if (!pool)
 					return nullptr;
 				return (ComponentType*)pool->GetComponent(entity, typeid(ComponentType).hash_code());
 			}
 
+			// Like GetComponent() but the chunk is neither unshared nor marked written, so change tracking doesn't see it.
+			template<typename ComponentType>
+			const ComponentType* ReadComponent(EntityId entity)
+			{
+				if constexpr (IsSparseComponent<ComponentType>::value) {
+					auto set = GetSparseSet<ComponentType>(false);
+					return set ? set->Find(entity) : nullptr;
+				}
+				auto pool = GetPoolForEntity(entity);
+				if (!pool)
+					return nullptr;
+				return (const ComponentType*)pool->ReadComponent(entity, typeid(ComponentType).hash_code());
+			}
+
+		// Adds or overwrites the sparse component of the entity. Returns nullptr if the entity doesn't exist.
+		// The pointer is valid until the next AddComponent() or RemoveComponent() of the same component.
+		template<typename ComponentType>
+		std::decay_t<ComponentType>* AddComponent(EntityId entity, ComponentType&& comp)
+		{
+			static_assert(IsSparseComponent<std::decay_t<ComponentType>>::value, "Only sparse components are added to existing entities.");
+			if (EntityPoolMap.find(entity) == EntityPoolMap.end())
+				return nullptr;
+			return GetSparseSet<std::decay_t<ComponentType>>(true)->Set(entity, std::forward<ComponentType>(comp));
+		}
+
+		// Returns false if the entity doesn't have the sparse component.
+		template<typename ComponentType>
+		bool RemoveComponent(EntityId entity)
+		{
+			static_assert(IsSparseComponent<ComponentType>::value, "Only sparse components are removed from existing entities.");
+			auto set = GetSparseSet<ComponentType>(false);
+			return set && set->Remove(entity);
+		}
+
 		template<typename ComponentType>
 		ComponentType* SetComponent(EntityId entity, ComponentType&& comp)
 		{
+			if constexpr (IsSparseComponent<ComponentType>::value) {
+				auto existing = GetComponent<ComponentType>(entity);
+				if (existing)
+					*existing = std::move(comp);
+				return existing;
+			}
 			auto pool = GetPoolForEntity(entity);
 			if (!pool)
 				return nullptr;
 			return (ComponentType*)pool->SetComponent(entity, typeid(ComponentType).hash_code(), &comp);
 		}
 
+		// Copies the component of entities[i] to values[i] for every entity.
+		// The entities are grouped by pool and the index lookups and copies are prefetched ahead,
+		// so it is faster than GetComponent() per entity for large batches.
+		// values[i] is left unchanged for the entities without the component. Returns the number of components copied.
+		// The components are copy assigned (memcpy when trivially copyable), so values must point at count constructed
+		// objects, e.g. a std::vector<ComponentType> of size count, not reserved or raw memory.
+		template<typename ComponentType>
+		uint32_t Gather(const EntityId* entities, std::size_t count, ComponentType* values)
+		{
+			static_assert(!IsSparseComponent<ComponentType>::value, "Sparse components are not in the pools.");
+			uint32_t copied = 0;
+			ForEachBatch(entities, count, [&](impl::IArchetypePool* pool, const impl::BatchRequest* requests, uint32_t requestCount) {
+				copied += pool->Gather(typeid(ComponentType).hash_code(), requests, requestCount, values, sizeof(ComponentType));
+			});
+			return copied;
+		}
+
+		// Copies values[i] to the component of entities[i] by copy assignment. Returns the number of components written.
+		// If an entity is given more than once, its last value is written.
+		template<typename ComponentType>
+		uint32_t Scatter(const EntityId* entities, std::size_t count, const ComponentType* values)
+		{
+			static_assert(!IsSparseComponent<ComponentType>::value, "Sparse components are not in the pools.");
+			uint32_t copied = 0;
+			ForEachBatch(entities, count, [&](impl::IArchetypePool* pool, const impl::BatchRequest* requests, uint32_t requestCount) {
+				copied += pool->Scatter(typeid(ComponentType).hash_code(), requests, requestCount, values, sizeof(ComponentType));
+			});
+			return copied;
+		}
+
+		// Sets the component to value on every entity which has it and all of QueryTypes.
+		// Fills one column of a chunk at a time without touching the other columns,
+		// so trivially copyable components are written with vectorized stores.
+		// e.g. ecs.Fill<FWeaponComponent, FPlayerComponent>(FWeaponComponent{}); Returns the number of components written.
+		template<typename ComponentType, typename ... QueryTypes>
+		uint32_t Fill(const ComponentType& value)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "Fill", "System");
+			auto writtenCount = ForEachColumn<ComponentType, QueryTypes...>([&value](ComponentType* components, uint32_t count) {
+				std::fill_n(components, count, value);
+			});
+			DOECS_PROFILE_ADD(profileScope, "entities", writtenCount);
+			return writtenCount;
+		}
+
+		// Replaces the component with fn(const ComponentType&) on every entity which has it and all of QueryTypes,
+		// one column of a chunk at a time like Fill(). Returns the number of components written.
+		template<typename ComponentType, typename ... QueryTypes, typename Fn>
+		uint32_t Transform(Fn&& fn)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "Transform", "System");
+			auto writtenCount = ForEachColumn<ComponentType, QueryTypes...>([&fn](ComponentType* components, uint32_t count) {
+				const ComponentType* source = components;
+				for (uint32_t i = 0; i < count; ++i) {
+					components[i] = fn(source[i]);
+				}
+			});
+			DOECS_PROFILE_ADD(profileScope, "entities", writtenCount);
+			return writtenCount;
+		}
+
+		// Calls fn(entity, ComponentTypes&...) for every entity which has all the components, sparse or not.
+		// Systems only see the archetype components. Use ForEach() for queries with sparse components.
+		// Iterates the smaller side: the entities of the smallest sparse set, looking up the other components,
+		// or the chunks of the pools with the archetype components, looking up the sparse components.
+		// Don't add or remove entities or sparse components in fn. Returns the number of entities visited.
+		template<typename ... ComponentTypes, typename Fn>
+		uint32_t ForEach(Fn&& fn)
+		{
+			static_assert(sizeof...(ComponentTypes) > 0, "ForEach() needs a component.");
+			DOECS_PROFILE_SCOPE(profileScope, "ForEach", "System");
+			auto visitedCount = ForEachImpl<ComponentTypes...>(fn, std::index_sequence_for<ComponentTypes...>{});
+			DOECS_PROFILE_ADD(profileScope, "entities", visitedCount);
+			return visitedCount;
+		}
+
+		// Runs the system on the matching pools within the limits of its ExecutionPolicy.
 		void RunSystem(ISystem* system)
 		{
-			const uint64_t* componentHashes = nullptr;
-			std::size_t componentCount = system->GetComponentHashes(componentHashes);
-			for (auto& pool : Pools)
-			{
-				if (pool.second->IsPoolFor(system))
-				{
-					int chunkIndex = 0;
-					bool checkNextChunk = true;
-					// loop over chunks;
-					while (checkNextChunk) {
-						ComponentsArg requiredComponents;
-						// loop over required components;
-						uint32_t count = 0;
-						for (uint32_t c = 0; c < componentCount; ++c) {
-							void* components = nullptr;
-							uint32_t count_ = pool.second->GetComponents(chunkIndex, componentHashes[c], components);
-
-							if (count_ == 0 || components == nullptr) {
-								checkNextChunk = false;
-								break;
-							}
-							assert(count == 0 || count == count_);
-							count = count_;
-							requiredComponents.push_back(components);
-						}
-						if (count > 0 && componentCount == requiredComponents.size())
-							system->Execute(count, requiredComponents);
-						++chunkIndex;
-					}
+			DOECS_PROFILE_SCOPE(profileScope, system->GetName(), "System");
+			auto policy = system->GetExecutionPolicy();
+			auto query = GetSystemQuery(system);
+			impl::SystemSlice slice;
+			if (policy.Interval <= 1 && policy.Slices <= 1 && policy.BudgetMicroseconds == 0) {
+				for (auto& match : query->Pools) {
+					match.first->RunSystem(system, match.second, slice);
+				}
+				DOECS_PROFILE_ADD(profileScope, "chunks", slice.ChunkCount);
+				DOECS_PROFILE_ADD(profileScope, "entities", slice.EntityCount);
+				return;
+			}
+
+			auto cursor = GetSystemCursor(system);
+			if (policy.Interval > 1 && cursor.RunCount++ % policy.Interval != 0) {
+				SetSystemCursor(system, cursor);
+				return;
+			}
+			if (policy.Slices > 1) {
+				uint32_t chunkCount = 0;
+				for (auto& match : query->Pools) {
+					chunkCount += match.first->GetChunkCount();
 				}
+				slice.ChunkBudget = std::max(1u, (chunkCount + policy.Slices - 1) / policy.Slices);
 			}
+			if (policy.BudgetMicroseconds > 0)
+				slice.Deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(policy.BudgetMicroseconds);
+
+			// The saved pool, or the next one if the system doesn't match it anymore.
+			auto it = std::lower_bound(query->Pools.begin(), query->Pools.end(), cursor.Pool, [](const SystemQuery::Match& match, impl::IArchetypePool* pool) {
+				return std::less<impl::IArchetypePool*>()(match.first, pool);
+			});
+			if (it == query->Pools.end() || it->first != cursor.Pool)
+				cursor.Chunk = 0;
+			for (; it != query->Pools.end(); ++it, cursor.Chunk = 0) {
+				slice.Cursor = cursor.Chunk;
+				if (!it->first->RunSystem(system, it->second, slice)) {
+					cursor.Chunk = slice.Cursor;
+					break;
+				}
+			}
+			// The pass is over. The next run starts from the first pool.
+			cursor.Pool = it == query->Pools.end() ? nullptr : it->first;
+			SetSystemCursor(system, cursor);
+			DOECS_PROFILE_ADD(profileScope, "chunks", slice.ChunkCount);
+			DOECS_PROFILE_ADD(profileScope, "entities", slice.EntityCount);
 		}
 
 		void RunSystems()
 		{
+			DOECS_PROFILE_SCOPE(profileScope, "RunSystems", "Phase");
 			for (auto system : Systems) {
 				system->Done = false;
 			}
@@ -867,25 +3383,492 @@ namespace de2
 			impl::IArchetypePool* pool = GetPoolForEntity(entId);
 			if (!pool)
 				return false;
+			if (DeferForAsyncFrame(pool, entId, evt))
+				return true;
 			pool->PushEvent(entId, evt);
 			return true;
 		}
 
 		void RunEvents()
 		{
+			DOECS_PROFILE_SCOPE(profileScope, "RunEvents", "Phase");
+			for (auto& pool : Pools) {
+				[[maybe_unused]] auto eventCount = RunPoolEvents(pool.second);
+				DOECS_PROFILE_ADD(profileScope, "events", eventCount);
+			}
+		}
+
+		// Removes the entities pending removal.
+		// With threadCount > 1, large removals run on up to threadCount threads: the pools erase and re-index
+		// their entities in parallel and the chunks of every pool are compacted as independent jobs.
+		// Observers are notified on the calling thread. What they allocate in its frame arena is released when Flush() returns.
+		void Flush(uint32_t threadCount = 1)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "Flush", "Phase");
+			FrameArenaScope arenaScope;
+			if (threadCount <= 1 || PendingRemove.size() < impl::MinParallelFlushCount) {
+				for (auto& pool : Pools) {
+					[[maybe_unused]] auto removedCount = FlushPool(pool.second);
+					DOECS_PROFILE_ADD(profileScope, "removed", removedCount);
+				}
+				ErasePendingRemove();
+				return;
+			}
+
+			FrameVector<impl::IArchetypePool*> pools;
+			for (auto& pool : Pools) {
+				if (!Observers.empty())
+					NotifyObservers(pool.second);
+				pools.push_back(pool.second);
+			}
+			FrameVector<uint32_t> jobCounts(pools.size());
+			impl::ParallelFor(threadCount, pools.size(), [&pools, &jobCounts](std::size_t begin, std::size_t end) {
+				for (auto p = begin; p < end; ++p) {
+					jobCounts[p] = pools[p]->BeginFlush();
+				}
+			});
+			// Every chunk with removed rows is one job, whatever its pool.
+			FrameVector<std::pair<impl::IArchetypePool*, uint32_t>> jobs;
+			for (std::size_t p = 0; p < pools.size(); ++p) {
+				for (uint32_t j = 0; j < jobCounts[p]; ++j) {
+					jobs.push_back({ pools[p], j });
+				}
+			}
+			impl::ParallelFor(threadCount, jobs.size(), [&jobs](std::size_t begin, std::size_t end) {
+				for (auto j = begin; j < end; ++j) {
+					jobs[j].first->FlushChunks(jobs[j].second, jobs[j].second + 1);
+				}
+			});
+			std::atomic<uint32_t> removedCount = 0;
+			impl::ParallelFor(threadCount, pools.size(), [&pools, &removedCount](std::size_t begin, std::size_t end) {
+				for (auto p = begin; p < end; ++p) {
+					removedCount += pools[p]->EndFlush();
+				}
+			});
+			DOECS_PROFILE_ADD(profileScope, "removed", removedCount.load());
+			DOECS_PROFILE_ADD(profileScope, "jobs", jobs.size());
+			ErasePendingRemove(threadCount);
+		}
+
+		// Resets the frame arena of the calling thread, releasing what systems and events allocated in it this frame.
+		// Call once per frame on the thread which runs RunSystems(), RunEvents() and Flush(), when nothing allocated
+		// in its arena is used anymore. With several DOECS on that thread, call it once after all of them.
+		void EndFrame()
+		{
+			GetFrameArena().Reset();
+		}
+
+		// RunSystems(), RunEvents() and Flush() on the workers.
+		// Pools which no added system matches run their events and removals on one worker while another runs the systems,
+		// then the events and removals of the pools the systems touched.
+		// The workers and their frame arenas live across frames, so steady async frames don't allocate either.
+		// RemoveEntity() and PushEvent() called by the systems for the entities of the untouched pools are queued
+		// and applied by FrameHandle::Wait(). Systems must not otherwise access the entities of those pools.
+		// Don't use the DOECS until the returned handle is waited.
+		FrameHandle RunSystemsAsync()
+		{
+			TouchedPools.clear();
+			for (auto system : Systems) {
+				for (auto& match : GetSystemQuery(system)->Pools) {
+					if (std::find(TouchedPools.begin(), TouchedPools.end(), match.first) == TouchedPools.end())
+						TouchedPools.push_back(match.first);
+				}
+			}
+			UntouchedPools.clear();
+			for (auto& pool : Pools) {
+				if (std::find(TouchedPools.begin(), TouchedPools.end(), pool.second) == TouchedPools.end())
+					UntouchedPools.push_back(pool.second);
+			}
+			AsyncFrame.store(true, std::memory_order_release);
+
+			impl::ReserveWorkers(2);
+			impl::SubmitTask(AsyncFrameTasks, [](void* context, std::size_t, std::size_t) {
+				auto ecs = (DOECS*)context;
+				ecs->FlushPools(ecs->UntouchedPools);
+			}, this, 0, 0);
+			impl::SubmitTask(AsyncFrameTasks, [](void* context, std::size_t, std::size_t) {
+				auto ecs = (DOECS*)context;
+				ecs->RunSystems();
+				ecs->FlushPools(ecs->TouchedPools);
+			}, this, 0, 0);
+			FrameHandle frame;
+			frame.Ecs = this;
+			return frame;
+		}
+
+		void GetPoolStats(std::vector<PoolStats>& stats)
+		{
+			stats.resize(Pools.size());
+			std::size_t i = 0;
+			for (auto& pool : Pools) {
+				pool.second->GetStats(stats[i++]);
+			}
+		}
+
+		// Compacts sparse pools within the time budget. Moves rows, so component pointers are invalidated.
+		// Pools with pending removals are skipped until Flush().
+		// Returns true when every pool is compacted.
+		bool Defragment(std::chrono::microseconds budget)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "Defragment", "Phase");
+			auto deadline = std::chrono::steady_clock::now() + budget;
+			bool done = true;
+			for (auto& pool : Pools) {
+				if (!pool.second->Defragment(deadline))
+					done = false;
+				if (std::chrono::steady_clock::now() >= deadline)
+					return false;
+			}
+			return done;
+		}
+
+		// Call between frames on the thread which runs the systems.
+		// Component pointers acquired before the snapshot must not be written after it.
+		WorldSnapshot Snapshot()
+		{
+			std::vector<impl::IPoolSnapshot*> pools;
+			pools.reserve(Pools.size());
 			for (auto& pool : Pools) {
-				pool.second->RunEvents();
+				pools.push_back(pool.second->CreateSnapshot());
 			}
+			return WorldSnapshot(std::move(pools));
+		}
+
+		// Reorders the rows of the pool by keyFn(const ComponentTypes&...), e.g. a Morton code of the position,
+		// so the entities close in key are close in memory. Moves rows, so component pointers are invalidated.
+		// maxChunkPairs == 0 sorts the whole pool at once. Otherwise the sort is spread over calls,
+		// merging up to maxChunkPairs adjacent chunk pairs per call.
+		// Returns true when the pool is sorted. Returns false while the pool has pending removals (call Flush() first).
+		template<typename ... ComponentTypes, typename KeyFn>
+		bool SortPool(KeyFn keyFn, uint32_t maxChunkPairs = 0)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "SortPool", "Phase");
+			uint64_t poolHash = 0;
+			impl::ComponentsHash<0, ComponentTypes...>(poolHash);
+			auto it = Pools.find(poolHash);
+			if (it == Pools.end())
+				return false;
+			return ((impl::ArchetypePool<ComponentTypes...>*)it->second)->Sort(keyFn, maxChunkPairs);
 		}
 
-		void Flush()
+		// Writes every pool to an image which OpenImage() maps back without deserializing the chunks.
+		// Flushes first. Returns false if a pool with entities has cold components or components which are
+		// not trivially copyable, or if the file can't be written. Sparse components, events and prefabs are not saved.
+		bool SaveImage(const char* path);
+
+		// Maps an image written by SaveImage() and links its chunks into the pools, which must be added with AddPool()
+		// and still be empty. Chunks are paged in when first read. Writes stay in memory and the file is not modified.
+		// Only the entity index is read. The mapping lives as long as this DOECS, so release snapshots first
+		// and don't MergeInto() another DOECS. Returns false if the file isn't an image of these pools.
+		bool OpenImage(const char* path);
+
+		// Calls fn(poolHash, pool) for every pool which has the component.
+		template<typename Fn>
+		void ForEachPoolWith(uint64_t componentHash, Fn&& fn)
 		{
 			for (auto& pool : Pools) {
-				pool.second->Flush();
+				if (pool.second->HasComponent(componentHash))
+					fn(pool.first, pool.second);
 			}
 		}
 
 	private:
+		uint32_t RunPoolEvents(impl::IArchetypePool* pool)
+		{
+			DOECS_PROFILE_SCOPE(poolScope, pool->GetName(), "Events");
+			auto eventCount = pool->RunEvents();
+			DOECS_PROFILE_ADD(poolScope, "events", eventCount);
+			return eventCount;
+		}
+
+		void UpdateObserved(impl::IArchetypePool* pool)
+		{
+			bool observed = false;
+			for (auto observer : Observers) {
+				const uint64_t* hashes = nullptr;
+				auto count = observer->GetComponentHashes(hashes);
+				observed = std::all_of(hashes, hashes + count, [pool](uint64_t hash) { return pool->HasComponent(hash); });
+				if (observed)
+					break;
+			}
+			pool->SetObserved(observed);
+		}
+
+		uint32_t NotifyObservers(impl::IArchetypePool* pool)
+		{
+			DOECS_PROFILE_SCOPE(poolScope, pool->GetName(), "Observers");
+			auto notifiedCount = pool->NotifyObservers(Observers.data(), Observers.size());
+			DOECS_PROFILE_ADD(poolScope, "entities", notifiedCount);
+			return notifiedCount;
+		}
+
+		uint32_t FlushPool(impl::IArchetypePool* pool)
+		{
+			if (!Observers.empty()) {
+				std::lock_guard l(ObserversMutex);
+				NotifyObservers(pool);
+			}
+			DOECS_PROFILE_SCOPE(poolScope, pool->GetName(), "Flush");
+			auto removedCount = pool->Flush();
+			DOECS_PROFILE_ADD(poolScope, "removed", removedCount);
+			return removedCount;
+		}
+
+		// Events then removals of the pools. ErasePendingRemove() is left to the caller.
+		void FlushPools(const std::vector<impl::IArchetypePool*>& pools)
+		{
+			for (auto pool : pools) {
+				RunPoolEvents(pool);
+			}
+			for (auto pool : pools) {
+				FlushPool(pool);
+			}
+		}
+
+		// Queues the removal (nullptr evt) or the event if the pool is being flushed by the async frame.
+		bool DeferForAsyncFrame(impl::IArchetypePool* pool, EntityId entity, IEvent* evt)
+		{
+			if (!AsyncFrame.load(std::memory_order_acquire) || std::find(UntouchedPools.begin(), UntouchedPools.end(), pool) == UntouchedPools.end())
+				return false;
+			std::lock_guard l(DeferredOpsMutex);
+			DeferredOps.push_back({ entity, evt });
+			return true;
+		}
+
+		// Called by FrameHandle::Wait() once the workers are done.
+		// Applies the queued removals and events, runs them, then erases the removed entities.
+		void EndAsyncFrame()
+		{
+			AsyncFrame.store(false, std::memory_order_release);
+			if (!DeferredOps.empty()) {
+				for (auto& op : DeferredOps) {
+					// The entity may be gone by now. The queued event was accepted, so it is deleted here.
+					if (op.second) {
+						if (!PushEvent(op.first, op.second))
+							delete op.second;
+					}
+					else
+						RemoveEntity(op.first);
+				}
+				DeferredOps.clear();
+				FlushPools(UntouchedPools);
+			}
+			ErasePendingRemove();
+		}
+
+		// Erases the entities removed by the pools' Flush(). The entity index and the sparse sets are independent,
+		// so each is one task: task 0 is the entity index, task s + 1 the sparse set s.
+		void ErasePendingRemove(uint32_t threadCount = 1)
+		{
+			FrameArenaScope arenaScope;
+			FrameVector<impl::ISparseSet*> sets;
+			for (auto& set : SparseSets) {
+				sets.push_back(set.second);
+			}
+			auto taskThreadCount = PendingRemove.size() < impl::MinParallelFlushCount ? 1 : threadCount;
+			impl::ParallelFor(taskThreadCount, sets.size() + 1, [this, &sets](std::size_t begin, std::size_t end) {
+				for (auto t = begin; t < end; ++t) {
+					for (auto entity : PendingRemove) {
+						if (t == 0)
+							EntityPoolMap.erase(entity);
+						else
+							sets[t - 1]->Remove(entity);
+					}
+				}
+			});
+			PendingRemove.clear();
+		}
+
+		// Groups the entities by pool and calls fn(pool, requests, requestCount) once per pool.
+		template<typename Fn>
+		void ForEachBatch(const EntityId* entities, std::size_t count, Fn&& fn)
+		{
+			// A world has a few pools. Linear search from the pool of the previous entity.
+			std::vector<std::pair<uint64_t, std::vector<impl::BatchRequest>>> batches;
+			std::size_t last = 0;
+			for (std::size_t i = 0; i < count; ++i) {
+				if (i + impl::BatchPrefetchDistance < count)
+					EntityPoolMap.Prefetch(entities[i + impl::BatchPrefetchDistance]);
+				auto it = EntityPoolMap.find(entities[i]);
+				if (it == EntityPoolMap.end())
+					continue;
+				if (batches.empty() || batches[last].first != it->second) {
+					last = 0;
+					while (last < batches.size() && batches[last].first != it->second)
+						++last;
+					if (last == batches.size())
+						batches.push_back({ it->second, {} });
+				}
+				batches[last].second.push_back({ entities[i], (uint32_t)i });
+			}
+			for (auto& batch : batches) {
+				fn(Pools.find(batch.first)->second, batch.second.data(), (uint32_t)batch.second.size());
+			}
+		}
+
+		std::shared_ptr<const SystemQuery> GetSystemQuery(ISystem* system)
+		{
+			const uint64_t* hashes[3];
+			std::size_t hashCounts[3];
+			hashCounts[0] = system->GetComponentHashes(hashes[0]);
+			hashCounts[1] = system->GetExcludedComponentHashes(hashes[1]);
+			hashCounts[2] = system->GetOptionalComponentHashes(hashes[2]);
+
+			std::lock_guard l(SystemQueriesMutex);
+			auto& query = SystemQueries[system];
+			if (query && std::equal(hashes, hashes + 3, query->Hashes) && std::equal(hashCounts, hashCounts + 3, query->HashCounts))
+				return query;
+
+			// A new query, since a run on another thread may still use the old one.
+			auto built = std::make_shared<SystemQuery>();
+			std::copy(hashes, hashes + 3, built->Hashes);
+			std::copy(hashCounts, hashCounts + 3, built->HashCounts);
+			for (auto& pool : Pools) {
+				std::vector<int32_t> columns;
+				if (pool.second->GetColumns(system, columns))
+					built->Pools.push_back({ pool.second, std::move(columns) });
+			}
+			std::sort(built->Pools.begin(), built->Pools.end(), [](const SystemQuery::Match& a, const SystemQuery::Match& b) {
+				return std::less<impl::IArchetypePool*>()(a.first, b.first);
+			});
+			query = std::move(built);
+			return query;
+		}
+
+		// Calls fn(components, count) with the writable ComponentType array of every non empty chunk
+		// of the pools which have ComponentType and QueryTypes. Returns the number of components visited.
+		template<typename ComponentType, typename ... QueryTypes, typename Fn>
+		uint32_t ForEachColumn(Fn&& fn)
+		{
+			static_assert(!(IsSparseComponent<ComponentType>::value || ... || IsSparseComponent<QueryTypes>::value), "Sparse components are not in the pools.");
+			// One extra slot, so the array is not empty without QueryTypes.
+			const uint64_t queryHashes[] = { typeid(QueryTypes).hash_code()..., 0 };
+			uint32_t visitedCount = 0;
+			std::vector<int32_t> columns(1);
+			for (auto& pool : Pools) {
+				columns[0] = pool.second->FindColumn(typeid(ComponentType).hash_code());
+				if (columns[0] < 0 || !std::all_of(queryHashes, queryHashes + sizeof...(QueryTypes), [&pool](uint64_t hash) { return pool.second->HasComponent(hash); }))
+					continue;
+				visitedCount += pool.second->ForEachChunk(columns, [&fn](uint32_t entityCount, const EntityId*, const ComponentsArg& components) {
+					fn((ComponentType*)components[0], entityCount);
+				});
+			}
+			return visitedCount;
+		}
+
+		SystemCursor GetSystemCursor(ISystem* system)
+		{
+			std::lock_guard l(SystemQueriesMutex);
+			return SystemCursors[system];
+		}
+
+		// Saves the cursor unless the system was removed during the run.
+		void SetSystemCursor(ISystem* system, const SystemCursor& cursor)
+		{
+			std::lock_guard l(SystemQueriesMutex);
+			auto it = SystemCursors.find(system);
+			if (it != SystemCursors.end())
+				it->second = cursor;
+		}
+
+		template<typename ComponentType>
+		impl::SparseSet<ComponentType>* GetSparseSet(bool create)
+		{
+			auto hash = typeid(ComponentType).hash_code();
+			auto it = SparseSets.find(hash);
+			if (it == SparseSets.end()) {
+				if (!create)
+					return nullptr;
+				it = SparseSets.insert({ hash, new impl::SparseSet<ComponentType> }).first;
+			}
+			return (impl::SparseSet<ComponentType>*)it->second;
+		}
+
+		template<typename ... ComponentTypes, typename Fn, std::size_t ... Is>
+		uint32_t ForEachImpl(Fn& fn, std::index_sequence<Is...>)
+		{
+			constexpr bool isSparse[] = { IsSparseComponent<ComponentTypes>::value... };
+			constexpr auto columnOf = impl::GetArchetypeIndices<ComponentTypes...>();
+			constexpr bool hasArchetype = !(IsSparseComponent<ComponentTypes>::value && ...);
+
+			std::tuple<impl::SparseSet<ComponentTypes>*...> sets{ (IsSparseComponent<ComponentTypes>::value ? GetSparseSet<ComponentTypes>(false) : nullptr)... };
+			impl::ISparseSet* driver = nullptr;
+			bool missingSet = false;
+			([&](impl::ISparseSet* set, bool sparse) {
+				if (!sparse)
+					return;
+				if (!set)
+					missingSet = true;
+				else if (!driver || set->GetCount() < driver->GetCount())
+					driver = set;
+			}(std::get<Is>(sets), isSparse[Is]), ...);
+			if (missingSet)
+				return 0;
+
+			uint64_t hashes[] = { typeid(ComponentTypes).hash_code()... };
+			std::vector<std::pair<impl::IArchetypePool*, std::vector<int32_t>>> pools;
+			uint64_t poolEntityCount = 0;
+			if (hasArchetype) {
+				for (auto& pool : Pools) {
+					std::vector<int32_t> columns;
+					bool match = true;
+					for (std::size_t i = 0; i < sizeof...(ComponentTypes) && match; ++i) {
+						if (isSparse[i])
+							continue;
+						columns.push_back(pool.second->FindColumn(hashes[i]));
+						match = columns.back() >= 0;
+					}
+					if (!match)
+						continue;
+					poolEntityCount += pool.second->GetEntityCount();
+					pools.push_back({ pool.second, std::move(columns) });
+				}
+			}
+
+			uint32_t visitedCount = 0;
+			if (driver && (!hasArchetype || driver->GetCount() < poolEntityCount)) {
+				auto entities = driver->GetEntities();
+				auto count = driver->GetCount();
+				for (uint32_t i = 0; i < count; ++i) {
+					auto entity = entities[i];
+					impl::IArchetypePool* pool = hasArchetype ? GetPoolForEntity(entity) : nullptr;
+					if (hasArchetype && !pool)
+						continue;
+					std::tuple<ComponentTypes*...> components{ (isSparse[Is]
+						? (ComponentTypes*)GetSparseComponent(std::get<Is>(sets), entity)
+						: (ComponentTypes*)pool->GetComponent(entity, hashes[Is]))... };
+					if (((std::get<Is>(components) == nullptr) || ...))
+						continue;
+					fn(entity, *std::get<Is>(components)...);
+					++visitedCount;
+				}
+				return visitedCount;
+			}
+
+			for (auto& match : pools) {
+				match.first->ForEachChunk(match.second, [&](uint32_t count, const EntityId* entities, const ComponentsArg& columns) {
+					for (uint32_t row = 0; row < count; ++row) {
+						std::tuple<ComponentTypes*...> components{ (isSparse[Is]
+							? (ComponentTypes*)GetSparseComponent(std::get<Is>(sets), entities[row])
+							: (ComponentTypes*)columns[columnOf[Is]] + row)... };
+						if (((std::get<Is>(components) == nullptr) || ...))
+							continue;
+						fn(entities[row], *std::get<Is>(components)...);
+						++visitedCount;
+					}
+				});
+			}
+			return visitedCount;
+		}
+
+		template<typename ComponentType>
+		static ComponentType* GetSparseComponent(impl::SparseSet<ComponentType>* set, EntityId entity)
+		{
+			if constexpr (IsSparseComponent<ComponentType>::value)
+				return set->Find(entity);
+			return nullptr;
+		}
+
 		impl::IArchetypePool* GetPoolForEntity(EntityId entId) {
 			auto it = EntityPoolMap.find(entId);
 			if (it != EntityPoolMap.end()) {
@@ -0,0 +1,209 @@
+#pragma once
+// Fastbird Engine
+// Written by Jungwan Byun
+// https://fastbirddev.blogspot.com
+
+#include "doecs2.h"
+#include <tuple>
+#include <vector>
+#include <unordered_map>
+
+namespace de2
+{
+	//
+	// TransformHierarchy
+	//
+	// Parent/child relations between entities, kept sorted by depth.
+	// Propagate() computes the world transform of every node level by level:
+	// each level is a contiguous range whose parents are all in the previous levels,
+	// so a level is a linear sweep and can be split across threads.
+	//
+	// WorldType is the combined transform. LocalComponentTypes are the components read from each entity.
+	// e.g. TransformHierarchy<FWorldTransform, FPositionComponent, FRotationComponent>
+	template<typename WorldType, typename ... LocalComponentTypes>
+	class TransformHierarchy
+	{
+	public:
+		static constexpr uint32_t InvalidIndex = (uint32_t)-1;
+		// Levels smaller than this are not split across threads.
+		static constexpr std::size_t MinParallelLevelSize = 1024;
+
+	private:
+		std::unordered_map<EntityId, EntityId> ParentOf;
+		std::unordered_map<EntityId, std::vector<EntityId>> ChildrenOf;
+
+		// Sorted by depth. Children of the same parent are contiguous and in the order of their parents.
+		std::vector<EntityId> Entities;
+		std::vector<uint32_t> Parents;
+		std::vector<uint32_t> LevelBegin;
+		// One array per local component, in the order of Entities.
+		std::tuple<std::vector<LocalComponentTypes>...> LocalTransforms;
+		std::vector<WorldType> WorldTransforms;
+		std::unordered_map<EntityId, uint32_t> NodeIndex;
+		bool Dirty = false;
+
+	public:
+		// parent == INVALID_ENTITY_ID detaches the child.
+		// Returns false if the relation would create a cycle.
+		bool SetParent(EntityId child, EntityId parent)
+		{
+			if (parent == INVALID_ENTITY_ID) {
+				Detach(child);
+				return true;
+			}
+
+			for (auto ancestor = parent; ancestor != INVALID_ENTITY_ID; ancestor = GetParent(ancestor)) {
+				if (ancestor == child)
+					return false;
+			}
+			Detach(child);
+			ParentOf[child] = parent;
+			ChildrenOf[parent].push_back(child);
+			Dirty = true;
+			return true;
+		}
+
+		EntityId GetParent(EntityId child) const
+		{
+			auto it = ParentOf.find(child);
+			return it != ParentOf.end() ? it->second : INVALID_ENTITY_ID;
+		}
+
+		// Removes the entity from the hierarchy. Its children become roots.
+		void RemoveEntity(EntityId entity)
+		{
+			Detach(entity);
+			auto it = ChildrenOf.find(entity);
+			if (it == ChildrenOf.end())
+				return;
+			for (auto child : it->second) {
+				ParentOf.erase(child);
+			}
+			ChildrenOf.erase(it);
+			Dirty = true;
+		}
+
+		uint32_t GetDepthCount()
+		{
+			Rebuild();
+			return LevelBegin.empty() ? 0 : (uint32_t)LevelBegin.size() - 1;
+		}
+
+		// Computes the world transforms.
+		// combine(parentWorld, locals...) returns the world transform of a node. Roots are combined with rootWorld.
+		// Entities missing one of the local components use value initialized components.
+		// The local components are read with one DOECS::Gather() per component, without marking the chunks written.
+		template<typename CombineFn>
+		void Propagate(DOECS& ecs, const WorldType& rootWorld, CombineFn combine, uint32_t threadCount = 1)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "TransformHierarchy", "System");
+			Rebuild();
+			DOECS_PROFILE_ADD(profileScope, "entities", Entities.size());
+			GatherLocals(ecs, std::index_sequence_for<LocalComponentTypes...>{});
+
+			for (std::size_t level = 0; level + 1 < LevelBegin.size(); ++level) {
+				auto begin = LevelBegin[level];
+				auto count = LevelBegin[level + 1] - begin;
+				auto sweep = [&, begin](std::size_t b, std::size_t e) {
+					Sweep(rootWorld, combine, begin + b, begin + e, std::index_sequence_for<LocalComponentTypes...>{});
+				};
+				impl::ParallelFor(count >= MinParallelLevelSize ? threadCount : 1, count, sweep);
+			}
+		}
+
+		// Valid after Propagate().
+		const WorldType* GetWorld(EntityId entity) const
+		{
+			auto it = NodeIndex.find(entity);
+			if (it == NodeIndex.end() || it->second >= WorldTransforms.size())
+				return nullptr;
+			return &WorldTransforms[it->second];
+		}
+
+		// Entities and their world transforms in depth order.
+		std::size_t GetWorlds(const EntityId*& entities, const WorldType*& worlds) const
+		{
+			entities = Entities.data();
+			worlds = WorldTransforms.data();
+			return WorldTransforms.size();
+		}
+
+	private:
+		// Removes the entity from the children of its parent.
+		void Detach(EntityId child)
+		{
+			auto it = ParentOf.find(child);
+			if (it == ParentOf.end())
+				return;
+			auto siblings = ChildrenOf.find(it->second);
+			siblings->second.erase(std::find(siblings->second.begin(), siblings->second.end(), child));
+			if (siblings->second.empty())
+				ChildrenOf.erase(siblings);
+			ParentOf.erase(it);
+			Dirty = true;
+		}
+
+		// Entities missing a component keep the value initialized one.
+		template<std::size_t ... Is>
+		void GatherLocals(DOECS& ecs, std::index_sequence<Is...>)
+		{
+			(std::get<Is>(LocalTransforms).assign(Entities.size(), LocalComponentTypes{}), ...);
+			(ecs.Gather(Entities.data(), Entities.size(), std::get<Is>(LocalTransforms).data()), ...);
+		}
+
+		template<typename CombineFn, std::size_t ... Is>
+		void Sweep(const WorldType& rootWorld, CombineFn& combine, std::size_t begin, std::size_t end, std::index_sequence<Is...>)
+		{
+			for (auto i = begin; i < end; ++i) {
+				const WorldType& parentWorld = Parents[i] == InvalidIndex ? rootWorld : WorldTransforms[Parents[i]];
+				WorldTransforms[i] = combine(parentWorld, std::get<Is>(LocalTransforms)[i]...);
+			}
+		}
+
+		void Rebuild()
+		{
+			if (!Dirty)
+				return;
+			Dirty = false;
+
+			std::vector<EntityId> roots;
+			for (auto& it : ChildrenOf) {
+				if (ParentOf.find(it.first) == ParentOf.end())
+					roots.push_back(it.first);
+				std::sort(it.second.begin(), it.second.end());
+			}
+			std::sort(roots.begin(), roots.end());
+
+			Entities.clear();
+			Parents.clear();
+			LevelBegin.clear();
+			NodeIndex.clear();
+			for (auto root : roots) {
+				NodeIndex[root] = (uint32_t)Entities.size();
+				Entities.push_back(root);
+				Parents.push_back(InvalidIndex);
+			}
+
+			// Breadth first. A level is appended in the order of the parents in the previous level.
+			std::size_t levelBegin = 0;
+			while (levelBegin < Entities.size()) {
+				LevelBegin.push_back((uint32_t)levelBegin);
+				std::size_t levelEnd = Entities.size();
+				for (auto parentIndex = levelBegin; parentIndex < levelEnd; ++parentIndex) {
+					auto it = ChildrenOf.find(Entities[parentIndex]);
+					if (it == ChildrenOf.end())
+						continue;
+					for (auto child : it->second) {
+						NodeIndex[child] = (uint32_t)Entities.size();
+						Entities.push_back(child);
+						Parents.push_back((uint32_t)parentIndex);
+					}
+				}
+				levelBegin = levelEnd;
+			}
+			LevelBegin.push_back((uint32_t)Entities.size());
+
+			WorldTransforms.resize(Entities.size());
+		}
+	};
+}
@@ -0,0 +1,237 @@
+#pragma once
+// Fastbird Engine
+// Written by Jungwan Byun
+// https://fastbirddev.blogspot.com
+
+#include "doecs2.h"
+#include <cmath>
+#include <map>
+#include <vector>
+#include <unordered_map>
+
+namespace de2
+{
+	//
+	// SpatialHit
+	//
+	// Chunk and row are valid until the next write to the pool.
+	struct SpatialHit
+	{
+		EntityId Entity;
+		uint64_t PoolHash;
+		uint32_t ChunkIndex;
+		uint32_t Row;
+	};
+
+	//
+	// SpatialGrid
+	//
+	// Uniform hash grid over a position component with x, y and z members.
+	// Update() re-inserts only the chunks whose position column was written since the previous Update(),
+	// so a frame which moves a few chunks costs a few chunks.
+	// Writes through GetComponent, SetComponent, systems and events are tracked.
+	// Pointers kept from before Update() and written after it are not.
+	//
+	// Queries are batched. The results of query i are in [resultOffsets[i], resultOffsets[i + 1]).
+	// e.g. SpatialGrid<FPositionComponent> grid(10.f);
+	template<typename PositionType>
+	class SpatialGrid
+	{
+		struct Entry
+		{
+			float X, Y, Z;
+			SpatialHit Hit;
+		};
+
+		using ChunkKey = std::pair<uint64_t, uint32_t>; // pool hash, chunk index
+
+		float CellSize;
+		float InvCellSize;
+		std::unordered_map<uint64_t, std::vector<Entry>> Cells;
+		// Cell of each row of the indexed chunks. Used to remove the rows when the chunk changes.
+		std::map<ChunkKey, std::vector<std::pair<EntityId, uint64_t>>> ChunkCells;
+		// Epoch to pass to GetChangedChunks() per pool.
+		std::unordered_map<uint64_t, uint64_t> PoolEpochs;
+		std::vector<impl::ChangedChunk> Changed;
+		std::size_t EntryCount = 0;
+
+	public:
+		SpatialGrid(float cellSize)
+			: CellSize(cellSize)
+			, InvCellSize(1.f / cellSize)
+		{
+			assert(cellSize > 0.f);
+		}
+
+		float GetCellSize() const
+		{
+			return CellSize;
+		}
+
+		std::size_t GetEntityCount() const
+		{
+			return EntryCount;
+		}
+
+		// Returns the number of chunks re-indexed.
+		uint32_t Update(DOECS& ecs)
+		{
+			DOECS_PROFILE_SCOPE(profileScope, "SpatialGrid", "System");
+			uint32_t updatedChunkCount = 0;
+			ecs.ForEachPoolWith(typeid(PositionType).hash_code(), [&](uint64_t poolHash, impl::IArchetypePool* pool) {
+				auto& epoch = PoolEpochs[poolHash];
+				uint32_t chunkCount = 0;
+				Changed.clear();
+				epoch = pool->GetChangedChunks(typeid(PositionType).hash_code(), epoch, Changed, chunkCount);
+
+				// Chunks released by Defragment().
+				for (auto it = ChunkCells.lower_bound({ poolHash, chunkCount }); it != ChunkCells.end() && it->first.first == poolHash;) {
+					RemoveRows(it->second);
+					it = ChunkCells.erase(it);
+				}
+
+				// Remove every changed chunk first. Defragment() moves rows between chunks.
+				for (auto& chunk : Changed) {
+					RemoveRows(ChunkCells[{ poolHash, chunk.ChunkIndex }]);
+				}
+				for (auto& chunk : Changed) {
+					auto& rows = ChunkCells[{ poolHash, chunk.ChunkIndex }];
+					auto positions = (const PositionType*)chunk.Components;
+					for (uint32_t row = 0; row < chunk.Count; ++row) {
+						auto& pos = positions[row];
+						auto cellKey = GetCellKey(GetCell(pos.x), GetCell(pos.y), GetCell(pos.z));
+						Cells[cellKey].push_back({ pos.x, pos.y, pos.z, { chunk.Entities[row], poolHash, chunk.ChunkIndex, row } });
+						rows.push_back({ chunk.Entities[row], cellKey });
+					}
+					EntryCount += chunk.Count;
+				}
+				updatedChunkCount += (uint32_t)Changed.size();
+			});
+			DOECS_PROFILE_ADD(profileScope, "chunks", updatedChunkCount);
+			return updatedChunkCount;
+		}
+
+		void Clear()
+		{
+			Cells.clear();
+			ChunkCells.clear();
+			PoolEpochs.clear();
+			EntryCount = 0;
+		}
+
+		// Entities within radii[i] of centers[i].
+		template<typename ResultType>
+		void QueryRadius(const PositionType* centers, const float* radii, std::size_t queryCount,
+			std::vector<uint32_t>& resultOffsets, std::vector<ResultType>& results) const
+		{
+			resultOffsets.resize(queryCount + 1);
+			results.clear();
+			for (std::size_t q = 0; q < queryCount; ++q) {
+				resultOffsets[q] = (uint32_t)results.size();
+				auto& c = centers[q];
+				float r = radii[q];
+				float rr = r * r;
+				ForEachInBox(c.x - r, c.y - r, c.z - r, c.x + r, c.y + r, c.z + r, [&](const Entry& entry) {
+					float dx = entry.X - c.x, dy = entry.Y - c.y, dz = entry.Z - c.z;
+					if (dx * dx + dy * dy + dz * dz <= rr)
+						results.push_back(ToResult<ResultType>(entry));
+				});
+			}
+			resultOffsets[queryCount] = (uint32_t)results.size();
+		}
+
+		// Entities inside the boxes [mins[i], maxs[i]].
+		template<typename ResultType>
+		void QueryBox(const PositionType* mins, const PositionType* maxs, std::size_t queryCount,
+			std::vector<uint32_t>& resultOffsets, std::vector<ResultType>& results) const
+		{
+			resultOffsets.resize(queryCount + 1);
+			results.clear();
+			for (std::size_t q = 0; q < queryCount; ++q) {
+				resultOffsets[q] = (uint32_t)results.size();
+				auto& lo = mins[q];
+				auto& hi = maxs[q];
+				ForEachInBox(lo.x, lo.y, lo.z, hi.x, hi.y, hi.z, [&](const Entry& entry) {
+					if (entry.X >= lo.x && entry.Y >= lo.y && entry.Z >= lo.z &&
+						entry.X <= hi.x && entry.Y <= hi.y && entry.Z <= hi.z)
+						results.push_back(ToResult<ResultType>(entry));
+				});
+			}
+			resultOffsets[queryCount] = (uint32_t)results.size();
+		}
+
+	private:
+		int32_t GetCell(float v) const
+		{
+			return (int32_t)std::floor(v * InvCellSize);
+		}
+
+		// 21 bits per axis.
+		static uint64_t GetCellKey(int32_t x, int32_t y, int32_t z)
+		{
+			constexpr uint64_t Mask = (1ull << 21) - 1;
+			return ((uint64_t)x & Mask) | (((uint64_t)y & Mask) << 21) | (((uint64_t)z & Mask) << 42);
+		}
+
+		template<typename ResultType>
+		static std::enable_if_t<std::is_same_v<ResultType, EntityId>, EntityId> ToResult(const Entry& entry)
+		{
+			return entry.Hit.Entity;
+		}
+
+		template<typename ResultType>
+		static std::enable_if_t<std::is_same_v<ResultType, SpatialHit>, const SpatialHit&> ToResult(const Entry& entry)
+		{
+			return entry.Hit;
+		}
+
+		void RemoveRows(std::vector<std::pair<EntityId, uint64_t>>& rows)
+		{
+			for (auto& row : rows) {
+				auto it = Cells.find(row.second);
+				assert(it != Cells.end());
+				auto& entries = it->second;
+				for (std::size_t i = 0; i < entries.size(); ++i) {
+					if (entries[i].Hit.Entity == row.first) {
+						entries[i] = entries.back();
+						entries.pop_back();
+						break;
+					}
+				}
+				if (entries.empty())
+					Cells.erase(it);
+			}
+			EntryCount -= rows.size();
+			rows.clear();
+		}
+
+		template<typename Fn>
+		void ForEachInBox(float minX, float minY, float minZ, float maxX, float maxY, float maxZ, Fn&& fn) const
+		{
+			int32_t x0 = GetCell(minX), y0 = GetCell(minY), z0 = GetCell(minZ);
+			int32_t x1 = GetCell(maxX), y1 = GetCell(maxY), z1 = GetCell(maxZ);
+			double boxCellCount = (double)(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1);
+			if (boxCellCount >= (double)Cells.size()) {
+				// Cheaper to visit the occupied cells.
+				for (auto& cell : Cells) {
+					for (auto& entry : cell.second) {
+						fn(entry);
+					}
+				}
+				return;
+			}
+			for (auto z = z0; z <= z1; ++z) {
+				for (auto y = y0; y <= y1; ++y) {
+					for (auto x = x0; x <= x1; ++x) {
+						auto it = Cells.find(GetCellKey(x, y, z));
+						if (it == Cells.end())
+							continue;
+						for (auto& entry : it->second) {
+							fn(entry);
+						}
+					}
+				}
+			}
+		}
+	};
+}
@@ -0,0 +1,350 @@
+#pragma once
+#ifndef __doecs_profile_header__
+#define __doecs_profile_header__
+// Fastbird Engine
+// Written by Jungwan Byun
+// https://fastbirddev.blogspot.com
+
+// Define DOECS_PROFILE 1 to record the time spent in RunSystem, RunEvents and Flush.
+// With DOECS_PROFILE 0 (default) the hooks compile to nothing.
+#ifndef DOECS_PROFILE
+#define DOECS_PROFILE 0
+#endif
+
+#if DOECS_PROFILE
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <map>
+#include <unordered_set>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <stdint.h>
+
+#define DOECS_PROFILE_SCOPE(var, name, category) ::de2::ProfileScope var(name, category)
+#define DOECS_PROFILE_ADD(var, key, value) var.AddArg(key, (uint64_t)(value))
+
+namespace de2
+{
+	struct ProfileStats
+	{
+		// Durations in microseconds over the last RollingWindow samples.
+		uint32_t SampleCount = 0;
+		double Min = 0.0;
+		double P50 = 0.0;
+		double P90 = 0.0;
+		double P99 = 0.0;
+		double Max = 0.0;
+	};
+
+	class Profiler
+	{
+	public:
+		static constexpr uint32_t MaxArgs = 4;
+		static constexpr uint32_t RollingWindow = 256;
+
+		struct Arg
+		{
+			const char* Key;
+			uint64_t Value;
+		};
+
+	private:
+		struct TraceEvent
+		{
+			const char* Name;
+			const char* Category;
+			uint32_t ThreadIndex;
+			int64_t StartNs;
+			int64_t DurationNs;
+			Arg Args[MaxArgs];
+			uint32_t ArgCount;
+		};
+
+		struct RollingSamples
+		{
+			int64_t Samples[RollingWindow];
+			uint32_t Count = 0;
+			uint32_t Next = 0;
+		};
+
+		// Events and samples of one thread. Only that thread records into it, so its lock is contended only by the reports,
+		// which merge the buffers. Reused by a later thread when the thread exits.
+		struct ThreadBuffer
+		{
+			std::mutex Mutex;
+			uint32_t ThreadIndex = 0;
+			std::atomic<bool> InUse{ true };
+			// Ring buffer of the latest trace events.
+			std::vector<TraceEvent> Events;
+			std::size_t NextEvent = 0;
+			std::size_t MaxEvents = 0;
+			std::unordered_set<std::string> Names;
+			// Keyed by (category, name), interned in Names.
+			std::map<std::pair<const char*, const char*>, RollingSamples> Stats;
+
+			const char* Intern(const char* name)
+			{
+				return Names.insert(name ? name : "").first->c_str();
+			}
+
+			// nullptr if the thread never recorded the name.
+			const char* Find(const char* name) const
+			{
+				auto it = Names.find(name ? name : "");
+				return it == Names.end() ? nullptr : it->c_str();
+			}
+
+			void Clear()
+			{
+				Events.clear();
+				NextEvent = 0;
+				Stats.clear();
+			}
+		};
+
+		// Releases the buffer of the thread when it exits.
+		struct ThreadLease
+		{
+			std::shared_ptr<ThreadBuffer> Buffer;
+
+			~ThreadLease()
+			{
+				if (Buffer)
+					Buffer->InUse = false;
+			}
+		};
+
+		// Guards Buffers and MaxEvents.
+		std::mutex Mutex;
+		std::chrono::steady_clock::time_point Origin = std::chrono::steady_clock::now();
+		std::vector<std::shared_ptr<ThreadBuffer>> Buffers;
+		std::size_t MaxEvents = 64 * 1024;
+
+		ThreadBuffer& GetThreadBuffer()
+		{
+			thread_local ThreadLease Lease;
+			if (!Lease.Buffer) {
+				std::lock_guard l(Mutex);
+				for (auto& buffer : Buffers) {
+					bool inUse = false;
+					if (buffer->InUse.compare_exchange_strong(inUse, true)) {
+						Lease.Buffer = buffer;
+						break;
+					}
+				}
+				if (!Lease.Buffer) {
+					Lease.Buffer = std::make_shared<ThreadBuffer>();
+					Lease.Buffer->ThreadIndex = (uint32_t)Buffers.size();
+					Lease.Buffer->MaxEvents = MaxEvents;
+					Buffers.push_back(Lease.Buffer);
+				}
+			}
+			return *Lease.Buffer;
+		}
+
+		// Calls fn(buffer) for every thread buffer, under its lock.
+		template<typename Fn>
+		void ForEachBuffer(Fn&& fn)
+		{
+			std::lock_guard l(Mutex);
+			for (auto& buffer : Buffers) {
+				std::lock_guard bufferLock(buffer->Mutex);
+				fn(*buffer);
+			}
+		}
+
+		static void WriteEscaped(FILE* file, const char* s)
+		{
+			for (; *s; ++s) {
+				if (*s == '"' || *s == '\\')
+					fputc('\\', file);
+				fputc(*s, file);
+			}
+		}
+
+	public:
+		static Profiler& Get()
+		{
+			static Profiler Instance;
+			return Instance;
+		}
+
+		int64_t Now() const
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - Origin).count();
+		}
+
+		// Trace events kept per thread.
+		void SetMaxTraceEvents(std::size_t maxEvents)
+		{
+			std::lock_guard l(Mutex);
+			MaxEvents = std::max<std::size_t>(1, maxEvents);
+			for (auto& buffer : Buffers) {
+				std::lock_guard bufferLock(buffer->Mutex);
+				buffer->MaxEvents = MaxEvents;
+				buffer->Events.clear();
+				buffer->NextEvent = 0;
+			}
+		}
+
+		void Record(const char* name, const char* category, int64_t startNs, int64_t durationNs, const Arg* args, uint32_t argCount)
+		{
+			auto& buffer = GetThreadBuffer();
+			std::lock_guard l(buffer.Mutex);
+			TraceEvent evt;
+			evt.Name = buffer.Intern(name);
+			evt.Category = buffer.Intern(category);
+			evt.ThreadIndex = buffer.ThreadIndex;
+			evt.StartNs = startNs;
+			evt.DurationNs = durationNs;
+			evt.ArgCount = std::min(argCount, MaxArgs);
+			std::copy(args, args + evt.ArgCount, evt.Args);
+			if (buffer.Events.size() < buffer.MaxEvents) {
+				buffer.Events.push_back(evt);
+			}
+			else {
+				buffer.Events[buffer.NextEvent] = evt;
+			}
+			buffer.NextEvent = (buffer.NextEvent + 1) % buffer.MaxEvents;
+
+			auto& samples = buffer.Stats[{ evt.Category, evt.Name }];
+			samples.Samples[samples.Next] = durationNs;
+			samples.Next = (samples.Next + 1) % RollingWindow;
+			samples.Count = std::min(samples.Count + 1, RollingWindow);
+		}
+
+		// Over the last RollingWindow samples of each thread.
+		ProfileStats GetStats(const char* category, const char* name)
+		{
+			std::vector<int64_t> sorted;
+			ForEachBuffer([&](ThreadBuffer& buffer) {
+				auto it = buffer.Stats.find({ buffer.Find(category), buffer.Find(name) });
+				if (it != buffer.Stats.end())
+					sorted.insert(sorted.end(), it->second.Samples, it->second.Samples + it->second.Count);
+			});
+			ProfileStats stats;
+			if (sorted.empty())
+				return stats;
+
+			std::sort(sorted.begin(), sorted.end());
+			auto percentile = [&sorted](double p) {
+				return sorted[std::min(sorted.size() - 1, (std::size_t)(p * (sorted.size() - 1) + 0.5))] / 1000.0;
+			};
+			stats.SampleCount = (uint32_t)sorted.size();
+			stats.Min = sorted.front() / 1000.0;
+			stats.P50 = percentile(0.5);
+			stats.P90 = percentile(0.9);
+			stats.P99 = percentile(0.99);
+			stats.Max = sorted.back() / 1000.0;
+			return stats;
+		}
+
+		// (category, name) of every scope recorded so far.
+		std::vector<std::pair<std::string, std::string>> GetScopeNames()
+		{
+			std::vector<std::pair<std::string, std::string>> names;
+			ForEachBuffer([&names](ThreadBuffer& buffer) {
+				for (auto& it : buffer.Stats) {
+					names.push_back({ it.first.first, it.first.second });
+				}
+			});
+			std::sort(names.begin(), names.end());
+			names.erase(std::unique(names.begin(), names.end()), names.end());
+			return names;
+		}
+
+		// Writes the buffered events of every thread in the Chrome trace event format, by start time.
+		// Open the file with chrome://tracing or https://ui.perfetto.dev
+		bool WriteChromeTrace(const char* path)
+		{
+			// The names stay valid after the locks are released. Buffers are never freed and their names never cleared.
+			std::vector<TraceEvent> events;
+			ForEachBuffer([&events](ThreadBuffer& buffer) {
+				events.insert(events.end(), buffer.Events.begin(), buffer.Events.end());
+			});
+			std::stable_sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) {
+				return a.StartNs < b.StartNs;
+			});
+
+			FILE* file = fopen(path, "w");
+			if (!file)
+				return false;
+
+			fputs("{\"traceEvents\":[\n", file);
+			for (std::size_t i = 0; i < events.size(); ++i) {
+				auto& evt = events[i];
+				fputs(i == 0 ? "{\"name\":\"" : ",\n{\"name\":\"", file);
+				WriteEscaped(file, evt.Name);
+				fputs("\",\"cat\":\"", file);
+				WriteEscaped(file, evt.Category);
+				fprintf(file, "\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+					evt.ThreadIndex, evt.StartNs / 1000.0, evt.DurationNs / 1000.0);
+				for (uint32_t a = 0; a < evt.ArgCount; ++a) {
+					fputs(a == 0 ? "\"" : ",\"", file);
+					WriteEscaped(file, evt.Args[a].Key);
+					fprintf(file, "\":%llu", (unsigned long long)evt.Args[a].Value);
+				}
+				fputs("}}", file);
+			}
+			fputs("\n]}\n", file);
+			return fclose(file) == 0;
+		}
+
+		void Clear()
+		{
+			ForEachBuffer([](ThreadBuffer& buffer) {
+				buffer.Clear();
+			});
+		}
+	};
+
+	class ProfileScope
+	{
+		const char* Name;
+		const char* Category;
+		int64_t Start;
+		Profiler::Arg Args[Profiler::MaxArgs];
+		uint32_t ArgCount = 0;
+
+	public:
+		ProfileScope(const char* name, const char* category)
+			: Name(name)
+			, Category(category)
+			, Start(Profiler::Get().Now())
+		{
+		}
+
+		ProfileScope(const ProfileScope&) = delete;
+		ProfileScope& operator=(const ProfileScope&) = delete;
+
+		~ProfileScope()
+		{
+			auto& profiler = Profiler::Get();
+			profiler.Record(Name, Category, Start, profiler.Now() - Start, Args, ArgCount);
+		}
+
+		// Accumulates value into the argument with the same key.
+		void AddArg(const char* key, uint64_t value)
+		{
+			for (uint32_t i = 0; i < ArgCount; ++i) {
+				if (Args[i].Key == key) {
+					Args[i].Value += value;
+					return;
+				}
+			}
+			if (ArgCount < Profiler::MaxArgs)
+				Args[ArgCount++] = { key, value };
+		}
+	};
+}
+
+#else
+#define DOECS_PROFILE_SCOPE(var, name, category)
+#define DOECS_PROFILE_ADD(var, key, value)
+#endif // DOECS_PROFILE
+
+#endif // __doecs_profile_header__
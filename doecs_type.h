@@ -7,6 +7,7 @@
 
 #include <stdint.h>
 #include <unordered_map>
+#include <vector>
 namespace de
 {
 	using EntityId = uint64_t;